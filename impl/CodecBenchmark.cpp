@@ -0,0 +1,126 @@
+#include <G3D/G3D.h>
+#include "../src/DistributedRenderer.h"
+
+using namespace std;
+using namespace DistributedRenderer;
+using namespace G3D;
+
+// Runs a sequence of captured frames through every frame codec, in order so
+// temporal codecs see real frame to frame changes, and reports encode and
+// decode throughput, compression ratio and whether the round trip is exact.
+//
+// A walkthrough recorded by a remote (Constants::RECORD_WALKTHROUGH_DIR) has
+// a .motion file next to every frame, the MOTION codec is fed those vectors
+// the way the remote feeds it the G-buffer's. Compare it against JPEG at the
+// same -q to see what the engine's motion buys over coding every frame alone.
+//
+// usage: CodecBenchmark [-n iterations] [-q quality] frame0.png frame1.png ...
+
+int main(int argc, const char* argv[]){
+
+	initG3D();
+
+	int iterations = 10;
+	int quality = 100;
+	Array<shared_ptr<PixelTransferBuffer>> frames;
+	Array<Array<float>> motion;
+
+	for (int i = 1; i < argc; i++) {
+		if (String(argv[i]) == "-n" && i + 1 < argc) {
+			iterations = atoi(argv[++i]);
+			continue;
+		}
+		if (String(argv[i]) == "-q" && i + 1 < argc) {
+			quality = atoi(argv[++i]);
+			continue;
+		}
+
+		shared_ptr<Image> image = Image::fromFile(argv[i]);
+		image->convertToRGB8();
+		frames.append(image->toPixelTransferBuffer());
+
+		// motion recorded alongside the frame, if there is any
+		motion.next();
+		const String motion_file = FilePath::base(argv[i]) + ".motion";
+		const String path = FilePath::concat(FilePath::parent(argv[i]), motion_file);
+		if (FileSystem::exists(path)) {
+			int w, h;
+			MotionPrediction::loadMotion(path, motion.last(), w, h);
+			if (w != image->width() || h != image->height()) motion.last().clear();
+		}
+	}
+
+	if (frames.size() == 0) {
+		cout << "usage: CodecBenchmark [-n iterations] [-q quality] frame0.png frame1.png ..." << endl;
+		return 1;
+	}
+
+	size_t raw_bytes = 0;
+	for (int f = 0; f < frames.size(); f++) raw_bytes += frames[f]->width() * frames[f]->height() * FrameCodec::BYTES_PER_PIXEL;
+
+	cout << frames.size() << " frames, " << iterations << " iterations, quality " << quality << ", " << raw_bytes / 1024 << " KB raw per pass" << endl << endl;
+	printf("%-12s %8s %12s %12s %12s %6s\n", "codec", "ratio", "KB/frame", "enc MB/s", "dec MB/s", "exact");
+
+	for (int id = 0; id < NUM_CODECS; id++) {
+		shared_ptr<FrameCodec> encoder = FrameCodec::create((CodecID)id, Constants::KEYFRAME_INTERVAL);
+		shared_ptr<FrameCodec> decoder = FrameCodec::create((CodecID)id, Constants::KEYFRAME_INTERVAL);
+		encoder->setQuality(quality);
+
+		// one decode target per frame size, decoded frames patch the last one like the router's do
+		shared_ptr<CPUPixelTransferBuffer> decoded;
+
+		RealTime encode_time = 0;
+		RealTime decode_time = 0;
+		size_t encoded_bytes = 0;
+		bool exact = true;
+
+		for (int it = 0; it < iterations; it++) {
+			for (int f = 0; f < frames.size(); f++) {
+				const shared_ptr<PixelTransferBuffer>& frame = frames[f];
+				const int w = frame->width();
+				const int h = frame->height();
+
+				if (isNull(decoded) || decoded->width() != w || decoded->height() != h) {
+					decoded = CPUPixelTransferBuffer::create(w, h, ImageFormat::RGB8());
+					encoder->reset();
+				}
+
+				const uint8* pixels = (const uint8*)frame->mapRead();
+
+				if (motion[f].size() > 0) encoder->setMotion(motion[f].getCArray(), w * 2);
+
+				BinaryOutput bo("<memory>", G3D_LITTLE_ENDIAN);
+				RealTime start = System::time();
+				encoder->encode(pixels, w, h, frame->stride(), bo);
+				encode_time += System::time() - start;
+				encoded_bytes += (size_t)bo.length();
+
+				BinaryInput bi(bo.getCArray(), bo.length(), G3D_LITTLE_ENDIAN, false, false);
+				start = System::time();
+				const bool ok = decoder->decode(bi, (uint8*)decoded->buffer(), decoded->stride(), w, h);
+				decode_time += System::time() - start;
+
+				for (int row = 0; ok && exact && row < h; row++) {
+					exact = memcmp(pixels + frame->rowOffset(row), (const uint8*)decoded->buffer() + decoded->rowOffset(row), w * FrameCodec::BYTES_PER_PIXEL) == 0;
+				}
+				exact = exact && ok;
+				if (!ok) cout << FrameCodec::name((CodecID)id) << " could not decode frame " << f << endl;
+
+				frame->unmap();
+			}
+		}
+
+		const double total_raw = (double)raw_bytes * iterations;
+		printf("%-12s %8.2f %12.1f %12.1f %12.1f %6s\n",
+			FrameCodec::name((CodecID)id),
+			total_raw / G3D::max((double)encoded_bytes, 1.0),
+			encoded_bytes / 1024.0 / (frames.size() * iterations),
+			total_raw / (1024.0 * 1024.0) / G3D::max(encode_time, 1e-9),
+			total_raw / (1024.0 * 1024.0) / G3D::max(decode_time, 1e-9),
+			exact ? "yes" : "no");
+	}
+
+	cout << endl << "Goodbye." << endl;
+
+	return 0;
+}
@@ -0,0 +1,131 @@
+#include <G3D/G3D.h>
+#include "../src/DistributedRenderer.h"
+
+using namespace std;
+using namespace DistributedRenderer;
+using namespace G3D;
+
+// Decodes and applies the frames of one UPDATE for n entities the way the
+// remotes used to, one ENTITY_PROPERTIES record and yaw/pitch/roll apiece,
+// and the way they do now, one TransformBlock decoded to matrices and applied
+// across cores from Constants::PARALLEL_APPLY_MIN entities up. Reports
+// entities per microsecond for each, the bytes on the wire, and how far the
+// frames each arrives at are from those sent.
+//
+// Apply here is setting a CoordinateFrame in a table, what Entity::setFrame
+// costs on top is the same either way.
+//
+// usage: SyncBenchmark [-n entities] [-i iterations]
+
+int main(int argc, const char* argv[]){
+
+	initG3D();
+
+	int count = 100000;
+	int iterations = 20;
+
+	for (int i = 1; i < argc; i++) {
+		if (String(argv[i]) == "-n" && i + 1 < argc) {
+			count = atoi(argv[++i]);
+			continue;
+		}
+		if (String(argv[i]) == "-i" && i + 1 < argc) {
+			iterations = atoi(argv[++i]);
+			continue;
+		}
+		cout << "usage: SyncBenchmark [-n entities] [-i iterations]" << endl;
+		return 1;
+	}
+
+	// frames anywhere in a 1 km cube, any way round
+	Random rng(1234, false);
+	Array<CoordinateFrame> frames;
+	frames.resize(count);
+	for (int e = 0; e < count; e++) {
+		frames[e] = CoordinateFrame::fromXYZYPRRadians(
+			rng.uniform(-500.0f, 500.0f), rng.uniform(-500.0f, 500.0f), rng.uniform(-500.0f, 500.0f),
+			rng.uniform(-pif(), pif()), rng.uniform(-halfPi(), halfPi()), rng.uniform(-pif(), pif()));
+	}
+
+	// one record per entity
+	BinaryOutput records("<memory>", G3D_LITTLE_ENDIAN);
+	{
+		PropertyReplication::state_t s = PropertyReplication::state_t();
+		for (int e = 0; e < count; e++) {
+			s.frame = frames[e];
+			records.writeUInt8(ENTITY_PROPERTIES);
+			records.writeUInt32((uint32)e);
+			PropertyReplication::write(records, s, PropertyReplication::FRAME);
+		}
+	}
+
+	// one block
+	BinaryOutput blocked("<memory>", G3D_LITTLE_ENDIAN);
+	{
+		TransformBlock block;
+		for (int e = 0; e < count; e++) block.append((uint32)e, frames[e]);
+		blocked.writeUInt8(ENTITY_FRAME_BLOCK);
+		blocked.writeUInt32((uint32)count);
+		block.write(blocked);
+	}
+
+	Array<CoordinateFrame> by_record;
+	Array<CoordinateFrame> by_block;
+	by_record.resize(count);
+	by_block.resize(count);
+
+	RealTime record_time = 0;
+	for (int it = 0; it < iterations; it++) {
+		BinaryInput in(records.getCArray(), records.length(), G3D_LITTLE_ENDIAN, false, false);
+		PropertyReplication::state_t s = PropertyReplication::state_t();
+		const RealTime start = System::time();
+		while (in.hasMore()) {
+			in.readUInt8();
+			const uint32 id = in.readUInt32();
+			PropertyReplication::read(in, s);
+			by_record[id] = s.frame;
+		}
+		record_time += System::time() - start;
+	}
+
+	TransformBlock block;
+	RealTime block_time = 0;
+	for (int it = 0; it < iterations; it++) {
+		BinaryInput in(blocked.getCArray(), blocked.length(), G3D_LITTLE_ENDIAN, false, false);
+		const RealTime start = System::time();
+		in.readUInt8();
+		if (!block.read(in, in.readUInt32())) {
+			cout << "The block is short" << endl;
+			return 1;
+		}
+		block.toMatrices();
+		runConcurrently(0, (int)block.size(), [&](int i) {
+			by_block[block.id(i)] = block.frame(i);
+		}, block.size() < Constants::PARALLEL_APPLY_MIN);
+		block_time += System::time() - start;
+	}
+
+	// against the frames sent, the largest difference of any matrix element or of the translation
+	auto apart = [](const CoordinateFrame& a, const CoordinateFrame& b) {
+		float d = (a.translation - b.translation).length();
+		for (int r = 0; r < 3; r++) {
+			for (int c = 0; c < 3; c++) d = G3D::max(d, fabsf(a.rotation[r][c] - b.rotation[r][c]));
+		}
+		return d;
+	};
+	float record_error = 0, block_error = 0;
+	for (int e = 0; e < count; e++) {
+		record_error = G3D::max(record_error, apart(by_record[e], frames[e]));
+		block_error = G3D::max(block_error, apart(by_block[e], frames[e]));
+	}
+
+	const double entities = (double)count * iterations;
+	cout << count << " entities, " << iterations << " iterations, " << System::numCores() << " cores" << endl << endl;
+	printf("%-12s %12s %14s %12s\n", "path", "bytes", "entities/us", "max error");
+	printf("%-12s %12d %14.2f %12.2e\n", "records", (int)records.length(), entities / G3D::max(record_time * 1e6, 1e-9), record_error);
+	printf("%-12s %12d %14.2f %12.2e\n", "block", (int)blocked.length(), entities / G3D::max(block_time * 1e6, 1e-9), block_error);
+
+	cout << endl << "Goodbye." << endl;
+
+	return 0;
+}
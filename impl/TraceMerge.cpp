@@ -0,0 +1,173 @@
+#include <G3D/G3D.h>
+#include "../src/DistributedRenderer.h"
+#include <map>
+
+using namespace std;
+using namespace DistributedRenderer;
+using namespace G3D;
+
+// Merges the span logs every node writes to Constants::TRACE_DIR into one
+// trace in Chrome's JSON format, for chrome://tracing or ui.perfetto.dev.
+// Every node becomes a process and every thread of it a track, spans carry
+// their session and batch in args, and flow arrows follow each batch from
+// node to node in the order its spans started, so a batch's critical path
+// can be read straight off the timeline. Every client numbers its batches
+// from 0, a batch is only told apart from another session's by the session.
+//
+// Times are cluster time, spans from different machines line up as well as
+// ClockSync has estimated each node's offset from the router.
+//
+// Also prints, per node and span, the mean and max duration, and the end to
+// end time of a batch from its first span starting to its last one ending.
+//
+// usage: TraceMerge [-o trace.json] node0.trace node1.trace ...
+
+typedef struct {
+	String name;
+	uint32 session;
+	uint32 batch;
+	int64 start_us;
+	int64 duration_us;
+	int thread;
+	int node;
+} span_t;
+
+// a batch ID is only unique within its session
+static uint64 batchKey(const span_t& s) {
+	return ((uint64)s.session << 32) | s.batch;
+}
+
+// @post: the node's spans are appended to spans and its name to nodes
+// @return: false if the file could not be read
+static bool readTrace(const String& path, Array<String>& nodes, Array<span_t>& spans) {
+	FILE* file = fopen(path.c_str(), "r");
+	if (isNull(file)) return false;
+
+	char line[256];
+	char name[128];
+	String node = FilePath::base(path);
+	if (notNull(fgets(line, sizeof(line), file)) && sscanf(line, "# %127s", name) == 1) node = name;
+	nodes.append(node);
+
+	span_t s;
+	s.node = nodes.size() - 1;
+	long long start, duration;
+	while (notNull(fgets(line, sizeof(line), file))) {
+		if (sscanf(line, "%127s %u %u %lld %lld %d", name, &s.session, &s.batch, &start, &duration, &s.thread) != 6) continue;
+		s.name = name;
+		s.start_us = (int64)start;
+		s.duration_us = (int64)duration;
+		spans.append(s);
+	}
+
+	fclose(file);
+	return true;
+}
+
+int main(int argc, const char* argv[]){
+
+	initG3D();
+
+	String output = "trace.json";
+	Array<String> nodes;
+	Array<span_t> spans;
+
+	for (int i = 1; i < argc; i++) {
+		if (String(argv[i]) == "-o" && i + 1 < argc) {
+			output = argv[++i];
+			continue;
+		}
+		if (!readTrace(argv[i], nodes, spans)) cout << "Could not read " << argv[i] << endl;
+	}
+
+	if (spans.size() == 0) {
+		cout << "usage: TraceMerge [-o trace.json] node0.trace node1.trace ..." << endl;
+		return 1;
+	}
+
+	// the timeline starts at the first span anyone recorded
+	int64 origin = spans[0].start_us;
+	for (int i = 1; i < spans.size(); i++) origin = G3D::min(origin, spans[i].start_us);
+
+	// every batch's spans, in the order they started, keyed by session and batch
+	map<uint64, Array<int>> batches;
+	for (int i = 0; i < spans.size(); i++) {
+		Array<int>& b = batches[batchKey(spans[i])];
+		int at = b.size();
+		while (at > 0 && spans[b[at - 1]].start_us > spans[i].start_us) --at;
+		b.insert(at, i);
+	}
+
+	FILE* out = fopen(output.c_str(), "w");
+	if (isNull(out)) {
+		cout << "Could not write " << output << endl;
+		return 1;
+	}
+
+	fprintf(out, "{\"traceEvents\":[\n");
+	for (int n = 0; n < nodes.size(); n++) {
+		fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":\"%s\"}},\n", n + 1, nodes[n].c_str());
+	}
+
+	for (int i = 0; i < spans.size(); i++) {
+		const span_t& s = spans[i];
+		fprintf(out, "{\"name\":\"%s\",\"cat\":\"frame\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d,\"args\":{\"session\":%u,\"batch\":%u}},\n",
+			s.name.c_str(), (long long)(s.start_us - origin), (long long)s.duration_us, s.node + 1, s.thread, s.session, s.batch);
+	}
+
+	// a flow per batch, bound to the start of every span it passes through
+	for (map<uint64, Array<int>>::iterator it = batches.begin(); it != batches.end(); it++) {
+		const Array<int>& b = it->second;
+		if (b.size() < 2) continue;
+		for (int i = 0; i < b.size(); i++) {
+			const span_t& s = spans[b[i]];
+			const char* phase = (i == 0) ? "s" : ((i == b.size() - 1) ? "f" : "t");
+			fprintf(out, "{\"name\":\"session %u batch %u\",\"cat\":\"batch\",\"ph\":\"%s\",\"bp\":\"e\",\"id\":%llu,\"ts\":%lld,\"pid\":%d,\"tid\":%d},\n",
+				s.session, s.batch, phase, (unsigned long long)it->first, (long long)(s.start_us - origin), s.node + 1, s.thread);
+		}
+	}
+
+	// one last event so every event above can end with a comma
+	fprintf(out, "{\"name\":\"end\",\"ph\":\"i\",\"s\":\"g\",\"ts\":0,\"pid\":0,\"tid\":0}\n]}\n");
+	fclose(out);
+
+	cout << spans.size() << " spans from " << nodes.size() << " nodes, " << batches.size() << " batches written to " << output << endl << endl;
+
+	// per node and span name
+	printf("%-32s %-14s %8s %10s %10s\n", "node", "span", "count", "mean ms", "max ms");
+	for (int n = 0; n < nodes.size(); n++) {
+		map<String, Array<int64>> durations;
+		for (int i = 0; i < spans.size(); i++) {
+			if (spans[i].node == n) durations[spans[i].name].append(spans[i].duration_us);
+		}
+		for (map<String, Array<int64>>::iterator it = durations.begin(); it != durations.end(); it++) {
+			int64 total = 0;
+			int64 longest = 0;
+			for (int i = 0; i < it->second.size(); i++) {
+				total += it->second[i];
+				longest = G3D::max(longest, it->second[i]);
+			}
+			printf("%-32s %-14s %8d %10.3f %10.3f\n", nodes[n].c_str(), it->first.c_str(), it->second.size(), total / 1000.0 / it->second.size(), longest / 1000.0);
+		}
+	}
+
+	// end to end, only batches with more than one span
+	int64 total = 0;
+	int64 longest = 0;
+	int count = 0;
+	for (map<uint64, Array<int>>::iterator it = batches.begin(); it != batches.end(); it++) {
+		const Array<int>& b = it->second;
+		if (b.size() < 2) continue;
+		int64 end = 0;
+		for (int i = 0; i < b.size(); i++) end = G3D::max(end, spans[b[i]].start_us + spans[b[i]].duration_us);
+		const int64 latency = end - spans[b[0]].start_us;
+		total += latency;
+		longest = G3D::max(longest, latency);
+		++count;
+	}
+	if (count > 0) printf("\nend to end over %d batches: mean %.3f ms, max %.3f ms\n", count, total / 1000.0 / count, longest / 1000.0);
+
+	cout << endl << "Goodbye." << endl;
+
+	return 0;
+}
@@ -10,8 +10,8 @@ int main(int argc, const char* argv[]) {
     DistributedRenderer::RApp::Settings settings(argc, argv);
     
     settings.window.caption     = argv[0];
-    settings.window.width       = 1280; 
-    settings.window.height      = 720;
+    settings.window.width       = Constants::SCREEN_WIDTH; 
+    settings.window.height      = Constants::SCREEN_HEIGHT;
 
 	App(settings, NodeType::CLIENT).run();
 }
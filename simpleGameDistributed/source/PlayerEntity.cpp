@@ -67,6 +67,8 @@ void PlayerEntity::init(const Vector3& velocity, const Sphere& collisionProxy) {
     m_desiredPitchVelocity  = 0;
     m_heading               = 0;
     m_headTilt              = 0;
+    m_animationStart        = notNull(m_scene) ? m_scene->time() : 0;
+    m_poseTime              = m_animationStart;
 }
 
 
@@ -94,7 +96,10 @@ void PlayerEntity::onSimulation(SimTime absoluteTime, SimTime deltaTime) {
     if (! isNaN(deltaTime) && (deltaTime > 0)) {
         m_previousFrame = m_frame;
     }
-    simulatePose(absoluteTime, deltaTime);
+    simulatePose(absoluteTime - m_animationStart, deltaTime);
+    if (! isNaN(absoluteTime)) {
+        m_poseTime = absoluteTime;
+    }
 
     //m_velocity = m_frame.vectorToWorldSpace(m_desiredOSVelocity);
     //m_frame.translation += m_velocity * (float)deltaTime;
@@ -109,6 +114,12 @@ void PlayerEntity::onSimulation(SimTime absoluteTime, SimTime deltaTime) {
 }
 
 
+void PlayerEntity::poseAt(SimTime t) {
+    simulatePose(t - m_animationStart, max(0.0, t - m_poseTime));
+    m_poseTime = t;
+}
+
+
 void PlayerEntity::getConservativeCollisionTris(Array<Tri>& triArray, const Vector3& velocity, float deltaTime) const {
     Sphere nearby = collisionProxy();
     nearby.radius += velocity.length() * deltaTime;
@@ -2,8 +2,9 @@
 #define PlayerEntity_h
 
 #include <G3D/G3D.h>
+#include "../src/PropertyReplication.h"
 
-class PlayerEntity : public VisibleEntity {
+class PlayerEntity : public VisibleEntity, public DistributedRenderer::ReplicatedEntity {
 protected:
 
     Vector3         m_velocity;
@@ -20,7 +21,14 @@ protected:
     /** Unused for rendering, for use by a fps cam. */
     float           m_headTilt;
 
-    PlayerEntity() {}
+    /** The scene time the pose animation counts from, when the entity was created. Replicated, it
+        only changes if the animation restarts, and the model is posed at the time since */
+    SimTime         m_animationStart;
+
+    /** The scene time the pose was last simulated at */
+    SimTime         m_poseTime;
+
+    PlayerEntity() : m_animationStart(0), m_poseTime(0) {}
 
 #ifdef G3D_OSX
     #pragma clang diagnostic push
@@ -112,6 +120,17 @@ public:
 
     virtual void onSimulation(SimTime absoluteTime, SimTime deltaTime) override;
 
+    virtual SimTime animationStart() const override {
+        return m_animationStart;
+    }
+
+    virtual void setAnimationStart(SimTime start) override {
+        m_animationStart = start;
+    }
+
+    /** Poses the model at scene time \a t without moving the entity, for remotes that do not simulate */
+    virtual void poseAt(SimTime t) override;
+
 };
 
 #endif
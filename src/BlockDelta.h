@@ -0,0 +1,208 @@
+#pragma once
+#include <G3D/G3D.h>
+#include <emmintrin.h>
+
+/* =========================================
+ *           Temporal Block Delta
+ * =========================================
+ *
+ * Encodes a tightly packed RGB8 strip against the strip that was sent
+ * previously on the same stream. The image is cut into 16x16 blocks,
+ * every block is compared to the previous frame with SSE2 and only the
+ * blocks that changed are sent, preceded by a bitmap of which blocks
+ * those are. Every KEYFRAME_INTERVAL frames (or whenever the size
+ * changes) the full strip is sent instead.
+ *
+ * The decoder has no state of its own: it patches the destination
+ * buffer in place, so the receiver's persistent frame IS the reference.
+ *
+ * Wire format:
+ *   uint8  keyframe
+ *   uint16 width
+ *   uint16 height
+ *   keyframe:  width * height * 3 bytes, rows in the order they were given
+ *   otherwise: ceil(blocks / 8) bitmap bytes, then the rows of every
+ *              set block (clipped to the image), in block order
+ */
+
+namespace DistributedRenderer {
+
+    class BlockDelta {
+        public:
+            static const int BLOCK_SIZE = 16;
+            static const int BYTES_PER_PIXEL = 3;
+
+            static int blocksAcross(int width) { return (width + BLOCK_SIZE - 1) / BLOCK_SIZE; }
+            static int blocksDown(int height) { return (height + BLOCK_SIZE - 1) / BLOCK_SIZE; }
+
+            // true if the two rows of n bytes differ anywhere
+            static bool rowDiffers(const uint8* a, const uint8* b, int n) {
+                int i = 0;
+                __m128i acc = _mm_setzero_si128();
+                for (; i + 16 <= n; i += 16) {
+                    const __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+                    const __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+                    acc = _mm_or_si128(acc, _mm_xor_si128(va, vb));
+                }
+                if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF) return true;
+
+                // tail of a clipped block
+                for (; i < n; i++) {
+                    if (a[i] != b[i]) return true;
+                }
+                return false;
+            }
+    };
+
+    class BlockDeltaEncoder {
+        private:
+            Array<uint8> previous;
+            int width = 0;
+            int height = 0;
+
+            uint32 frames_since_keyframe = 0;
+            bool force_keyframe = true;
+
+            void writeKeyframe(const uint8* pixels, ptrdiff_t stride, BinaryOutput& bo) {
+                const int row_bytes = width * BlockDelta::BYTES_PER_PIXEL;
+                for (int row = 0; row < height; row++) {
+                    const uint8* src = pixels + row * stride;
+                    bo.writeBytes(src, row_bytes);
+                    System::memcpy(previous.getCArray() + row * row_bytes, src, row_bytes);
+                }
+            }
+
+        public:
+            uint32 keyframe_interval;
+
+            BlockDeltaEncoder(uint32 interval = 60) : keyframe_interval(interval) {}
+
+            // the next frame will be sent in full
+            void forceKeyframe() { force_keyframe = true; }
+
+            // @pre: pixels points to the first row of a width x height RGB8 image, rows stride bytes apart
+            // (negative to walk a buffer bottom-up)
+            // @post: writes a keyframe or a block delta to bo and remembers pixels as the new reference
+            // @return: the number of blocks that were sent
+            int encode(const uint8* pixels, int w, int h, ptrdiff_t stride, BinaryOutput& bo) {
+
+                if (w != width || h != height) {
+                    width = w;
+                    height = h;
+                    previous.resize(width * height * BlockDelta::BYTES_PER_PIXEL);
+                    force_keyframe = true;
+                }
+
+                const int across = BlockDelta::blocksAcross(width);
+                const int down = BlockDelta::blocksDown(height);
+                const bool keyframe = force_keyframe || ++frames_since_keyframe >= keyframe_interval;
+
+                bo.writeUInt8(keyframe ? 1 : 0);
+                bo.writeUInt16((uint16)width);
+                bo.writeUInt16((uint16)height);
+
+                if (keyframe) {
+                    writeKeyframe(pixels, stride, bo);
+                    frames_since_keyframe = 0;
+                    force_keyframe = false;
+                    return across * down;
+                }
+
+                const int row_bytes = width * BlockDelta::BYTES_PER_PIXEL;
+
+                // reserve the bitmap, it is filled in once we know which blocks changed
+                const int bitmap_bytes = (across * down + 7) / 8;
+                const int64 bitmap_pos = bo.position();
+                for (int i = 0; i < bitmap_bytes; i++) bo.writeUInt8(0);
+
+                Array<uint8> bitmap;
+                bitmap.resize(bitmap_bytes);
+                System::memset(bitmap.getCArray(), 0, bitmap_bytes);
+
+                uint8* prev = previous.getCArray();
+                int changed = 0;
+
+                for (int by = 0; by < down; by++) {
+                    const int y0 = by * BlockDelta::BLOCK_SIZE;
+                    const int rows = G3D::min(BlockDelta::BLOCK_SIZE, height - y0);
+
+                    for (int bx = 0; bx < across; bx++) {
+                        const int x0 = bx * BlockDelta::BLOCK_SIZE * BlockDelta::BYTES_PER_PIXEL;
+                        const int n = G3D::min(BlockDelta::BLOCK_SIZE * BlockDelta::BYTES_PER_PIXEL, row_bytes - x0);
+
+                        bool dirty = false;
+                        for (int r = 0; r < rows && !dirty; r++) {
+                            dirty = BlockDelta::rowDiffers(pixels + (y0 + r) * stride + x0, prev + (y0 + r) * row_bytes + x0, n);
+                        }
+                        if (!dirty) continue;
+
+                        const int block = by * across + bx;
+                        bitmap[block >> 3] |= (1 << (block & 7));
+                        ++changed;
+
+                        for (int r = 0; r < rows; r++) {
+                            const uint8* src = pixels + (y0 + r) * stride + x0;
+                            bo.writeBytes(src, n);
+                            System::memcpy(prev + (y0 + r) * row_bytes + x0, src, n);
+                        }
+                    }
+                }
+
+                // go back and fill in the bitmap
+                const int64 end_pos = bo.position();
+                bo.setPosition(bitmap_pos);
+                bo.writeBytes(bitmap.getCArray(), bitmap_bytes);
+                bo.setPosition(end_pos);
+
+                return changed;
+            }
+    };
+
+    class BlockDeltaDecoder {
+        public:
+
+            // @pre: dst points to the first row of the region this stream owns, rows dst_stride bytes apart
+            // @post: patches the keyframe or the changed blocks into dst in place
+            // @return: false if the stream does not fit in the destination
+            static bool decode(BinaryInput& bi, uint8* dst, ptrdiff_t dst_stride, int dst_width, int dst_height) {
+
+                const bool keyframe = bi.readUInt8() != 0;
+                const int width = bi.readUInt16();
+                const int height = bi.readUInt16();
+
+                if (width > dst_width || height > dst_height) return false;
+
+                const int row_bytes = width * BlockDelta::BYTES_PER_PIXEL;
+
+                if (keyframe) {
+                    for (int row = 0; row < height; row++) {
+                        bi.readBytes(dst + row * dst_stride, row_bytes);
+                    }
+                    return true;
+                }
+
+                const int across = BlockDelta::blocksAcross(width);
+                const int down = BlockDelta::blocksDown(height);
+                const int bitmap_bytes = (across * down + 7) / 8;
+
+                if (bi.getLength() - bi.getPosition() < bitmap_bytes) return false;
+                const uint8* bitmap = bi.getCArray() + bi.getPosition();
+                bi.skip(bitmap_bytes);
+
+                for (int block = 0; block < across * down; block++) {
+                    if (!(bitmap[block >> 3] & (1 << (block & 7)))) continue;
+
+                    const int y0 = (block / across) * BlockDelta::BLOCK_SIZE;
+                    const int x0 = (block % across) * BlockDelta::BLOCK_SIZE * BlockDelta::BYTES_PER_PIXEL;
+                    const int rows = G3D::min(BlockDelta::BLOCK_SIZE, height - y0);
+                    const int n = G3D::min(BlockDelta::BLOCK_SIZE * BlockDelta::BYTES_PER_PIXEL, row_bytes - x0);
+
+                    for (int r = 0; r < rows; r++) {
+                        bi.readBytes(dst + (y0 + r) * dst_stride + x0, n);
+                    }
+                }
+
+                return true;
+            }
+    };
+}
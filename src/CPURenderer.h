@@ -0,0 +1,264 @@
+#pragma once
+#include <G3D/G3D.h>
+#include <emmintrin.h>
+#include <functional>
+
+/* =========================================
+ *              CPU Renderer
+ * =========================================
+ *
+ * A software rasterizer that lets a Remote render its strip without
+ * touching the GPU. Every frame the scene is posed into surfaces, the
+ * surfaces are flattened into triangles (the same CPU-side vertex data
+ * the collision code uses), triangles are projected and clipped against
+ * the near plane, binned into 32x32 tiles and then every tile is
+ * rasterized on its own thread. Edge functions and the depth test are
+ * evaluated four pixels at a time with SSE2.
+ *
+ * Shading is flat: the triangle's Lambertian albedo lit by the scene's
+ * first light plus a constant ambient term. The output is the same tightly
+ * packed RGB8 strip that Remote::encodeLayer ships for the GPU path.
+ */
+
+namespace DistributedRenderer {
+
+    class CPURenderer {
+        private:
+            static const int TILE_SIZE = 32;
+
+            typedef struct {
+                // screen space vertices, relative to the top left of the strip
+                float x[3];
+                float y[3];
+                float z[3];
+                Color3 color;
+            } screen_tri_t;
+
+            Array<shared_ptr<Surface>> surfaces;
+            CPUVertexArray vertices;
+            Array<Tri> tris;
+
+            Array<screen_tri_t> screen_tris;
+            Array<Array<int>> bins;
+            Array<float> depth;
+
+            static Color3 albedo(const Tri& tri) {
+                const shared_ptr<UniversalMaterial>& material = dynamic_pointer_cast<UniversalMaterial>(tri.material());
+                if (isNull(material)) return Color3(0.7f);
+                return material->bsdf()->lambertian().mean().rgb();
+            }
+
+            // clip a homogeneous polygon against w > near_w, returns the number of vertices left
+            static int clipNear(const Vector4* in, int n, Vector4* out, float near_w) {
+                int count = 0;
+                for (int i = 0; i < n; i++) {
+                    const Vector4& a = in[i];
+                    const Vector4& b = in[(i + 1) % n];
+                    const bool a_in = a.w > near_w;
+                    const bool b_in = b.w > near_w;
+
+                    if (a_in) out[count++] = a;
+                    if (a_in != b_in) {
+                        const float t = (near_w - a.w) / (b.w - a.w);
+                        out[count++] = a + (b - a) * t;
+                    }
+                }
+                return count;
+            }
+
+            void addScreenTri(const Vector4& a, const Vector4& b, const Vector4& c, const Color3& color, const Rect2D& strip) {
+                screen_tri_t st;
+                const Vector4* v[3] = { &a, &b, &c };
+                for (int i = 0; i < 3; i++) {
+                    st.x[i] = v[i]->x / v[i]->w - strip.x0();
+                    st.y[i] = v[i]->y / v[i]->w - strip.y0();
+                    st.z[i] = v[i]->z / v[i]->w;
+                }
+
+                // cull degenerates only, the scene's models are two-sided
+                const float area = (st.x[1] - st.x[0]) * (st.y[2] - st.y[0]) - (st.x[2] - st.x[0]) * (st.y[1] - st.y[0]);
+                if (fabs(area) < 1e-6f) return;
+
+                st.color = color;
+                screen_tris.append(st);
+            }
+
+            void project(const shared_ptr<Scene>& scene, const shared_ptr<Camera>& camera, const Rect2D& strip, int width, int height) {
+
+                Matrix4 P;
+                camera->projection().getProjectPixelMatrix(Rect2D::xywh(0, 0, (float)width, (float)height), P);
+                const Matrix4& PV = P * camera->frame().inverse().toMatrix4();
+
+                // light direction, towards the light
+                Vector3 L = Vector3::unitY();
+                const Array<shared_ptr<Light>>& lights = scene->lightingEnvironment().lightArray;
+                if (lights.size() > 0) {
+                    const Vector4& p = lights[0]->position();
+                    L = (p.w == 0.0f) ? p.xyz().direction() : (p.xyz() - camera->frame().translation).direction();
+                }
+
+                const float near_w = -camera->projection().nearPlaneZ();
+
+                screen_tris.fastClear();
+                for (int t = 0; t < tris.size(); t++) {
+                    const Tri& tri = tris[t];
+                    const Point3& p0 = tri.position(vertices, 0);
+                    const Point3& p1 = tri.position(vertices, 1);
+                    const Point3& p2 = tri.position(vertices, 2);
+
+                    const Vector3& n = (p1 - p0).cross(p2 - p0).directionOrZero();
+                    const Color3& color = albedo(tri) * (0.25f + 0.75f * G3D::max(0.0f, n.dot(L)));
+
+                    Vector4 clip[3] = { PV * Vector4(p0, 1.0f), PV * Vector4(p1, 1.0f), PV * Vector4(p2, 1.0f) };
+                    Vector4 poly[4];
+                    const int count = clipNear(clip, 3, poly, near_w);
+
+                    for (int i = 1; i + 1 < count; i++) {
+                        addScreenTri(poly[0], poly[i], poly[i + 1], color, strip);
+                    }
+                }
+            }
+
+            void bin(int tiles_x, int tiles_y, int width, int height) {
+                bins.resize(tiles_x * tiles_y);
+                for (int i = 0; i < bins.size(); i++) bins[i].fastClear();
+
+                for (int t = 0; t < screen_tris.size(); t++) {
+                    const screen_tri_t& st = screen_tris[t];
+                    const float x0 = G3D::min(st.x[0], G3D::min(st.x[1], st.x[2]));
+                    const float x1 = G3D::max(st.x[0], G3D::max(st.x[1], st.x[2]));
+                    const float y0 = G3D::min(st.y[0], G3D::min(st.y[1], st.y[2]));
+                    const float y1 = G3D::max(st.y[0], G3D::max(st.y[1], st.y[2]));
+
+                    if (x1 < 0 || y1 < 0 || x0 >= width || y0 >= height) continue;
+
+                    const int tx0 = iClamp(int(x0) / TILE_SIZE, 0, tiles_x - 1);
+                    const int tx1 = iClamp(int(x1) / TILE_SIZE, 0, tiles_x - 1);
+                    const int ty0 = iClamp(int(y0) / TILE_SIZE, 0, tiles_y - 1);
+                    const int ty1 = iClamp(int(y1) / TILE_SIZE, 0, tiles_y - 1);
+
+                    for (int ty = ty0; ty <= ty1; ty++) {
+                        for (int tx = tx0; tx <= tx1; tx++) {
+                            bins[ty * tiles_x + tx].append(t);
+                        }
+                    }
+                }
+            }
+
+            // rasterizes one tile's bin, four pixels per step
+            void rasterizeTile(int tx, int ty, int tiles_x, int width, int height, uint8* out, size_t stride) {
+                const int px0 = tx * TILE_SIZE;
+                const int py0 = ty * TILE_SIZE;
+                const int px1 = G3D::min(px0 + TILE_SIZE, width);
+                const int py1 = G3D::min(py0 + TILE_SIZE, height);
+
+                const Array<int>& tile = bins[ty * tiles_x + tx];
+                const __m128 lane = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+
+                for (int i = 0; i < tile.size(); i++) {
+                    const screen_tri_t& st = screen_tris[tile[i]];
+
+                    // edge function coefficients, e(x, y) = a * x + b * y + c
+                    float a[3], b[3], c[3];
+                    for (int e = 0; e < 3; e++) {
+                        const int j = (e + 1) % 3;
+                        a[e] = st.y[e] - st.y[j];
+                        b[e] = st.x[j] - st.x[e];
+                        c[e] = st.x[e] * st.y[j] - st.x[j] * st.y[e];
+                    }
+                    const float area = c[0] + c[1] + c[2];
+                    const float inv_area = 1.0f / area;
+
+                    const uint8 r = (uint8)iClamp(iRound(st.color.r * 255.0f), 0, 255);
+                    const uint8 g = (uint8)iClamp(iRound(st.color.g * 255.0f), 0, 255);
+                    const uint8 bl = (uint8)iClamp(iRound(st.color.b * 255.0f), 0, 255);
+
+                    for (int y = py0; y < py1; y++) {
+                        const __m128 vy = _mm_set1_ps(y + 0.5f);
+                        float* zrow = depth.getCArray() + y * width;
+                        uint8* crow = out + y * stride;
+
+                        for (int x = px0; x < px1; x += 4) {
+                            const __m128 vx = _mm_add_ps(_mm_set1_ps((float)x), lane);
+
+                            // barycentric weights, scaled by area
+                            __m128 w[3];
+                            __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+                            for (int e = 0; e < 3; e++) {
+                                w[e] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(a[e]), vx), _mm_mul_ps(_mm_set1_ps(b[e]), vy)), _mm_set1_ps(c[e]));
+                                // same sign as the area means inside
+                                inside = _mm_and_ps(inside, (area < 0.0f) ? _mm_cmple_ps(w[e], _mm_setzero_ps()) : _mm_cmpge_ps(w[e], _mm_setzero_ps()));
+                            }
+
+                            int mask = _mm_movemask_ps(inside);
+                            if (!mask) continue;
+
+                            // weight of vertex k is the edge opposite it
+                            const __m128 z = _mm_mul_ps(_mm_add_ps(_mm_add_ps(
+                                _mm_mul_ps(w[1], _mm_set1_ps(st.z[0])),
+                                _mm_mul_ps(w[2], _mm_set1_ps(st.z[1]))),
+                                _mm_mul_ps(w[0], _mm_set1_ps(st.z[2]))), _mm_set1_ps(inv_area));
+
+                            alignas(16) float zs[4];
+                            _mm_store_ps(zs, z);
+
+                            for (int k = 0; k < 4 && x + k < px1; k++) {
+                                if (!(mask & (1 << k)) || zs[k] >= zrow[x + k]) continue;
+                                zrow[x + k] = zs[k];
+                                uint8* px = crow + (x + k) * 3;
+                                px[0] = r; px[1] = g; px[2] = bl;
+                            }
+                        }
+                    }
+                }
+            }
+
+        public:
+
+            // depth of the last strip rendered, strip width floats per row, +inf where nothing was drawn
+            const float* depthBuffer() const { return depth.getCArray(); }
+
+            // @pre: out is at least strip.width() x strip.height() RGB8
+            // @post: out holds the strip of the scene as seen by camera on a width x height screen, rows top to bottom,
+            // of the entities shades takes, or all of them without it
+            void render(const shared_ptr<Scene>& scene, const shared_ptr<Camera>& camera, const Rect2D& strip, int width, int height, const shared_ptr<CPUPixelTransferBuffer>& out,
+                const std::function<bool(const shared_ptr<Entity>&)>& shades = nullptr) {
+
+                BEGIN_PROFILER_EVENT("CPURenderer::render");
+
+                surfaces.fastClear();
+                scene->onPose(surfaces);
+                if (shades) {
+                    for (int i = surfaces.size() - 1; i >= 0; i--) {
+                        if (!shades(surfaces[i]->entity())) surfaces.fastRemove(i);
+                    }
+                }
+
+                vertices.clear();
+                tris.fastClear();
+                Surface::getTris(surfaces, vertices, tris);
+
+                const int w = (int)strip.width();
+                const int h = (int)strip.height();
+                const int tiles_x = (w + TILE_SIZE - 1) / TILE_SIZE;
+                const int tiles_y = (h + TILE_SIZE - 1) / TILE_SIZE;
+
+                project(scene, camera, strip, width, height);
+                bin(tiles_x, tiles_y, w, h);
+
+                // clear to the sky colour and the far plane
+                depth.resize(w * h);
+                for (int i = 0; i < depth.size(); i++) depth[i] = finf();
+
+                uint8* pixels = (uint8*)out->buffer();
+                const size_t stride = out->stride();
+                for (int y = 0; y < h; y++) System::memset(pixels + y * stride, 0, w * 3);
+
+                runConcurrently(0, tiles_x * tiles_y, [&](int tile) {
+                    rasterizeTile(tile % tiles_x, tile / tiles_x, tiles_x, w, h, pixels, stride);
+                });
+
+                END_PROFILER_EVENT();
+            }
+    };
+}
@@ -1,5 +1,6 @@
 #include "DistributedRenderer.h"
 #include "FramebufferDist.h"
+#include "Interest.h"
 
 using namespace std;
 using namespace G3D;
@@ -7,19 +8,30 @@ using namespace DistributedRenderer;
 
 namespace DistributedRenderer{
 
-	shared_ptr<ImageDist> frame;
 	shared_ptr<FramebufferDist> buffer;
 
     Client::Client(RApp* app) : NetworkNode(NodeType::CLIENT, app, false) {
 		buffer = FramebufferDist::create(TextureDist::createEmpty("frame", the_app->renderDevice->width(), the_app->renderDevice->height()));
 		the_app->setFinalFrameBuffer(buffer);
+
+		frame_pixels = FramePool::instance().cpu(Constants::SCREEN_WIDTH, Constants::SCREEN_HEIGHT);
+
+		echo = frame_echo_t();
+		lifecycle = BinaryUtils::create();
+
+		FrameTrace::instance().open(Constants::TRACE_DIR, "client");
 	}
 
     void Client::onConnect() {
 		
 		cout << "Connected to router" << endl;
 
-        send(PacketType::HI_AM_CLIENT);
+        // the loaded entities are as the scene file has them on every node
+        sent_states.fastClear();
+        for (int i = 0; i < entity_table.loadedCount(); i++) captureSent(i);
+
+        // introduce ourselves along with the codecs we can decode and our share of the remotes
+        send(PacketType::HI_AM_CLIENT, *BinaryUtils::empty(), *BinaryUtils::clientHello());
 		
 		cout << "Awaiting ready signal" << endl;
 
@@ -34,8 +46,19 @@ namespace DistributedRenderer{
 						cout << "Network was terminated" << endl;
 						return;
                     case PacketType::READY:
+						// the body carries the codec frames will arrive in
+						codec = FrameCodec::create((CodecID)iter.binaryInput().readUInt8(), Constants::KEYFRAME_INTERVAL);
+						for (int v = 1; v < MultiView::count(Constants::VIEW_LAYOUT); v++) view_codecs.append(FrameCodec::create(codec->id(), Constants::KEYFRAME_INTERVAL));
+						setRegions(iter.binaryInput());
+
+						// then how many batches may be in flight at once, more than one when remotes take turns
+						if (iter.binaryInput().hasMore()) max_in_flight = G3D::max((uint32)iter.binaryInput().readUInt8(), (uint32)1);
+
+						// and the session the router knows us by, our batch IDs are only unique within it
+						if (iter.binaryInput().hasMore()) FrameTrace::instance().setSession(iter.binaryInput().readUInt8());
+
 						// exit so the app can run
-						cout << "Network is ready" << endl;
+						cout << "Network is ready, frames are " << codec->name() << endl;
                         ready = true;
                         break;
                     default: break;
@@ -44,6 +67,80 @@ namespace DistributedRenderer{
         }
     }
 
+    // @pre: the rest of a READY packet, the region table
+    // @post: frames are taken to be at full resolution until one says otherwise
+    void Client::setRegions(BinaryInput& bi) {
+        Foveation::readRegions(bi, full_regions);
+        setFrameScale(ResolutionController::MAX_SCALE);
+    }
+
+    // @pre: the percent of full resolution frames arrive at
+    // @post: frames are decoded into an atlas of the regions' size at that scale, and unless that is
+    // the screen itself every region gets a texture of its own for the app to draw
+    void Client::setFrameScale(uint8 percent) {
+        frame_scale = percent;
+
+        uint32 atlas_width;
+        const uint32 atlas_height = Foveation::atScale(full_regions, Constants::SCREEN_WIDTH, percent, regions, atlas_width);
+
+        frame_pixels.reset();
+        frame_pixels = FramePool::instance().cpu(atlas_width, atlas_height);
+        region_pixels.fastClear();
+        region_textures.fastClear();
+        the_app->setFinalFrameSharpness(percent < ResolutionController::MAX_SCALE ? Constants::UPSCALE_SHARPNESS : 0.0f);
+
+        if (Foveation::isIdentity(regions)) {
+            // the frame is the screen, uploaded to the app's frame buffer as it is
+            if ((uint32)buffer->texture(0)->width() != atlas_width || (uint32)buffer->texture(0)->height() != atlas_height) {
+                buffer = FramebufferDist::create(TextureDist::createEmpty("frame", atlas_width, atlas_height));
+                the_app->setFinalFrameBuffer(buffer);
+            }
+        } else {
+            for (int i = 0; i < regions.size(); i++) {
+                region_pixels.append(FramePool::instance().cpu(regions[i].atlas_w, regions[i].atlas_h));
+                region_textures.append(Texture::createEmpty(format("region %d", i), regions[i].atlas_w, regions[i].atlas_h, ImageFormat::RGB8()));
+            }
+            the_app->setFinalFrameRegions(regions, region_textures);
+
+            cout << "Foveated, " << regions.size() << " regions in a " << atlas_width << "x" << atlas_height << " frame" << endl;
+        }
+
+        // every other view arrives at the same size, each to a texture of its own
+        view_pixels.fastClear();
+        view_textures.fastClear();
+        for (int v = 0; v < view_codecs.size(); v++) {
+            view_pixels.append(FramePool::instance().cpu(atlas_width, atlas_height));
+            view_textures.append(Texture::createEmpty(format("view %d", v + 1), atlas_width, atlas_height, ImageFormat::RGB8()));
+        }
+        if (view_textures.size() > 0) the_app->setFinalFrameViews(view_textures);
+
+        setPlanes();
+
+        if (percent < ResolutionController::MAX_SCALE) cout << "Frames at " << (int)percent << "% resolution, " << atlas_width << "x" << atlas_height << endl;
+    }
+
+    // @post: if the codec decodes to planes and the frame is the screen itself, frames are
+    // decoded straight into Y, Cb and Cr textures, half the upload of RGB and no conversion here.
+    // Only with a single view, the planes are drawn over the whole window
+    void Client::setPlanes() {
+        for (int i = 0; i < 3; i++) {
+            plane_pixels[i].reset();
+            plane_textures[i].reset();
+        }
+        if (!codec->decodesToPlanes() || region_textures.size() > 0 || view_codecs.size() > 0) return;
+
+        static const char* names[] = { "Y", "Cb", "Cr" };
+        for (int i = 0; i < 3; i++) {
+            const int w = (i == 0) ? frame_pixels->width() : YUV420Codec::chromaSize(frame_pixels->width());
+            const int h = (i == 0) ? frame_pixels->height() : YUV420Codec::chromaSize(frame_pixels->height());
+            plane_pixels[i] = FramePool::instance().cpu(w, h, ImageFormat::R8());
+            plane_textures[i] = Texture::createEmpty(names[i], w, h, ImageFormat::R8());
+        }
+        the_app->setFinalFramePlanes(plane_textures);
+
+        cout << "Frames are converted from YUV420 on the GPU" << endl;
+    }
+
     // checks the network once and handles all available messages
     // wrap in a loop to repeatedly poll the network
     bool Client::checkNetwork(){
@@ -51,32 +148,75 @@ namespace DistributedRenderer{
         NetMessageIterator& iter = connection->incomingMessageIterator();
 
         if(!iter.isValid()) return false;
+        const int64 arrived_ns = ClockSync::localTimeNs();
 
         try{
 
 
             BinaryInput& header = iter.headerBinaryInput();
-            //uint32 batch_id = header.readUInt32();
 
             switch(iter.type()){
-                case PacketType::FRAME:
-
-					frame = ImageDist::fromBinaryInput(iter.binaryInput(), ImageFormat::RGB8());
-
-				/*	if(current_batch_id %2 == 0)
-						frame->setAll(Color3::red());*/
-
-
-					//buffer = FramebufferDist::create(TextureDist::fromImage("test", frame));
-
-					buffer->set(Framebuffer::COLOR0, TextureDist::fromImage("incomingFrame", frame));
+                case PacketType::FRAME: {
+
+					frame_header_t fh = BinaryUtils::readFrameHeader(header);
+					ClockSync::instance().onEcho(BinaryUtils::readClockEcho(header), arrived_ns);
+					if (in_flight > 0) --in_flight;
+					FrameTrace::instance().setBatch(fh.batch_id);
+
+					if (fh.encoding != codec->id()) {
+						cout << "Frame encoded as " << FrameCodec::name((CodecID)fh.encoding) << ", expected " << codec->name() << endl;
+						break;
+					}
+
+					// the router changed the resolution, the stream starts over from a keyframe at the new size
+					if (fh.render_scale != frame_scale) setFrameScale(fh.render_scale);
+
+					// one layer per view, back to back in the body
+					{
+						Array<MultiView::layer_t> layers;
+						MultiView::readLayers(header, layers);
+
+						BinaryInput& body = iter.binaryInput();
+						int64 offset = body.getPosition();
+						bool decoded = true;
+						for (int i = 0; i < layers.size() && decoded; i++) {
+							if (offset + layers[i].bytes > body.getLength()) {
+								decoded = false;
+								break;
+							}
+							BinaryInput layer(body.getCArray() + offset, layers[i].bytes, G3D_LITTLE_ENDIAN, false, false);
+							offset += layers[i].bytes;
+							decoded = decodeLayer(layers[i].view, layer);
+						}
+						if (!decoded) {
+							cout << "Frame could not be decoded" << endl;
+							break;
+						}
+					}
+					the_app->setFinalFrameBottomUp((fh.flags & FRAME_BOTTOM_UP) != 0);
+
+					uint32 allocations = FramePool::instance().endFrame();
+#if (DEBUG)
+					cout << "Frame pool allocations this frame: " << allocations << endl;
+#endif
+					(void)allocations;
+
+					// receipt for the router's rate controller
+					echo.sent_ms = fh.sent_ms;
+					echo.received_ms = current_time_ms();
+					echo.bytes = (uint32)(header.getLength() + iter.binaryInput().getLength());
 
                     // convert to texture and toggle flag
-                    cout << "Received frame at " << current_time_ms() << endl;
+                    cout << "Received frame at " << current_time_ms() << ", " << (int32)(current_time_ms() - fh.sent_ms) << " ms after the router sent it" << endl;
 
 					++iter;
 
 					return true;
+                }
+                case PacketType::REGIONS:
+                    // the remotes were laid out anew, frames from here on are packed by this table
+                    setRegions(iter.binaryInput());
+                    break;
                 case PacketType::TERMINATE:
                     // clean up
                     break;
@@ -91,35 +231,191 @@ namespace DistributedRenderer{
         ++iter;
     }
 
+    // @pre: the view a layer of a FRAME is of and the layer
+    // @post: the layer is decoded and uploaded for the app to draw
+    // @return: false if it could not be decoded
+    bool Client::decodeLayer(uint8 view, BinaryInput& in) {
+        if (view > 0) {
+            if (view > (uint8)view_codecs.size()) return false;
+            const shared_ptr<CPUPixelTransferBuffer>& dst = view_pixels[view - 1];
+            bool decoded;
+            {
+                FrameTrace::Span span("decode");
+                decoded = view_codecs[view - 1]->decode(in, (uint8*)dst->buffer(), dst->stride(), dst->width(), dst->height());
+            }
+            if (!decoded) return false;
+
+            FrameTrace::Span span("upload");
+            view_textures[view - 1]->update(dst);
+            return true;
+        }
+
+        // planar frames go up as they are, the app converts them while drawing
+        if (notNull(plane_textures[0])) {
+            uint8* const planes[3] = { (uint8*)plane_pixels[0]->buffer(), (uint8*)plane_pixels[1]->buffer(), (uint8*)plane_pixels[2]->buffer() };
+            const ptrdiff_t strides[3] = { (ptrdiff_t)plane_pixels[0]->stride(), (ptrdiff_t)plane_pixels[1]->stride(), (ptrdiff_t)plane_pixels[2]->stride() };
+            bool decoded;
+            {
+                FrameTrace::Span span("decode");
+                decoded = codec->decodePlanes(in, planes, strides, plane_pixels[0]->width(), plane_pixels[0]->height());
+            }
+            if (!decoded) return false;
+            FrameTrace::Span span("upload");
+            for (int i = 0; i < 3; i++) plane_textures[i]->update(plane_pixels[i]);
+        }
+        else {
+            // decode into our copy of the frame and re-upload it
+            bool decoded;
+            {
+                FrameTrace::Span span("decode");
+                decoded = codec->decode(in, (uint8*)frame_pixels->buffer(), frame_pixels->stride(), frame_pixels->width(), frame_pixels->height());
+            }
+            if (!decoded) return false;
+
+            FrameTrace::Span span("upload");
+            if (region_textures.size() == 0) {
+                buffer->texture(0)->update(frame_pixels);
+            } else {
+                // cut the atlas back up into its regions, the app stretches each over its rows
+                const uint8* atlas = (const uint8*)frame_pixels->buffer();
+                for (int i = 0; i < regions.size(); i++) {
+                    const Foveation::region_t& r = regions[i];
+                    const shared_ptr<CPUPixelTransferBuffer>& dst = region_pixels[i];
+                    for (int row = 0; row < (int)r.atlas_h; row++) {
+                        Compositor::copyRow((uint8*)dst->buffer() + dst->rowOffset(row), atlas + frame_pixels->rowOffset(r.atlas_y + row) + r.atlas_x * FrameCodec::BYTES_PER_PIXEL, r.atlas_w * FrameCodec::BYTES_PER_PIXEL);
+                    }
+                    region_textures[i]->update(dst);
+                }
+            }
+        }
+        return true;
+    }
+
+    // @pre: a name no other entity has and a G3D entity spec, such as VisibleEntity { model = ...; frame = ...; }
+    // @post: the entity is added to the scene here and, with the next update, on every remote
+    // @return: its network ID, INVALID_ID if it could not be created
+    EntityTable::NetID Client::spawn(const String& name, const Any& spec) {
+        shared_ptr<Entity> ent;
+        try {
+            ent = the_app->scene()->createEntity(name, spec);
+        } catch (...) {
+            cout << "Could not spawn " << name << endl;
+            return EntityTable::INVALID_ID;
+        }
+        if (isNull(ent)) return EntityTable::INVALID_ID;
+
+        const EntityTable::NetID id = entity_table.add(ent);
+        if (id == EntityTable::INVALID_ID) {
+            the_app->scene()->removeEntity(name);
+            cout << "No network ID left for " << name << endl;
+            return id;
+        }
+
+        lifecycle->writeUInt8(ENTITY_SPAWN);
+        lifecycle->writeUInt32(id);
+        lifecycle->writeString(name);
+        lifecycle->writeString(spec.unparse());
+        BinaryUtils::writeEntityFrame(*lifecycle, ent->frame());
+
+        // remotes create it from the same spec, only what changes after this goes out
+        captureSent((int)EntityTable::slotOf(id));
+        return id;
+    }
+
+    // @post: the slot's entity is taken to be on the remotes as it is here now
+    void Client::captureSent(int slot) {
+        if (sent_states.size() <= slot) sent_states.resize(slot + 1);
+        PropertyReplication::capture(entity_table.at(slot), sent_states[slot]);
+    }
+
+    // @post: the entity is removed from the scene here and, with the next update, on every remote
+    // @return: false if the ID is stale or names an entity loaded with the scene
+    bool Client::despawn(EntityTable::NetID id) {
+        shared_ptr<Entity> ent = entity_table.remove(id);
+        if (isNull(ent)) return false;
+
+        the_app->scene()->removeEntity(ent->name());
+        lifecycle->writeUInt8(ENTITY_DESPAWN);
+        lifecycle->writeUInt32(id);
+        return true;
+    }
+
 	// send an update on the network with a batch ID
 	// the processed batch frame will need to return by the next deadline
 	// or else the client will use a low qual render instead
     bool Client::sendUpdate(){
 
+        FrameTrace::Span span("sendUpdate", current_batch_id);
+
         // serialize 
 		BinaryOutput* batch = BinaryUtils::create();
 
-        for (int i = 0; i < entities.size(); i++){
-            shared_ptr<Entity> ent = entities[i];
+        // spawns and despawns first, so the frames after them find their entities
+        if (lifecycle->length() > 0) {
+            batch->writeBytes(lifecycle->getCArray(), lifecycle->length());
+            lifecycle->reset();
+        }
 
-            if(ent->lastChangeTime() < last_update) continue;
+        // then whatever changed of every entity since the last update, behind a change mask, the frames
+        // all in one block, and where it is for the router to send it only to the remotes that can see it
+        PropertyReplication::state_t now = PropertyReplication::state_t();
+        Array<Interest::entry_t> interest;
+        for (int i = 0; i < entity_table.size() && i < sent_states.size(); i++){
+            const shared_ptr<Entity>& ent = entity_table.at(i);
+            if(isNull(ent)) continue;
+
+            PropertyReplication::capture(ent, now);
+            const PropertyReplication::mask_t changed = PropertyReplication::changed(sent_states[i], now);
+            if (changed == 0) continue;
+
+            if (changed & PropertyReplication::FRAME) frame_block.append(entity_table.idAt(i), now.frame);
+            const PropertyReplication::mask_t rest = changed & ~PropertyReplication::FRAME;
+            if (rest != 0) {
+                batch->writeUInt8(ENTITY_PROPERTIES);
+                batch->writeUInt32(entity_table.idAt(i));
+                PropertyReplication::write(*batch, now, rest);
+            }
 
-            float x,y,z,yaw,pitch,roll;
-            ent->frame().getXYZYPRRadians(x,y,z,yaw,pitch,roll);
+            if (Constants::INTEREST_MANAGEMENT) {
+                Interest::entry_t entry;
+                entry.id = entity_table.idAt(i);
+                entry.bounds = Interest::boundsOf(ent, now.frame.translation - sent_states[i].frame.translation);
+                interest.append(entry);
+            }
+            sent_states[i] = now;
+        }
+        if (frame_block.size() > 0) {
+            batch->writeUInt8(ENTITY_FRAME_BLOCK);
+            batch->writeUInt32(frame_block.size());
+            frame_block.write(*batch);
+            frame_block.clear();
+        }
 
-            batch->writeUInt32(i);
-			batch->writeFloat32(x);
-			batch->writeFloat32(y);
-			batch->writeFloat32(z);
-			batch->writeFloat32(yaw);
-			batch->writeFloat32(pitch);
-			batch->writeFloat32(roll);
+        // the cameras of the layout, a batch goes out when they moved even if nothing else did
+        Array<MultiView::view_t> views;
+        const shared_ptr<Camera>& camera = the_app->activeCamera();
+        MultiView::fromCamera(camera->frame(), camera->fieldOfViewAngle(), Constants::VIEW_LAYOUT, Constants::EYE_SEPARATION, Constants::MINIMAP_HEIGHT, views);
+        bool moved = views.size() != sent_views.size();
+        for (int v = 0; v < views.size() && !moved; v++) {
+            moved = views[v].frame != sent_views[v].frame || views[v].fov != sent_views[v].fov;
         }
 
         // net message send batch to router ip
-        if(batch->length() > 0){
-            send(PacketType::UPDATE, *BinaryUtils::toBinaryOutput(current_batch_id++), *batch);
-            last_update = System::time();
+        if(batch->length() > 0 || moved){
+            // the header carries the batch id, the simulation time the remotes pose the batch at,
+            // and the receipt for the last frame
+            BinaryOutput* header = BinaryUtils::toBinaryOutput(current_batch_id++);
+            header->writeFloat64(notNull(the_app->scene()) ? the_app->scene()->time() : 0.0);
+            if (echo.bytes > 0) echo.held_ms = (uint16)G3D::min(current_time_ms() - echo.received_ms, (uint32)0xFFFF);
+            BinaryUtils::writeFrameEcho(*header, echo);
+            BinaryUtils::writeClockRequest(*header);
+            MultiView::write(*header, views);
+            if (Constants::INTEREST_MANAGEMENT) Interest::write(*header, RegionCull::tanHalfFovY(camera, (float)Constants::SCREEN_WIDTH, (float)Constants::SCREEN_HEIGHT), interest);
+            sent_views = views;
+            echo.bytes = 0;
+
+            send(PacketType::UPDATE, *header, *batch);
+            ++in_flight;
             cout << "Update " << current_batch_id << " sent at " << current_time_ms() << endl;
 			return true;
 		}
@@ -0,0 +1,175 @@
+#pragma once
+#include <G3D/G3D.h>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+/* =========================================
+ *               Clock Sync
+ * =========================================
+ *
+ * The router's clock is the cluster's clock. Every other node estimates
+ * the offset of its own clock from the router's, and how fast that offset
+ * drifts, the way NTP does, from timestamps that ride on packets already
+ * going back and forth:
+ *
+ *     node    t1 ---- FRAGMENT / UPDATE ----> t2  router
+ *     node    t4 <------ UPDATE / FRAME ----- t3  router
+ *
+ * The node stamps t1 on its way out, the router notes t2 when it gets it
+ * and echoes both back with t3 on the next packet the other way, which the
+ * node stamps t4. Then
+ *
+ *     offset = ((t2 - t1) + (t3 - t4)) / 2
+ *     delay  = (t4 - t1) - (t3 - t2)
+ *
+ * so however long the router holds on to the exchange (waiting for the
+ * client, rendering) drops out. Queueing makes single samples noisy, so the
+ * offset is taken from the sample with the least delay in the last WINDOW,
+ * and the drift is a least squares fit through those filtered offsets.
+ *
+ * clusterTimeNs() is the local clock corrected by that estimate. Once the
+ * first exchange has set it, it never goes backwards, so time differences
+ * taken on one node stay non-negative when the estimate moves. Until then,
+ * and always on the router, it is the local clock.
+ */
+
+namespace DistributedRenderer {
+
+    // One exchange, 0 origin_ns when there is nothing to echo
+    typedef struct {
+        int64 origin_ns;      // t1, on the node's clock
+        int64 received_ns;    // t2, on the router's clock
+        int64 transmitted_ns; // t3, on the router's clock
+    } clock_echo_t;
+
+    class ClockSync {
+        private:
+
+            typedef struct {
+                int64 local_ns; // midpoint of the exchange on our clock
+                int64 offset_ns;
+                int64 delay_ns;
+            } sample_t;
+
+            mutable std::mutex lock;
+            Array<sample_t> window;  // the last WINDOW samples
+            Array<sample_t> history; // the best of every WINDOW samples, for the drift
+            int since_fit;
+
+            // offset_ns at base_ns, changing by drift ns per ns
+            int64 base_ns;
+            int64 offset_ns;
+            double drift;
+            int64 delay_ns;
+            bool synced;
+
+            std::atomic<int64> last_ns;
+
+            ClockSync() : since_fit(0), base_ns(0), offset_ns(0), drift(0), delay_ns(0), synced(false), last_ns(0) {}
+
+            // @pre: lock is held
+            // @post: offset and drift are a least squares fit through history
+            void fit() {
+                const sample_t& newest = history.last();
+                if (history.size() < 2 || newest.local_ns - history[0].local_ns < MIN_DRIFT_SPAN_NS) {
+                    base_ns = newest.local_ns;
+                    offset_ns = newest.offset_ns;
+                    drift = 0;
+                    return;
+                }
+
+                // relative to the newest sample so doubles keep their precision
+                double sx = 0, sy = 0, sxx = 0, sxy = 0;
+                const double n = history.size();
+                for (int i = 0; i < history.size(); i++) {
+                    const double x = (double)(history[i].local_ns - newest.local_ns);
+                    const double y = (double)(history[i].offset_ns - newest.offset_ns);
+                    sx += x;
+                    sy += y;
+                    sxx += x * x;
+                    sxy += x * y;
+                }
+                const double d = n * sxx - sx * sx;
+                const double max_drift = MAX_DRIFT_PPM * 1e-6;
+                drift = (d > 0) ? G3D::clamp((n * sxy - sx * sy) / d, -max_drift, max_drift) : 0.0;
+
+                // the line goes through the mean, moved to the newest sample's time
+                const double mean_x = sx / n;
+                const double mean_y = sy / n;
+                base_ns = newest.local_ns;
+                offset_ns = newest.offset_ns + (int64)(mean_y - drift * mean_x);
+            }
+
+        public:
+            static const int WINDOW = 8;
+            static const int HISTORY = 64;
+            static const int64 MIN_DRIFT_SPAN_NS = 2000000000LL; // drift is 0 until the history covers this much
+            static const int MAX_DRIFT_PPM = 500;                   // NTP's limit, quartz is well inside it
+
+            static ClockSync& instance() {
+                static ClockSync sync;
+                return sync;
+            }
+
+            // this machine's clock, what every exchange is stamped with
+            static int64 localTimeNs() {
+                return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+            }
+
+            // @pre: an echo from the router and our clock when it arrived
+            // @post: the estimate includes the exchange if it was one
+            void onEcho(const clock_echo_t& echo, int64 destination_ns) {
+                if (echo.origin_ns == 0) return;
+
+                sample_t s;
+                s.delay_ns = (destination_ns - echo.origin_ns) - (echo.transmitted_ns - echo.received_ns);
+                s.offset_ns = ((echo.received_ns - echo.origin_ns) + (echo.transmitted_ns - destination_ns)) / 2;
+                s.local_ns = echo.origin_ns + (destination_ns - echo.origin_ns) / 2;
+
+                // a negative delay is a mangled or mismatched echo
+                if (s.delay_ns < 0) return;
+
+                std::lock_guard<std::mutex> guard(lock);
+                if (window.size() == WINDOW) window.remove(0);
+                window.append(s);
+
+                int best = 0;
+                for (int i = 1; i < window.size(); i++) {
+                    if (window[i].delay_ns < window[best].delay_ns) best = i;
+                }
+
+                // the best of every WINDOW samples goes into the fit, the first straight away
+                if (++since_fit == WINDOW || history.size() == 0) {
+                    if (history.size() == HISTORY) history.remove(0);
+                    history.append(window[best]);
+                    fit();
+                    since_fit = 0;
+                }
+                delay_ns = window[best].delay_ns;
+
+                // the first estimate is a step, after that cluster time only moves forwards
+                if (!synced) last_ns = 0;
+                synced = true;
+            }
+
+            // @return: what to add to our clock at local_ns to get the router's
+            int64 offsetNs(int64 local_ns) const {
+                std::lock_guard<std::mutex> guard(lock);
+                return offset_ns + (int64)(drift * (double)(local_ns - base_ns));
+            }
+
+            int64 clusterTimeNs() {
+                const int64 local = localTimeNs();
+                const int64 t = local + offsetNs(local);
+
+                int64 prev = last_ns.load();
+                while (t > prev && !last_ns.compare_exchange_weak(prev, t)) {}
+                return G3D::max(t, prev);
+            }
+
+            bool synchronized() const { std::lock_guard<std::mutex> guard(lock); return synced; }
+            double driftPpm() const { std::lock_guard<std::mutex> guard(lock); return drift * 1e6; }
+            double delayMs() const { std::lock_guard<std::mutex> guard(lock); return delay_ns / 1e6; }
+    };
+}
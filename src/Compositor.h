@@ -0,0 +1,164 @@
+#pragma once
+#include <G3D/G3D.h>
+#include <emmintrin.h>
+#include "FramePool.h"
+
+/* =========================================
+ *               Compositor
+ * =========================================
+ *
+ * Places (rect, pixels) regions into one persistent frame buffer. Regions
+ * may be any size and anywhere in the frame, so strips of unequal height,
+ * tiles and partial updates all go through the same path. Rows are copied
+ * with unaligned SSE2 loads and stores, a region stored bottom-up is flipped
+ * while it is copied, and separate regions are placed on separate threads.
+ *
+ * For sort-last rendering the compositor can also z-merge full screen
+ * layers, keeping the nearest colour at every pixel (direct-send at the
+ * router). Depths are compared four at a time and rows are split across
+ * threads.
+ */
+
+namespace DistributedRenderer {
+
+    class Compositor {
+        public:
+            typedef struct {
+                // where the region goes in the frame, rows top to bottom
+                Rect2D rect;
+                // first row of the region as stored, rows stride bytes apart
+                const uint8* pixels;
+                size_t stride;
+                // true if pixels holds the bottom row first
+                bool flip;
+            } region_t;
+
+            typedef struct {
+                // a full frame of colour, rows top to bottom
+                const uint8* color;
+                size_t color_stride;
+                // the matching depth, smaller is nearer, depth_stride floats per row
+                const float* depth;
+                size_t depth_stride;
+            } layer_t;
+
+        private:
+            shared_ptr<CPUPixelTransferBuffer> frame;
+            size_t bytes_per_pixel;
+
+        public:
+            Compositor(int width, int height, const ImageFormat* format = ImageFormat::RGB8()) {
+                frame = FramePool::instance().cpu(width, height, format);
+                bytes_per_pixel = iCeil(format->cpuBitsPerPixel / 8.0f);
+            }
+
+            static shared_ptr<Compositor> create(int width, int height, const ImageFormat* format = ImageFormat::RGB8()) {
+                return createShared<Compositor>(width, height, format);
+            }
+
+            // the composited frame, it is reused every frame and comes back to the pool with the compositor
+            const shared_ptr<CPUPixelTransferBuffer>& buffer() { return frame; }
+
+            static region_t region(const Rect2D& rect, const uint8* pixels, size_t stride, bool flip = false) {
+                region_t r;
+                r.rect = rect;
+                r.pixels = pixels;
+                r.stride = stride;
+                r.flip = flip;
+                return r;
+            }
+
+            static void copyRow(uint8* dst, const uint8* src, size_t n) {
+                size_t i = 0;
+                for (; i + 64 <= n; i += 64) {
+                    const __m128i a = _mm_loadu_si128((const __m128i*)(src + i));
+                    const __m128i b = _mm_loadu_si128((const __m128i*)(src + i + 16));
+                    const __m128i c = _mm_loadu_si128((const __m128i*)(src + i + 32));
+                    const __m128i d = _mm_loadu_si128((const __m128i*)(src + i + 48));
+                    _mm_storeu_si128((__m128i*)(dst + i), a);
+                    _mm_storeu_si128((__m128i*)(dst + i + 16), b);
+                    _mm_storeu_si128((__m128i*)(dst + i + 32), c);
+                    _mm_storeu_si128((__m128i*)(dst + i + 48), d);
+                }
+                for (; i + 16 <= n; i += 16) {
+                    _mm_storeu_si128((__m128i*)(dst + i), _mm_loadu_si128((const __m128i*)(src + i)));
+                }
+                for (; i < n; i++) dst[i] = src[i];
+            }
+
+            // @post: copies one region into the frame, clipped to the frame
+            void place(const region_t& r) {
+                const Rect2D& clipped = r.rect.intersect(Rect2D::xywh(0, 0, (float)frame->width(), (float)frame->height()));
+                if (clipped.isEmpty()) return;
+
+                const int x0 = (int)clipped.x0();
+                const int y0 = (int)clipped.y0();
+                const int w = (int)clipped.width();
+                const int h = (int)clipped.height();
+
+                // offset into the source if the region hung off the frame
+                const int skip_x = x0 - (int)r.rect.x0();
+                const int skip_y = y0 - (int)r.rect.y0();
+                const int src_h = (int)r.rect.height();
+
+                uint8* dst = (uint8*)frame->buffer();
+                const size_t n = w * bytes_per_pixel;
+
+                for (int row = 0; row < h; row++) {
+                    const int src_row = r.flip ? (src_h - 1 - (row + skip_y)) : (row + skip_y);
+                    copyRow(dst + frame->rowOffset(y0 + row) + x0 * bytes_per_pixel,
+                            r.pixels + src_row * r.stride + skip_x * bytes_per_pixel, n);
+                }
+            }
+
+            // @post: the frame holds, at every pixel, the colour of the layer with the nearest depth
+            void depthMerge(const Array<layer_t>& layers) {
+                if (layers.size() == 0) return;
+
+                BEGIN_PROFILER_EVENT("Compositor::depthMerge");
+                const int width = frame->width();
+                uint8* dst = (uint8*)frame->buffer();
+
+                runConcurrently(0, frame->height(), [&](int y) {
+                    uint8* out = dst + frame->rowOffset(y);
+
+                    for (int x = 0; x < width; x += 4) {
+                        const int lanes = G3D::min(4, width - x);
+
+                        // nearest depth and its layer index, four pixels at a time
+                        alignas(16) float load[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+                        alignas(16) int32 winner[4];
+
+                        System::memcpy(load, layers[0].depth + y * layers[0].depth_stride + x, lanes * sizeof(float));
+                        __m128 best = _mm_load_ps(load);
+                        __m128i index = _mm_setzero_si128();
+
+                        for (int l = 1; l < layers.size(); l++) {
+                            System::memcpy(load, layers[l].depth + y * layers[l].depth_stride + x, lanes * sizeof(float));
+                            const __m128 d = _mm_load_ps(load);
+                            const __m128i nearer = _mm_castps_si128(_mm_cmplt_ps(d, best));
+                            best = _mm_min_ps(d, best);
+                            index = _mm_or_si128(_mm_and_si128(nearer, _mm_set1_epi32(l)), _mm_andnot_si128(nearer, index));
+                        }
+                        _mm_store_si128((__m128i*)winner, index);
+
+                        for (int k = 0; k < lanes; k++) {
+                            const layer_t& layer = layers[winner[k]];
+                            const uint8* src = layer.color + y * layer.color_stride + (x + k) * bytes_per_pixel;
+                            for (size_t b = 0; b < bytes_per_pixel; b++) out[(x + k) * bytes_per_pixel + b] = src[b];
+                        }
+                    }
+                });
+                END_PROFILER_EVENT();
+            }
+
+            // @post: places every region, one thread per region
+            void composite(const Array<region_t>& regions) {
+                BEGIN_PROFILER_EVENT("Compositor::composite");
+                runConcurrently(0, regions.size(), [&](int i) {
+                    place(regions[i]);
+                });
+                END_PROFILER_EVENT();
+            }
+    };
+}
@@ -9,6 +9,19 @@
 #include <array>
 #include <chrono>
 #include "FramebufferDist.h"
+#include "FrameCodec.h"
+#include "RateController.h"
+#include "ResolutionController.h"
+#include "FramePool.h"
+#include "CPURenderer.h"
+#include "Foveation.h"
+#include "ClockSync.h"
+#include "FrameTrace.h"
+#include "MultiView.h"
+#include "EntityTable.h"
+#include "PropertyReplication.h"
+#include "RegionCull.h"
+#include "TransformBlock.h"
 
 using namespace G3D;
 using namespace std;
@@ -24,6 +37,25 @@ using namespace chrono;
 
 namespace DistributedRenderer {
 
+    // What a Remote renders its strip with
+    enum RenderBackend {
+        GPU_BACKEND,
+        CPU_BACKEND // software rasterizer, see CPURenderer
+    };
+
+    // How work is split between remotes
+    enum RenderMode {
+        SORT_FIRST, // every remote renders every entity for its own strip of the screen
+        SORT_LAST,      // every remote renders its own entities for the whole screen, merged by depth
+        ALTERNATE_FRAME // remotes take turns rendering whole frames, the router sends them on in batch order
+    };
+
+    // Which remote renders the next batch when alternate-frame
+    enum AFRSchedule {
+        ROUND_ROBIN, // in turn
+        LEAST_LOADED // the one with the fewest batches outstanding, then the quickest
+    };
+
     namespace Constants {
 
         // display        
@@ -32,12 +64,70 @@ namespace DistributedRenderer {
 
         // networking
         static const RealTime CONNECTION_WAIT = 2;
-        static const bool COMPRESS_NETWORK_DATA = false;
+        static const bool COMPRESS_NETWORK_DATA = true; // false sends raw frames, for fast LANs where encoding costs more than the wire
 
         static const uint16 PORT = 8080; // node port
 
         static NetAddress ROUTER_ADDR ("137.165.8.92", PORT);
 
+        // frame encoding, the first codec both ends of a link support is used
+        static const CodecID CODEC_PREFERENCE[] = { MOTION_CODEC, BLOCK_DELTA_CODEC, LZ4_CODEC, QOI_CODEC, JPEG_CODEC, RAW_CODEC };
+        static const int NUM_CODEC_PREFERENCES = sizeof(CODEC_PREFERENCE) / sizeof(CODEC_PREFERENCE[0]);
+        static const bool YUV_TO_CLIENT = false; // send the client planar YUV420 whatever the preference, it converts on the GPU
+
+        // rate control, per link
+        static const double TARGET_MBPS = 1000.0;     // bitrate a single stream should stay under
+        static const double LATENCY_BUDGET_MS = 33.0; // round trip a frame may take, processing excluded
+        static const uint32 KEYFRAME_INTERVAL = 60; // frames between full block delta keyframes, and over which motion intra refresh cycles
+        static const char* RECORD_WALKTHROUGH_DIR = ""; // remotes save every strip and its motion here for CodecBenchmark, empty for off
+        static const char* TRACE_DIR = ""; // every node records its per-batch spans here for TraceMerge, empty for off
+
+        // rendering
+        static const RenderBackend REMOTE_BACKEND = GPU_BACKEND; // CPU_BACKEND still opens a hidden GL window, a GPU-less node needs a software GL
+        static const RenderMode RENDER_MODE = SORT_FIRST;
+        static const AFRSchedule AFR_SCHEDULE = LEAST_LOADED;
+        static const double AFR_DEADLINE_MS = 250.0; // alternate-frame, a batch waits this long on a view before the client gets the one it last saw
+        static const bool HEADLESS_REMOTES = true; // remotes get a hidden window, no vsync, no swaps and no developer GUI
+        static const char* SHADER_CACHE_DIR = "shader-cache"; // relative to the working directory
+
+        // foveation, sort-first and single view only: strips outside the band around the view centre are reduced
+        static const bool FOVEATED = false;
+        static const float FOVEA_FRACTION = 0.3f;      // height of the full resolution band, as a fraction of the screen
+        static const uint8 PERIPHERY_SCALE = 2;        // peripheral strips are rendered at 1 / this resolution
+        static const uint8 PERIPHERY_MAX_QUALITY = 60; // and encoded at most at this quality
+
+        // dynamic resolution, sort-first only: the router scales the whole frame to keep its time per batch on target
+        static const bool DYNAMIC_RESOLUTION = false;
+        static const double FRAME_TIME_TARGET_MS = 12.0; // UPDATE in to FRAME out at the router
+        static const uint8 MIN_RENDER_SCALE = 50;        // percent of full resolution each way
+        static const float UPSCALE_SHARPNESS = 0.5f;     // how hard the client sharpens a scaled frame, 0 for plain bilinear
+
+        // views: every batch is rendered from each camera of the layout, see MultiView.h
+        static const ViewLayout VIEW_LAYOUT = SINGLE_VIEW;
+        static const float EYE_SEPARATION = 0.064f;  // metres between the stereo cameras
+        static const float MINIMAP_HEIGHT = 40.0f;   // metres the minimap camera is above the player's
+        static const float MINIMAP_FRACTION = 0.3f;  // of the window each way the minimap covers
+
+        // sessions: several clients share the remotes, each with its own scene state, streams and frame
+        static const uint32 MAX_CLIENTS = 4;
+        static const uint8 CLIENT_WEIGHT = 1;              // this client's share of the remotes' time against the others', sent with HI_AM_CLIENT
+        static const uint32 POOL_BATCHES = 2;              // batches the router lets be out on the remotes at once, per remote when alternate-frame
+        static const RealTime SESSION_STATS_INTERVAL = 5;  // seconds between the router's per-session reports, 0 for none
+
+        // interest management: each remote only hears of the entities that can show up in its rows, see Interest.h
+        static const bool INTEREST_MANAGEMENT = false;
+        static const float INTEREST_MARGIN = 32.0f; // rows either side of a remote's that still count as its
+
+        // region culling: remotes cull entities and surfaces against the frustum of their rect of the screen, see RegionCull.h
+        static const bool REGION_CULLING = true;
+        static const float REGION_CULL_MARGIN = 16.0f; // rows either side of the rect, for the guard band
+
+        // sync: frames go in one TransformBlock per update, applied across cores from this many entities up
+        static const uint32 PARALLEL_APPLY_MIN = 2048;
+
+        // memory
+        static const bool USE_HUGE_PAGES = false; // back pooled frame buffers with 2 MB pages
+
     }
 
 	enum NodeType {
@@ -55,7 +145,9 @@ namespace DistributedRenderer {
         READY,
         TERMINATE,
         HI_AM_REMOTE,
-        HI_AM_CLIENT
+        HI_AM_CLIENT,
+        SNAPSHOT,      // one session's entities, to a remote joining a running network
+        REGIONS        // a client's region table again, after the remotes were laid out anew
     };
 
     // =========================================
@@ -85,10 +177,51 @@ namespace DistributedRenderer {
 		return false;
     }
 
+    // Row order of a FRAGMENT or FRAME body. Rows travel in the order the sender
+    // holds them and are never flipped on the way: receivers decode bottom-up
+    // strips through a negative stride, and the client flips at draw time
+    enum FrameFlags {
+        FRAME_BOTTOM_UP = 1 // first row is the bottom of the image
+    };
+
+    // Records of an UPDATE body, back to back, each its kind and an entity's NetID, see EntityTable.
+    // A spawn carries the entity's name and spec, G3D Any text such as VisibleEntity { model = ...; },
+    // and then its frame, so a remote never draws it anywhere the client did not put it
+    enum UpdateRecord {
+        ENTITY_FRAME,   // x, y, z, yaw, pitch, roll
+        ENTITY_SPAWN,   // name, spec, then the frame
+        ENTITY_DESPAWN,
+        ENTITY_PROPERTIES, // what changed, see PropertyReplication
+        ENTITY_FRAME_BLOCK // the count in place of a NetID, then the frames of that many entities as arrays, see TransformBlock
+    };
+
+    // Header carried by every FRAGMENT and FRAME packet
+    typedef struct {
+        uint32 batch_id;
+        uint8 encoding; // CodecID of the body
+        uint8 flags;    // FrameFlags
+        uint8 quality;  // what the rate controller asked the codec for
+        uint8 render_scale; // percent of full resolution each way, see ResolutionController
+        uint32 sent_ms; // cluster time
+        uint16 held_ms; // time between the sender getting the batch's UPDATE and sending this
+    } frame_header_t;
+
+    // The client's receipt for the last frame, sent back with its next UPDATE
+    // so the router can measure the link. bytes is 0 when there is nothing to report
+    typedef struct {
+        uint32 sent_ms;     // the frame's sent_ms
+        uint32 received_ms; // cluster time
+        uint32 bytes;
+        uint16 held_ms;     // time between the frame arriving and this UPDATE leaving
+    } frame_echo_t;
+
+	// the router's clock as best this node knows it, comparable across machines, see ClockSync
+	static int64 clusterTimeNs() {
+		return ClockSync::instance().clusterTimeNs();
+	}
+
 	static uint32 current_time_ms() {
-		return (uint32) duration_cast<milliseconds>(
-			system_clock::now().time_since_epoch()
-		).count();
+		return (uint32)(clusterTimeNs() / 1000000);
 	}
 
     // Easy conversion of data types to BinaryOutputs
@@ -115,6 +248,131 @@ namespace DistributedRenderer {
                 return bo;
             }
 
+            // The codecs this node can handle, the body of HI_AM_REMOTE and HI_AM_CLIENT
+            static BinaryOutput* codecs() {
+                return toBinaryOutput(FrameCodec::supportedMask());
+            }
+
+            // Pick the codec for one link given the mask its far end sent
+            static CodecID negotiateCodec(uint32 remote_mask) {
+                if (!Constants::COMPRESS_NETWORK_DATA) return RAW_CODEC;
+
+                Array<uint32> masks;
+                masks.append(FrameCodec::supportedMask(), remote_mask);
+                return FrameCodec::negotiate(Constants::CODEC_PREFERENCE, Constants::NUM_CODEC_PREFERENCES, masks);
+            }
+
+            // Read a HI_AM body, nodes from before codec negotiation only spoke JPEG
+            static uint32 readCodecs(BinaryInput& in) {
+                return (in.getLength() >= 4) ? in.readUInt32() : (1 << JPEG_CODEC);
+            }
+
+            // The client's share of the remotes, after its codecs in HI_AM_CLIENT
+            static BinaryOutput* clientHello() {
+                BinaryOutput* bo = codecs();
+                bo->writeUInt8(Constants::CLIENT_WEIGHT);
+                return bo;
+            }
+
+            // Read the rest of a HI_AM_CLIENT body, clients from before sessions all weigh the same
+            static uint8 readWeight(BinaryInput& in) {
+                return in.hasMore() ? in.readUInt8() : 1;
+            }
+
+            // Write a frame header to a binary output
+            static BinaryOutput* toBinaryOutput(const frame_header_t& header) {
+                BinaryOutput* bo = BinaryUtils::create();
+                bo->writeUInt32(header.batch_id);
+                bo->writeUInt8(header.encoding);
+                bo->writeUInt8(header.flags);
+                bo->writeUInt8(header.quality);
+                bo->writeUInt8(header.render_scale);
+                bo->writeUInt32(header.sent_ms);
+                bo->writeUInt16(header.held_ms);
+                return bo;
+            }
+
+            static frame_header_t readFrameHeader(BinaryInput& in) {
+                frame_header_t header;
+                header.batch_id = in.readUInt32();
+                header.encoding = in.readUInt8();
+                header.flags = in.readUInt8();
+                header.quality = in.readUInt8();
+                header.render_scale = in.readUInt8();
+                header.sent_ms = in.readUInt32();
+                header.held_ms = in.readUInt16();
+                return header;
+            }
+
+            static void writeFrameEcho(BinaryOutput& bo, const frame_echo_t& echo) {
+                bo.writeUInt32(echo.sent_ms);
+                bo.writeUInt32(echo.received_ms);
+                bo.writeUInt32(echo.bytes);
+                bo.writeUInt16(echo.held_ms);
+            }
+
+            static frame_echo_t readFrameEcho(BinaryInput& in) {
+                frame_echo_t echo;
+                echo.sent_ms = in.readUInt32();
+                echo.received_ms = in.readUInt32();
+                echo.bytes = in.readUInt32();
+                echo.held_ms = in.readUInt16();
+                return echo;
+            }
+
+            // The node's half of a clock exchange, stamped on its way out. Rides on UPDATE from
+            // the client and on FRAGMENT from remotes, right after the frame echo or frame header
+            static void writeClockRequest(BinaryOutput& bo) {
+                bo.writeInt64(ClockSync::localTimeNs());
+            }
+
+            // @return: the exchange, noted as received now
+            static clock_echo_t readClockRequest(BinaryInput& in) {
+                clock_echo_t echo;
+                echo.origin_ns = in.readInt64();
+                echo.received_ns = ClockSync::localTimeNs();
+                echo.transmitted_ns = 0;
+                return echo;
+            }
+
+            // The router's half, stamped transmitted now. Rides on the next UPDATE to the
+            // remote or FRAME to the client, after the quality or frame header
+            static void writeClockEcho(BinaryOutput& bo, const clock_echo_t& echo) {
+                bo.writeInt64(echo.origin_ns);
+                bo.writeInt64(echo.received_ns);
+                bo.writeInt64(ClockSync::localTimeNs());
+            }
+
+            static clock_echo_t readClockEcho(BinaryInput& in) {
+                clock_echo_t echo;
+                echo.origin_ns = in.readInt64();
+                echo.received_ns = in.readInt64();
+                echo.transmitted_ns = in.readInt64();
+                return echo;
+            }
+
+            // An entity's frame in an UPDATE record
+            static void writeEntityFrame(BinaryOutput& bo, const CoordinateFrame& frame) {
+                float x, y, z, yaw, pitch, roll;
+                frame.getXYZYPRRadians(x, y, z, yaw, pitch, roll);
+                bo.writeFloat32(x);
+                bo.writeFloat32(y);
+                bo.writeFloat32(z);
+                bo.writeFloat32(yaw);
+                bo.writeFloat32(pitch);
+                bo.writeFloat32(roll);
+            }
+
+            static CoordinateFrame readEntityFrame(BinaryInput& in) {
+                const float x = in.readFloat32();
+                const float y = in.readFloat32();
+                const float z = in.readFloat32();
+                const float yaw = in.readFloat32();
+                const float pitch = in.readFloat32();
+                const float roll = in.readFloat32();
+                return CoordinateFrame::fromXYZYPRRadians(x, y, z, yaw, pitch, roll);
+            }
+
             // Convert a BinaryInput to a BinaryOutput
             static BinaryOutput* toBinaryOutput(BinaryInput* in) {
 				BinaryOutput* bo = BinaryUtils::create();
@@ -162,9 +420,13 @@ namespace DistributedRenderer {
             // Each entity in the scene will have a registered network ID
             // which should be the same over all instances of the application 
             // then at runtime, transforms will be synced across the network
-            // before rendering a frame
-            vector<shared_ptr<Entity>> entities;
-            map<String, uint32> entity_index_by_name;
+            // before rendering a frame. Loaded entities are numbered by the
+            // stable hash of their names, spawned ones by the client
+            EntityTable entity_table;
+
+            // every visible entity, changing or not, in scene order, used to
+            // split the scene between remotes when rendering sort-last
+            vector<shared_ptr<VisibleEntity>> visible_entities;
 
             shared_ptr<NetConnection> connection; 
 
@@ -205,26 +467,23 @@ namespace DistributedRenderer {
 
             bool isHeadless() { return headless; }
 
-            // register all entities to be tracked by the network 
-            // currently, this does not support adding or removing entities
+            // register all entities loaded with the scene to be tracked by the network,
+            // entities added later are spawned through the client
             void trackEntities(Array<shared_ptr<Entity>>* e) {
-                // make an ID lookup for tracking
-                int index = 0;
+                Array<shared_ptr<Entity>> changing;
                 for(int i = 0; i < e->size(); i++){
                     shared_ptr<Entity> ent = (*e)[i];
-                    if(ent->canChange()){
-                        entities.push_back(ent);
-                        entity_index_by_name[ent->name()] = index++;
-                    }
-                }
-            }
+                    if(ent->canChange()) changing.append(ent);
 
-            uint32 getEntityIDByName(String name){
-                return entity_index_by_name[name];
+                    shared_ptr<VisibleEntity> visible = dynamic_pointer_cast<VisibleEntity>(ent);
+                    if (notNull(visible)) visible_entities.push_back(visible);
+                }
+                entity_table.load(changing);
             }
 
-            shared_ptr<Entity> getEntityByID(uint32 id){
-                return entities[id];
+            // @return: null if the entity is gone or the ID never named one
+            shared_ptr<Entity> getEntityByID(EntityTable::NetID id){
+                return entity_table.get(id);
             }
 
     };
@@ -234,9 +493,53 @@ namespace DistributedRenderer {
             uint32 current_batch_id = 0; 
             float ms_to_deadline = 0;
 
-            RealTime last_update = 0;
+            // what the remotes were last told of every entity, by slot, updates carry what differs
+            Array<PropertyReplication::state_t> sent_states;
+
+            // the frames of the next update, sent as one block
+            TransformBlock frame_block;
+
+            // frame cache, frames are decoded into this in place
+            shared_ptr<CPUPixelTransferBuffer> frame_pixels;
+
+            // the codec the router picked for its frames, sent with READY
+            shared_ptr<FrameCodec> codec;
+
+            // receipt for the last frame, goes out with the next update
+            frame_echo_t echo;
+
+            // where each region of the screen is in the frames, as sent with READY and at the scale
+            // frames arrive at now. Unless the frame is the screen itself every region is uploaded to its own texture
+            Array<Foveation::region_t> full_regions;
+            Array<Foveation::region_t> regions;
+            uint8 frame_scale = ResolutionController::MAX_SCALE;
+            Array<shared_ptr<CPUPixelTransferBuffer>> region_pixels;
+            Array<shared_ptr<Texture>> region_textures;
+
+            // updates sent whose frames have not come back, and how many the router lets be, sent with READY
+            uint32 in_flight = 0;
+            uint32 max_in_flight = 1;
 
-            // frame cache
+            // Y, Cb and Cr of the frame when the codec hands out planes, converted to RGB by the app's shader
+            shared_ptr<CPUPixelTransferBuffer> plane_pixels[3];
+            shared_ptr<Texture> plane_textures[3];
+
+            // every view after the first is a stream of its own, decoded to a texture of its own
+            Array<shared_ptr<FrameCodec>> view_codecs;
+            Array<shared_ptr<CPUPixelTransferBuffer>> view_pixels;
+            Array<shared_ptr<Texture>> view_textures;
+
+            // the cameras the last update went out with
+            Array<MultiView::view_t> sent_views;
+
+            // spawns and despawns since the last update, they go out ahead of its frames
+            BinaryOutput* lifecycle;
+
+            void setRegions(BinaryInput& bi);
+            void setFrameScale(uint8 percent);
+            void setPlanes();
+            bool decodeLayer(uint8 view, BinaryInput& in);
+            void captureSent(int slot);
 
             void onConnect() override;
 
@@ -247,17 +550,101 @@ namespace DistributedRenderer {
 
             bool checkNetwork();
 
+            // entities created and destroyed at runtime, projectiles, crowds
+            EntityTable::NetID spawn(const String& name, const Any& spec);
+            bool despawn(EntityTable::NetID id);
+
+            // the batch id the next update goes out with
+            uint32 nextBatchId() const { return current_batch_id; }
+
+            uint32 framesInFlight() const { return in_flight; }
+
+            // the next update has to wait for a frame
+            bool pipelineFull() const { return in_flight >= max_in_flight; }
+
     };
 
     class Remote : public NetworkNode{
         protected:
+            // One client's view of the scene. Every session moves the same entities its own
+            // way, and its strips of every view go out as a stream of their own
+            typedef struct {
+                uint8 id;
+                Array<shared_ptr<FrameCodec>> codecs; // one per view
+                uint8 render_scale;
+                Array<PropertyReplication::state_t> states; // every entity by slot, as the session last set it
+                EntityTable table; // the loaded entities and the ones the session's client spawned
+            } session_t;
+
             Rect2D bounds; 
+            RenderMode mode = SORT_FIRST;
+
+            // when sort-last, our share of the entities, by the stable hash of their names
+            uint32 partition_index = 0;
+            uint32 partition_count = 1;
+
+            // the codec the router picked for our fragments, sent with CONFIG, the current
+            // view's instance of it, and the quality the router wants for the current batch
+            CodecID codec_id = RAW_CODEC;
+            shared_ptr<FrameCodec> codec;
+            uint8 quality = RateController::MAX_QUALITY;
+            uint32 update_received_ms = 0;
+
+            // every session seen so far, the one the scene holds now, and the scene as loaded
+            map<uint8, session_t> sessions;
+            session_t* session = nullptr;
+            Array<PropertyReplication::state_t> loaded_states;
+
+            // the last frame block synced, decoded in place every update
+            TransformBlock transforms;
+
+            // only used with the CPU backend
+            CPURenderer cpu_renderer;
+            shared_ptr<CPUPixelTransferBuffer> cpu_strip;
+
+            // GPU readback targets, taken from the frame pool every frame
+            shared_ptr<GLPixelTransferBuffer> readback;
+            shared_ptr<GLPixelTransferBuffer> depth_readback;
+            shared_ptr<GLPixelTransferBuffer> motion_readback;
+
+            // sort-last, compresses the depth that goes ahead of every layer
+            DepthPlane depth_plane;
+
+            // the strip is sent at 1 / scale resolution, from here
+            uint8 scale = 1;
+            shared_ptr<CPUPixelTransferBuffer> scaled_strip;
+
+            // and on top of that at render_scale percent, the router picks it every batch
+            uint8 render_scale = ResolutionController::MAX_SCALE;
             
             void sync(BinaryInput* update);
-            void sendFrame(uint32 batch_id);
+            void applyFrames();
+            void pose(SimTime t);
+            void spawnEntity(EntityTable::NetID id, const String& name, const String& spec, const CoordinateFrame& frame);
+            void despawnEntity(EntityTable::NetID id);
+            void showSpawned(session_t* s, bool shown);
+            void showEntities();
+            bool drawn(session_t* s, int slot) const;
+            bool owns(const String& name) const;
+            shared_ptr<PixelTransferBuffer> renderStrip(Rect2D& rect, bool& bottom_up);
+            void render(uint32 batch_id, uint8 mask, const Array<MultiView::view_t>& views);
+            void renderView(uint32 batch_id, int view, BinaryOutput& bo, bool& bottom_up);
+            void warmUp();
+            const float* renderDepth(shared_ptr<PixelTransferBuffer>& depth, size_t& stride);
+            const float* renderMotion(shared_ptr<PixelTransferBuffer>& motion, size_t& stride);
+            void record(uint32 batch_id, const shared_ptr<PixelTransferBuffer>& pixels, const Rect2D& rect, const float* motion, size_t motion_stride);
+            void encodeLayer(uint32 batch_id, const shared_ptr<PixelTransferBuffer>& pixels, const Rect2D& rect, BinaryOutput& bo, const float* depth = nullptr, size_t depth_stride = 0);
+            void sendFragment(uint32 batch_id, bool bottom_up, const Array<MultiView::layer_t>& layers, BinaryOutput* bo);
 
             void setClip(BinaryInput* bi);
             void setClip(uint32 y, uint32 height);
+            void setPartition(BinaryInput* bi);
+            void setCodec(BinaryInput* bi);
+            void setScale(BinaryInput* bi);
+            void setRenderScale(uint8 percent);
+            void setSession(uint8 id);
+            void configure(BinaryInput* bi);
+            void loadSnapshot(BinaryInput& header, BinaryInput& body);
             
             void onConnect() override;
 
@@ -265,6 +652,8 @@ namespace DistributedRenderer {
             Remote(RApp* app, bool headless_mode);
             void receive();
             Rect2D getClip() { return bounds; }
+            Rect2D getRenderedClip() const;
+            bool shades(const shared_ptr<Entity>& e) const;
     };
 
     class RApp : public GApp {
@@ -276,6 +665,40 @@ namespace DistributedRenderer {
 
             shared_ptr<FramebufferDist>     m_finalFrameBuffer;
 
+            // the client's frame arrived bottom row first, flip it when it is drawn
+            bool                            m_finalFrameBottomUp = false;
+
+            // when foveated, the frame comes as one texture per region, each stretched over its rows of the screen
+            Array<Foveation::region_t>      m_finalFrameRegions;
+            Array<shared_ptr<Texture>>      m_finalFrameRegionTextures;
+
+            // when the frame comes as YUV420 planes, Y, Cb and Cr, converted by YUVToRGB.pix as it is drawn
+            shared_ptr<Texture>             m_finalFramePlanes[3];
+
+            // every view of the layout after the first, each drawn in its own part of the window
+            Array<shared_ptr<Texture>>      m_finalFrameViews;
+
+            // the client's frame is below full resolution, sharpen it this much as it is upscaled
+            float                           m_finalFrameSharpness = 0.0f;
+
+            // a remote renders at this percent of the window each way, below full size the film pass
+            // writes into m_scaledFrameBuffer at that size instead of m_finalFrameBuffer
+            uint8                           m_renderScale = ResolutionController::MAX_SCALE;
+            shared_ptr<FramebufferDist>     m_scaledFrameBuffer;
+
+            // region culling, the regions of the views the next pose is rendered from, how far every
+            // entity reached from its origin when last posed, and what was culled, see RegionCull.h
+            Array<RegionCull::frustum_t>    m_cullRegions;
+            map<shared_ptr<Entity>, float>  m_poseReach;
+            RegionCull::stats_t             m_cullStats;
+
+            void drawFinalFrameTexture(const Rect2D& rect, const shared_ptr<Texture>& texture);
+            void cullBeforePose(Array<shared_ptr<VisibleEntity>>& hidden);
+            void rememberReach(const Array<shared_ptr<VisibleEntity>>& hidden);
+
+            // settings already adjusted for the node type, see getConstructorSettings
+            RApp(NodeType type, const GApp::Settings& adjusted);
+
         protected:
             NetworkNode* network_node;
 
@@ -290,17 +713,59 @@ namespace DistributedRenderer {
 				return m_framebuffer;
 			}
 
+			// depth of the last frame rendered, offset is where the screen starts inside the guard band
+			shared_ptr<Texture> depthTexture(Vector2int32& offset) {
+				offset = Vector2int32(settings().hdrFramebuffer.colorGuardBandThickness + settings().hdrFramebuffer.depthGuardBandThickness);
+				return m_framebuffer->texture(Framebuffer::DEPTH);
+			}
+
+			// screen-space motion of the last frame rendered, same offset as depthTexture, null if the G-buffer has none
+			shared_ptr<Texture> motionTexture(Vector2int32& offset) {
+				offset = Vector2int32(settings().hdrFramebuffer.colorGuardBandThickness + settings().hdrFramebuffer.depthGuardBandThickness);
+				return notNull(m_gbuffer) ? m_gbuffer->texture(GBuffer::Field::SS_POSITION_CHANGE) : nullptr;
+			}
+
 			void setFinalFrameBuffer(shared_ptr<FramebufferDist> b) 
 			{	
 				m_finalFrameBuffer = b;
 			}
 
+			void setFinalFrameBottomUp(bool b) { m_finalFrameBottomUp = b; }
+
+			void setFinalFrameRegions(const Array<Foveation::region_t>& regions, const Array<shared_ptr<Texture>>& textures) {
+				m_finalFrameRegions = regions;
+				m_finalFrameRegionTextures = textures;
+			}
+
+			void setFinalFrameViews(const Array<shared_ptr<Texture>>& textures) { m_finalFrameViews = textures; }
+
+			void setFinalFramePlanes(const shared_ptr<Texture> planes[3]) {
+				for (int i = 0; i < 3; i++) m_finalFramePlanes[i] = planes[i];
+			}
+
+			void setFinalFrameSharpness(float s) { m_finalFrameSharpness = s; }
+
+			void setRenderScale(uint8 percent) { m_renderScale = percent; }
+
+			// what the last frame was rendered into, the window's size or the render scale's
+			shared_ptr<FramebufferDist> renderedFrameBuffer() {
+				return (m_renderScale < ResolutionController::MAX_SCALE) ? m_scaledFrameBuffer : m_finalFrameBuffer;
+			}
+
+			// the regions of the views the next poseAdHoc is rendered from, none to pose everything
+			void setCullRegions(const Array<RegionCull::frustum_t>& regions) { m_cullRegions = regions; }
+
+			// what region culling left out, since the last poseAdHoc
+			const RegionCull::stats_t& cullStats() const { return m_cullStats; }
+
             virtual void onInit() override;
 		
 			int run();
             void onRun();
             void oneFrame();
-            void oneFrameAdHoc(); 
+            void oneFrameAdHoc();
+            void poseAdHoc();
+            void graphicsAdHoc();
             void onGraphics(RenderDevice* rd, Array<shared_ptr<Surface> >& surface, Array<shared_ptr<Surface2D> >& surface2D) override;
             void onGraphics3D(RenderDevice* rd, Array<shared_ptr<Surface> >& surface) override;
 
@@ -0,0 +1,147 @@
+#pragma once
+#include <G3D/G3D.h>
+
+/* =========================================
+ *               Entity Table
+ * =========================================
+ *
+ * Network IDs of the entities every node tracks. An ID is a slot in a
+ * dense table and the generation of that slot,
+ *
+ *     generation << SLOT_BITS | slot
+ *
+ * so a lookup is an index and a compare. A slot's generation goes up when
+ * its entity is removed, and an ID that outlived its entity, say in a
+ * batch that was already on its way, finds nothing instead of whatever
+ * took the slot since.
+ *
+ * Entities loaded with the scene fill the first slots, ordered by the
+ * stable hash of their names (by name on a tie), so every node numbers
+ * them the same whatever order its scene file lists them in. Entities
+ * spawned at runtime take free slots after them, picked by whoever spawns
+ * them and placed at that exact ID by everyone who hears of it.
+ */
+
+namespace DistributedRenderer {
+
+    class EntityTable {
+        public:
+            typedef uint32 NetID;
+
+            static const uint32 SLOT_BITS = 20;
+            static const uint32 SLOT_MASK = (1u << SLOT_BITS) - 1;
+            static const uint32 GENERATION_MASK = (1u << (32 - SLOT_BITS)) - 1;
+            static const NetID INVALID_ID = 0xFFFFFFFF;
+
+            // the last slot is never handed out, at its last generation its ID would be INVALID_ID
+            static const uint32 MAX_SLOTS = SLOT_MASK;
+
+            static uint32 slotOf(NetID id) { return id & SLOT_MASK; }
+            static uint32 generationOf(NetID id) { return id >> SLOT_BITS; }
+            static NetID makeID(uint32 slot, uint32 generation) { return ((generation & GENERATION_MASK) << SLOT_BITS) | slot; }
+
+            // FNV-1a, the same on every node and every run, unlike std::hash
+            static uint32 stableHash(const String& name) {
+                uint32 h = 2166136261u;
+                for (size_t i = 0; i < name.size(); i++) {
+                    h ^= (uint8)name[i];
+                    h *= 16777619u;
+                }
+                return h;
+            }
+
+        private:
+            typedef struct {
+                shared_ptr<Entity> entity;
+                uint32 generation;
+            } slot_t;
+
+            Array<slot_t> slots;
+            Array<uint32> free_slots;
+            int loaded = 0;
+
+            static bool hashOrder(const shared_ptr<Entity>& a, const shared_ptr<Entity>& b) {
+                const uint32 ha = stableHash(a->name());
+                const uint32 hb = stableHash(b->name());
+                return (ha != hb) ? (ha < hb) : (a->name() < b->name());
+            }
+
+        public:
+            // @pre: the scene's entities that can change, in any order
+            // @post: they hold the first slots, in stable hash order
+            void load(const Array<shared_ptr<Entity>>& scene) {
+                Array<shared_ptr<Entity>> sorted = scene;
+                sorted.sort(hashOrder);
+
+                slots.fastClear();
+                free_slots.fastClear();
+                for (int i = 0; i < sorted.size(); i++) {
+                    if (i > 0 && stableHash(sorted[i]->name()) == stableHash(sorted[i - 1]->name())) {
+                        debugPrintf("Entities %s and %s hash alike, they are told apart by name\n", sorted[i - 1]->name().c_str(), sorted[i]->name().c_str());
+                    }
+                    slot_t s = { sorted[i], 0 };
+                    slots.append(s);
+                }
+                loaded = slots.size();
+            }
+
+            // @post: entity holds a free slot after the loaded ones
+            // @return: its ID, INVALID_ID when the table is full
+            NetID add(const shared_ptr<Entity>& entity) {
+                uint32 slot;
+                if (free_slots.size() > 0) {
+                    slot = free_slots.pop();
+                } else {
+                    if ((uint32)slots.size() >= MAX_SLOTS) return INVALID_ID;
+                    slot = (uint32)slots.size();
+                    slot_t s = { nullptr, 0 };
+                    slots.append(s);
+                }
+                slots[slot].entity = entity;
+                return makeID(slot, slots[slot].generation);
+            }
+
+            // @post: entity holds the slot and generation of an ID someone else picked,
+            // replacing what held it
+            // @return: false if the ID is not one for runtime entities
+            bool addAt(NetID id, const shared_ptr<Entity>& entity) {
+                const uint32 slot = slotOf(id);
+                if (slot < (uint32)loaded || slot >= MAX_SLOTS) return false;
+                while ((uint32)slots.size() <= slot) {
+                    slot_t s = { nullptr, 0 };
+                    slots.append(s);
+                }
+                slots[slot].entity = entity;
+                slots[slot].generation = generationOf(id);
+                return true;
+            }
+
+            // @post: the entity with this ID, if any, is out of the table and its slot's generation has moved on
+            // @return: the entity, null if the ID is stale or one of the loaded ones
+            shared_ptr<Entity> remove(NetID id) {
+                const uint32 slot = slotOf(id);
+                if (slot < (uint32)loaded) return nullptr;
+                shared_ptr<Entity> entity = get(id);
+                if (isNull(entity)) return nullptr;
+
+                slots[slot].entity.reset();
+                slots[slot].generation = (slots[slot].generation + 1) & GENERATION_MASK;
+                free_slots.append(slot);
+                return entity;
+            }
+
+            // @return: the entity with this ID, null if it is gone or never was
+            shared_ptr<Entity> get(NetID id) const {
+                const uint32 slot = slotOf(id);
+                if (slot >= (uint32)slots.size()) return nullptr;
+                const slot_t& s = slots[slot];
+                return (s.generation == generationOf(id)) ? s.entity : nullptr;
+            }
+
+            // slots, loaded first, some of the rest may be empty
+            int size() const { return slots.size(); }
+            int loadedCount() const { return loaded; }
+            const shared_ptr<Entity>& at(int slot) const { return slots[slot].entity; }
+            NetID idAt(int slot) const { return makeID((uint32)slot, slots[slot].generation); }
+    };
+}
@@ -0,0 +1,220 @@
+#pragma once
+#include <G3D/G3D.h>
+
+/* =========================================
+ *                Foveation
+ * =========================================
+ *
+ * In sort-first mode every strip is a region of the screen, and with
+ * foveation on the router gives each region a tier: strips that overlap
+ * the band around the centre of the view stay at full resolution and
+ * quality, the rest are rendered (or downsampled) by their remote at
+ * 1 / PERIPHERY_SCALE the resolution and their quality is capped.
+ *
+ * Regions travel to the client in one atlas frame instead of being
+ * upscaled on the way. The router packs them into shelves, tallest first,
+ * so the reduced strips sit side by side below the full width ones, and
+ * sends the table of where each landed along with READY. The client
+ * decodes the atlas and lets the GPU stretch every region back over its
+ * part of the screen when it presents the frame.
+ *
+ * Without foveation every region is at scale 1 and the atlas is exactly
+ * the screen.
+ *
+ * With dynamic resolution the whole atlas is also rendered at a percentage
+ * of itself. Both ends derive the table at that percentage from the one
+ * sent with READY, by sizing every region down and packing them again.
+ */
+
+namespace DistributedRenderer {
+
+    class Foveation {
+        public:
+
+            // where a region is on screen and where it is in the atlas
+            typedef struct {
+                uint32 screen_y;
+                uint32 screen_h;
+                uint8 scale;     // 1 is full resolution
+                uint32 atlas_x;
+                uint32 atlas_y;
+                uint32 atlas_w;
+                uint32 atlas_h;
+            } region_t;
+
+            // a length at 1 / scale, rounded up so nothing is cut off
+            static uint32 scaled(uint32 length, uint8 scale) { return (length + scale - 1) / scale; }
+
+            // a length at percent of itself, rounded up the same way
+            static uint32 atPercent(uint32 length, uint8 percent) { return G3D::max((length * percent + 99) / 100, (uint32)1); }
+
+            // @return: the scale for a strip of the screen, 1 if it overlaps the fovea
+            static uint8 tierFor(uint32 y, uint32 h, uint32 screen_height, float fovea_fraction, uint8 periphery_scale) {
+                const float centre = screen_height * 0.5f;
+                const float half = screen_height * fovea_fraction * 0.5f;
+                const bool foveal = (float)y < centre + half && (float)(y + h) > centre - half;
+                return foveal ? 1 : periphery_scale;
+            }
+
+            // @pre: regions with their screen rows and scale
+            // @post: every region has its place in an atlas atlas_width wide, packed into shelves tallest first
+            // @return: the height of the atlas
+            static uint32 pack(Array<region_t>& regions, uint32 screen_width, uint32& atlas_width) {
+                atlas_width = screen_width;
+
+                for (int i = 0; i < regions.size(); i++) {
+                    regions[i].atlas_w = scaled(screen_width, regions[i].scale);
+                    regions[i].atlas_h = scaled(regions[i].screen_h, regions[i].scale);
+                }
+                return place(regions, atlas_width);
+            }
+
+            // @pre: regions as pack left them, the atlas they were packed into was screen_width wide
+            // @post: out is regions with every atlas size at percent, packed again into an atlas atlas_width wide
+            // @return: the height of that atlas
+            static uint32 atScale(const Array<region_t>& regions, uint32 screen_width, uint8 percent, Array<region_t>& out, uint32& atlas_width) {
+                out = regions;
+                atlas_width = atPercent(screen_width, percent);
+
+                for (int i = 0; i < out.size(); i++) {
+                    out[i].atlas_w = atPercent(regions[i].atlas_w, percent);
+                    out[i].atlas_h = atPercent(regions[i].atlas_h, percent);
+                }
+                return place(out, atlas_width);
+            }
+
+            // @pre: regions with their atlas size
+            // @post: every region has its place in an atlas atlas_width wide, packed into shelves tallest first
+            // @return: the height of the atlas
+            static uint32 place(Array<region_t>& regions, uint32 atlas_width) {
+                Array<int> order;
+                for (int i = 0; i < regions.size(); i++) {
+                    // insertion sort, stable so equal regions keep their order on screen
+                    int at = order.size();
+                    while (at > 0 && regions[order[at - 1]].atlas_h < regions[i].atlas_h) --at;
+                    order.insert(at, i);
+                }
+
+                uint32 shelf_y = 0;
+                uint32 shelf_h = 0;
+                uint32 shelf_x = 0;
+
+                for (int i = 0; i < order.size(); i++) {
+                    region_t& r = regions[order[i]];
+
+                    // next to the last region if the shelf has room across and is tall enough
+                    if (shelf_x + r.atlas_w > atlas_width || r.atlas_h > shelf_h) {
+                        shelf_y += shelf_h;
+                        shelf_h = r.atlas_h;
+                        shelf_x = 0;
+                    }
+
+                    r.atlas_x = shelf_x;
+                    r.atlas_y = shelf_y;
+                    shelf_x += r.atlas_w;
+                }
+
+                return shelf_y + shelf_h;
+            }
+
+            // true if the atlas is the screen itself
+            static bool isIdentity(const Array<region_t>& regions) {
+                for (int i = 0; i < regions.size(); i++) {
+                    if (regions[i].scale != 1) return false;
+                }
+                return true;
+            }
+
+            static void writeRegions(BinaryOutput& bo, const Array<region_t>& regions) {
+                bo.writeUInt16((uint16)regions.size());
+                for (int i = 0; i < regions.size(); i++) {
+                    const region_t& r = regions[i];
+                    bo.writeUInt32(r.screen_y);
+                    bo.writeUInt32(r.screen_h);
+                    bo.writeUInt8(r.scale);
+                    bo.writeUInt32(r.atlas_x);
+                    bo.writeUInt32(r.atlas_y);
+                    bo.writeUInt32(r.atlas_w);
+                    bo.writeUInt32(r.atlas_h);
+                }
+            }
+
+            static void readRegions(BinaryInput& bi, Array<region_t>& regions) {
+                regions.resize(bi.readUInt16());
+                for (int i = 0; i < regions.size(); i++) {
+                    region_t& r = regions[i];
+                    r.screen_y = bi.readUInt32();
+                    r.screen_h = bi.readUInt32();
+                    r.scale = bi.readUInt8();
+                    r.atlas_x = bi.readUInt32();
+                    r.atlas_y = bi.readUInt32();
+                    r.atlas_w = bi.readUInt32();
+                    r.atlas_h = bi.readUInt32();
+                }
+            }
+
+            // @pre: src points to the first row of a width x height RGB8 image, dst holds scaled(width) x scaled(height)
+            // @post: dst is src box filtered down by scale, partial boxes at the edges average what they cover
+            static void downsample(const uint8* src, ptrdiff_t src_stride, int width, int height, uint8 scale, uint8* dst, ptrdiff_t dst_stride) {
+                const int w = (int)scaled(width, scale);
+                const int h = (int)scaled(height, scale);
+
+                runConcurrently(0, h, [&](int y) {
+                    const int y0 = y * scale;
+                    const int rows = G3D::min((int)scale, height - y0);
+                    uint8* out = dst + y * dst_stride;
+
+                    for (int x = 0; x < w; x++) {
+                        const int x0 = x * scale;
+                        const int cols = G3D::min((int)scale, width - x0);
+                        uint32 sum[3] = { 0, 0, 0 };
+
+                        for (int r = 0; r < rows; r++) {
+                            const uint8* px = src + (y0 + r) * src_stride + x0 * 3;
+                            for (int c = 0; c < cols; c++, px += 3) {
+                                sum[0] += px[0];
+                                sum[1] += px[1];
+                                sum[2] += px[2];
+                            }
+                        }
+
+                        const uint32 n = rows * cols;
+                        out[x * 3 + 0] = (uint8)((sum[0] + n / 2) / n);
+                        out[x * 3 + 1] = (uint8)((sum[1] + n / 2) / n);
+                        out[x * 3 + 2] = (uint8)((sum[2] + n / 2) / n);
+                    }
+                });
+            }
+
+            // @pre: src points to the first row of a width x height RGB8 image, dst holds dst_width x dst_height,
+            // no more than twice as small either way
+            // @post: dst is src resized bilinearly, pixel centres lined up
+            static void resample(const uint8* src, ptrdiff_t src_stride, int width, int height, uint8* dst, ptrdiff_t dst_stride, int dst_width, int dst_height) {
+                const float sx = width / (float)dst_width;
+                const float sy = height / (float)dst_height;
+
+                runConcurrently(0, dst_height, [&](int y) {
+                    const float fy = G3D::clamp((y + 0.5f) * sy - 0.5f, 0.0f, (float)(height - 1));
+                    const int y0 = (int)fy;
+                    const int y1 = G3D::min(y0 + 1, height - 1);
+                    const int wy = (int)((fy - y0) * 256.0f);
+                    const uint8* row0 = src + y0 * src_stride;
+                    const uint8* row1 = src + y1 * src_stride;
+                    uint8* out = dst + y * dst_stride;
+
+                    for (int x = 0; x < dst_width; x++) {
+                        const float fx = G3D::clamp((x + 0.5f) * sx - 0.5f, 0.0f, (float)(width - 1));
+                        const int x0 = (int)fx;
+                        const int x1 = G3D::min(x0 + 1, width - 1);
+                        const int wx = (int)((fx - x0) * 256.0f);
+
+                        for (int c = 0; c < 3; c++) {
+                            const int top = row0[x0 * 3 + c] * (256 - wx) + row0[x1 * 3 + c] * wx;
+                            const int bottom = row1[x0 * 3 + c] * (256 - wx) + row1[x1 * 3 + c] * wx;
+                            out[x * 3 + c] = (uint8)((top * (256 - wy) + bottom * wy + (1 << 15)) >> 16);
+                        }
+                    }
+                });
+            }
+    };
+}
@@ -0,0 +1,857 @@
+#pragma once
+#include <G3D/G3D.h>
+#include "ImageDist.h"
+#include "BlockDelta.h"
+#include "MotionPrediction.h"
+#include "Compositor.h"
+#include <emmintrin.h>
+
+/* =========================================
+ *              Frame Codecs
+ * =========================================
+ *
+ * Every FRAGMENT and FRAME body is written by a FrameCodec. Codecs take
+ * RGB8 rows in whatever order the sender holds them and decode them in
+ * that same order straight into the receiver's buffer. Strides are signed,
+ * so a receiver that keeps the other orientation decodes through a
+ * negative stride instead of flipping afterwards (see frame_header_t).
+ * A codec instance belongs to one stream (one remote's strip, or the
+ * router's frame to the client) because some codecs keep the previous
+ * frame as a reference.
+ *
+ * Nodes announce the codecs they can decode/encode as a bitmask in their
+ * HI_AM packet. The router picks the first codec in
+ * Constants::CODEC_PREFERENCE that everyone on a link supports and hands
+ * it out in CONFIG (remotes) and READY (client).
+ *
+ *   RAW          rows as they are, for fast LANs where the CPU is the bottleneck
+ *   LZ4          LZ4 block format, lossless, very fast to decode
+ *   QOI          QOI-style run/index/diff coding, lossless, cheap on both ends
+ *   JPEG         FreeImage JPEG, lossy, smallest on slow links
+ *   BLOCK_DELTA  only the 16x16 blocks that changed since the last frame
+ *   MOTION       blocks predicted along the G-buffer's motion vectors, residuals only
+ *   YUV420       planar Y, Cb, Cr with quarter resolution chroma, half the bytes of RAW.
+ *                The client can take the planes as they are and convert on the GPU
+ *
+ * Every codec takes a quality from 1 to 100 that the rate controller
+ * adjusts per frame. JPEG passes it to the encoder, the lossless codecs
+ * drop low bits of every channel below 100 so there is less to code and
+ * MOTION quantizes its residuals by the same amount.
+ */
+
+namespace DistributedRenderer {
+
+    enum CodecID {
+        RAW_CODEC,
+        LZ4_CODEC,
+        QOI_CODEC,
+        JPEG_CODEC,
+        BLOCK_DELTA_CODEC,
+        MOTION_CODEC,
+        YUV420_CODEC,
+        NUM_CODECS
+    };
+
+    class FrameCodec {
+        public:
+            static const int BYTES_PER_PIXEL = 3;
+
+            virtual ~FrameCodec() {}
+
+            virtual CodecID id() const = 0;
+            virtual const char* name() const = 0;
+
+            // true if a frame depends on the one before it, so every frame has to be decoded, even late ones
+            virtual bool isTemporal() const { return false; }
+
+            // @pre: pixels points to the first row of a width x height RGB8 image, rows stride bytes apart
+            // @post: writes the encoded image to bo, rows in the same order
+            virtual void encode(const uint8* pixels, int width, int height, ptrdiff_t stride, BinaryOutput& bo) = 0;
+
+            // @pre: dst points to the first row of the region this stream owns, rows stride bytes apart
+            // (negative to write the rows bottom-up)
+            // @post: decodes the image from bi into dst
+            // @return: false if the image is malformed or does not fit
+            virtual bool decode(BinaryInput& bi, uint8* dst, ptrdiff_t stride, int width, int height) = 0;
+
+            // the next frame may not depend on anything sent before it
+            virtual void reset() {}
+
+            // true if the codec can use the renderer's screen-space motion, see setMotion
+            virtual bool usesMotion() const { return false; }
+
+            // @pre: motion points to the vectors of the first row of the next image, 2 floats a pixel,
+            // rows stride floats apart, valid until the next encode returns
+            virtual void setMotion(const float* motion, ptrdiff_t stride) { (void)motion; (void)stride; }
+
+            // true if the codec can decode to Y, Cb and Cr planes, see decodePlanes
+            virtual bool decodesToPlanes() const { return false; }
+
+            // @pre: planes and strides for Y (width x height) and Cb, Cr (half that each way, rounded up)
+            // @post: decodes the image from bi into the planes without converting to RGB
+            // @return: false if the image is malformed, does not fit or the codec has no planes
+            virtual bool decodePlanes(BinaryInput& bi, uint8* const planes[3], const ptrdiff_t strides[3], int width, int height) {
+                (void)bi; (void)planes; (void)strides; (void)width; (void)height;
+                return false;
+            }
+
+            void setQuality(int q) { quality = iClamp(q, 1, 100); }
+            int getQuality() const { return quality; }
+
+            // @return: a fresh codec for one stream, block delta keyframes and motion
+            // intra refreshes every keyframe_interval frames
+            static shared_ptr<FrameCodec> create(CodecID id, uint32 keyframe_interval);
+
+            // every codec this build can encode and decode
+            static uint32 supportedMask() { return (1 << NUM_CODECS) - 1; }
+
+            // @return: the first codec in preference that every mask supports, raw if none
+            static CodecID negotiate(const CodecID* preference, int count, const Array<uint32>& masks) {
+                for (int i = 0; i < count; i++) {
+                    bool all = true;
+                    for (int m = 0; m < masks.size(); m++) all = all && (masks[m] & (1 << preference[i]));
+                    if (all) return preference[i];
+                }
+                return RAW_CODEC;
+            }
+
+            static const char* name(CodecID id) {
+                static const char* names[] = { "RAW", "LZ4", "QOI", "JPEG", "BLOCK_DELTA", "MOTION", "YUV420" };
+                return (id < NUM_CODECS) ? names[id] : "UNKNOWN";
+            }
+
+        protected:
+            int quality = 100;
+            Array<uint8> scratch;
+
+            // number of low bits dropped from every channel at the current quality
+            int droppedBits() const { return (quality >= 100) ? 0 : (quality >= 75) ? 1 : (quality >= 50) ? 2 : 3; }
+
+            uint8 quantizeMask() const { return (uint8)(0xFF << droppedBits()); }
+
+            static void quantizeRow(uint8* dst, const uint8* src, size_t n, uint8 mask) {
+                const __m128i m = _mm_set1_epi8((char)mask);
+                size_t i = 0;
+                for (; i + 16 <= n; i += 16) {
+                    _mm_storeu_si128((__m128i*)(dst + i), _mm_and_si128(_mm_loadu_si128((const __m128i*)(src + i)), m));
+                }
+                for (; i < n; i++) dst[i] = src[i] & mask;
+            }
+
+            // @return: the image as one tightly packed block, quantized to the current quality,
+            // copying only if the rows are padded or walked backwards or bits are dropped
+            const uint8* packed(const uint8* pixels, int width, int height, ptrdiff_t stride, bool quantize = true) {
+                const size_t row_bytes = width * BYTES_PER_PIXEL;
+                const uint8 mask = quantize ? quantizeMask() : 0xFF;
+                if (stride == (ptrdiff_t)row_bytes && mask == 0xFF) return pixels;
+
+                scratch.resize((int)(row_bytes * height), false);
+                for (int row = 0; row < height; row++) {
+                    quantizeRow(scratch.getCArray() + row * row_bytes, pixels + row * stride, row_bytes, mask);
+                }
+                return scratch.getCArray();
+            }
+
+            // @post: reads the width and height every codec but JPEG starts with
+            // @return: false if they do not fit the destination
+            static bool readSize(BinaryInput& bi, int width, int height, int& w, int& h) {
+                w = bi.readUInt16();
+                h = bi.readUInt16();
+                return w <= width && h <= height;
+            }
+    };
+
+    // =========================================
+    //                   RAW
+    // =========================================
+
+    class RawCodec : public FrameCodec {
+        public:
+            CodecID id() const override { return RAW_CODEC; }
+            const char* name() const override { return "RAW"; }
+
+            void encode(const uint8* pixels, int width, int height, ptrdiff_t stride, BinaryOutput& bo) override {
+                bo.writeUInt16((uint16)width);
+                bo.writeUInt16((uint16)height);
+                for (int row = 0; row < height; row++) {
+                    bo.writeBytes(pixels + row * stride, width * BYTES_PER_PIXEL);
+                }
+            }
+
+            bool decode(BinaryInput& bi, uint8* dst, ptrdiff_t stride, int width, int height) override {
+                int w, h;
+                if (!readSize(bi, width, height, w, h)) return false;
+                for (int row = 0; row < h; row++) {
+                    bi.readBytes(dst + row * stride, w * BYTES_PER_PIXEL);
+                }
+                return true;
+            }
+    };
+
+    // =========================================
+    //                   LZ4
+    // =========================================
+
+    // LZ4 block format: a token (literal length, match length), the literals,
+    // a 16 bit offset back into the output and the match. The last 5 bytes
+    // are always literals and no match starts in the last 12.
+    class LZ4Codec : public FrameCodec {
+        private:
+            static const int HASH_LOG = 16;
+            static const int MIN_MATCH = 4;
+
+            Array<int> table;
+            Array<uint8> compressed;
+
+            static uint32 read32(const uint8* p) {
+                uint32 v;
+                System::memcpy(&v, p, 4);
+                return v;
+            }
+
+            static void writeLength(uint8* dst, int& op, int length) {
+                for (; length >= 255; length -= 255) dst[op++] = 255;
+                dst[op++] = (uint8)length;
+            }
+
+        public:
+            CodecID id() const override { return LZ4_CODEC; }
+            const char* name() const override { return "LZ4"; }
+
+            static int compressBound(int n) { return n + n / 255 + 16; }
+
+            // @return: the number of bytes written to dst, which holds at least compressBound(n)
+            int compress(const uint8* src, int n, uint8* dst) {
+                table.resize(1 << HASH_LOG, false);
+                for (int i = 0; i < table.size(); i++) table[i] = -1;
+
+                const int mflimit = n - 12;
+                const int matchlimit = n - 5;
+                int ip = 0;
+                int anchor = 0;
+                int op = 0;
+
+                while (ip < mflimit) {
+                    const uint32 seq = read32(src + ip);
+                    const uint32 h = (seq * 2654435761u) >> (32 - HASH_LOG);
+                    const int ref = table[h];
+                    table[h] = ip;
+
+                    if (ref < 0 || ip - ref > 65535 || read32(src + ref) != seq) {
+                        ++ip;
+                        continue;
+                    }
+
+                    int length = MIN_MATCH;
+                    while (ip + length < matchlimit && src[ref + length] == src[ip + length]) ++length;
+
+                    const int literals = ip - anchor;
+                    const int match = length - MIN_MATCH;
+                    uint8* token = dst + op++;
+                    *token = (uint8)((G3D::min(literals, 15) << 4) | G3D::min(match, 15));
+
+                    if (literals >= 15) writeLength(dst, op, literals - 15);
+                    System::memcpy(dst + op, src + anchor, literals);
+                    op += literals;
+
+                    dst[op++] = (uint8)((ip - ref) & 0xFF);
+                    dst[op++] = (uint8)((ip - ref) >> 8);
+                    if (match >= 15) writeLength(dst, op, match - 15);
+
+                    ip += length;
+                    anchor = ip;
+                }
+
+                // last literals
+                const int literals = n - anchor;
+                dst[op++] = (uint8)(G3D::min(literals, 15) << 4);
+                if (literals >= 15) writeLength(dst, op, literals - 15);
+                System::memcpy(dst + op, src + anchor, literals);
+                op += literals;
+
+                return op;
+            }
+
+            // @return: false unless src decompresses to exactly dst_n bytes
+            static bool decompress(const uint8* src, int n, uint8* dst, int dst_n) {
+                int ip = 0;
+                int op = 0;
+
+                while (ip < n) {
+                    const uint8 token = src[ip++];
+
+                    int literals = token >> 4;
+                    if (literals == 15) {
+                        uint8 b;
+                        do {
+                            if (ip >= n) return false;
+                            b = src[ip++];
+                            literals += b;
+                        } while (b == 255);
+                    }
+                    if (op + literals > dst_n || ip + literals > n) return false;
+                    System::memcpy(dst + op, src + ip, literals);
+                    ip += literals;
+                    op += literals;
+
+                    // the last sequence has no match
+                    if (ip >= n) break;
+
+                    if (ip + 2 > n) return false;
+                    const int offset = src[ip] | (src[ip + 1] << 8);
+                    ip += 2;
+
+                    int match = token & 15;
+                    if (match == 15) {
+                        uint8 b;
+                        do {
+                            if (ip >= n) return false;
+                            b = src[ip++];
+                            match += b;
+                        } while (b == 255);
+                    }
+                    match += MIN_MATCH;
+
+                    if (offset == 0 || offset > op || op + match > dst_n) return false;
+
+                    // matches may overlap their own output, copy forwards one byte at a time
+                    const uint8* from = dst + op - offset;
+                    for (int i = 0; i < match; i++) dst[op + i] = from[i];
+                    op += match;
+                }
+
+                return op == dst_n;
+            }
+
+            void encode(const uint8* pixels, int width, int height, ptrdiff_t stride, BinaryOutput& bo) override {
+                const int n = width * height * BYTES_PER_PIXEL;
+                const uint8* src = packed(pixels, width, height, stride);
+
+                compressed.resize(compressBound(n), false);
+                const int size = compress(src, n, compressed.getCArray());
+
+                bo.writeUInt16((uint16)width);
+                bo.writeUInt16((uint16)height);
+                bo.writeUInt32(size);
+                bo.writeBytes(compressed.getCArray(), size);
+            }
+
+            bool decode(BinaryInput& bi, uint8* dst, ptrdiff_t stride, int width, int height) override {
+                int w, h;
+                if (!readSize(bi, width, height, w, h)) return false;
+
+                const int size = bi.readUInt32();
+                if (size < 0 || size > bi.getLength() - bi.getPosition()) return false;
+                const uint8* src = bi.getCArray() + bi.getPosition();
+                bi.skip(size);
+
+                const size_t row_bytes = w * BYTES_PER_PIXEL;
+                if (stride == (ptrdiff_t)row_bytes) return decompress(src, size, dst, (int)row_bytes * h);
+
+                scratch.resize((int)row_bytes * h, false);
+                if (!decompress(src, size, scratch.getCArray(), scratch.size())) return false;
+                for (int row = 0; row < h; row++) {
+                    Compositor::copyRow(dst + row * stride, scratch.getCArray() + row * row_bytes, row_bytes);
+                }
+                return true;
+            }
+    };
+
+    // =========================================
+    //               Depth Planes
+    // =========================================
+
+    // Sort-last depth travels ahead of its layer's colour, losslessly so the
+    // router's z-merge sees what the remote rendered. The floats are split into
+    // byte planes first, neighbouring pixels nearly always share their sign and
+    // exponent bytes, and the planes go through LZ4.
+    //   uint32 size, then an LZ4 block of width * height * 4 bytes
+    class DepthPlane {
+        private:
+            LZ4Codec lz4;
+            Array<uint8> planes;
+            Array<uint8> compressed;
+
+        public:
+            // @pre: depth points to the first row of width x height floats, rows stride floats apart
+            // @post: writes the compressed plane to bo
+            void encode(const float* depth, int width, int height, size_t stride, BinaryOutput& bo) {
+                const int count = width * height;
+                planes.resize(count * 4, false);
+                uint8* out = planes.getCArray();
+                for (int y = 0; y < height; y++) {
+                    const uint8* row = (const uint8*)(depth + y * stride);
+                    for (int x = 0; x < width; x++) {
+                        const int i = y * width + x;
+                        for (int b = 0; b < 4; b++) out[b * count + i] = row[x * 4 + b];
+                    }
+                }
+
+                compressed.resize(LZ4Codec::compressBound(count * 4), false);
+                const int size = lz4.compress(planes.getCArray(), count * 4, compressed.getCArray());
+                bo.writeUInt32(size);
+                bo.writeBytes(compressed.getCArray(), size);
+            }
+
+            // @pre: depth points to the first row of width x height floats, rows stride floats apart
+            // (negative to write the rows bottom-up)
+            // @post: reads the plane into depth
+            // @return: false if the plane is malformed or not width x height floats
+            bool decode(BinaryInput& bi, float* depth, int width, int height, ptrdiff_t stride) {
+                if (bi.getLength() - bi.getPosition() < 4) return false;
+                const int size = bi.readUInt32();
+                if (size < 0 || size > bi.getLength() - bi.getPosition()) return false;
+                const uint8* src = bi.getCArray() + bi.getPosition();
+                bi.skip(size);
+
+                const int count = width * height;
+                planes.resize(count * 4, false);
+                if (!LZ4Codec::decompress(src, size, planes.getCArray(), count * 4)) return false;
+
+                const uint8* in = planes.getCArray();
+                for (int y = 0; y < height; y++) {
+                    uint8* row = (uint8*)(depth + y * stride);
+                    for (int x = 0; x < width; x++) {
+                        const int i = y * width + x;
+                        for (int b = 0; b < 4; b++) row[x * 4 + b] = in[b * count + i];
+                    }
+                }
+                return true;
+            }
+    };
+
+    // =========================================
+    //                   QOI
+    // =========================================
+
+    // The QOI op set without alpha: a 64 entry index of recently seen colours,
+    // small diffs from the previous pixel, luma-based diffs and runs
+    class QOICodec : public FrameCodec {
+        private:
+            static const uint8 OP_INDEX = 0x00;
+            static const uint8 OP_DIFF = 0x40;
+            static const uint8 OP_LUMA = 0x80;
+            static const uint8 OP_RUN = 0xC0;
+            static const uint8 OP_RGB = 0xFE;
+            static const uint8 MASK = 0xC0;
+
+            Array<uint8> coded;
+
+            static int hash(uint8 r, uint8 g, uint8 b) { return (r * 3 + g * 5 + b * 7 + 255 * 11) % 64; }
+
+        public:
+            CodecID id() const override { return QOI_CODEC; }
+            const char* name() const override { return "QOI"; }
+
+            void encode(const uint8* pixels, int width, int height, ptrdiff_t stride, BinaryOutput& bo) override {
+                if (quantizeMask() != 0xFF) {
+                    pixels = packed(pixels, width, height, stride);
+                    stride = width * BYTES_PER_PIXEL;
+                }
+
+                uint8 index[64][3];
+                System::memset(index, 0, sizeof(index));
+
+                // worst case is 4 bytes a pixel
+                coded.resize(width * height * 4 + 4, false);
+                uint8* out = coded.getCArray();
+                int op = 0;
+
+                uint8 pr = 0, pg = 0, pb = 0;
+                int run = 0;
+
+                for (int y = 0; y < height; y++) {
+                    const uint8* px = pixels + y * stride;
+                    for (int x = 0; x < width; x++, px += 3) {
+                        const uint8 r = px[0], g = px[1], b = px[2];
+
+                        if (r == pr && g == pg && b == pb) {
+                            if (++run == 62) {
+                                out[op++] = OP_RUN | (run - 1);
+                                run = 0;
+                            }
+                            continue;
+                        }
+
+                        if (run > 0) {
+                            out[op++] = OP_RUN | (run - 1);
+                            run = 0;
+                        }
+
+                        const int h = hash(r, g, b);
+                        if (index[h][0] == r && index[h][1] == g && index[h][2] == b) {
+                            out[op++] = OP_INDEX | h;
+                        } else {
+                            index[h][0] = r; index[h][1] = g; index[h][2] = b;
+
+                            const int8 dr = (int8)(r - pr);
+                            const int8 dg = (int8)(g - pg);
+                            const int8 db = (int8)(b - pb);
+                            const int8 dr_dg = (int8)(dr - dg);
+                            const int8 db_dg = (int8)(db - dg);
+
+                            if (dr > -3 && dr < 2 && dg > -3 && dg < 2 && db > -3 && db < 2) {
+                                out[op++] = OP_DIFF | ((dr + 2) << 4) | ((dg + 2) << 2) | (db + 2);
+                            } else if (dg > -33 && dg < 32 && dr_dg > -9 && dr_dg < 8 && db_dg > -9 && db_dg < 8) {
+                                out[op++] = OP_LUMA | (dg + 32);
+                                out[op++] = (uint8)(((dr_dg + 8) << 4) | (db_dg + 8));
+                            } else {
+                                out[op++] = OP_RGB;
+                                out[op++] = r; out[op++] = g; out[op++] = b;
+                            }
+                        }
+
+                        pr = r; pg = g; pb = b;
+                    }
+                }
+                if (run > 0) out[op++] = OP_RUN | (run - 1);
+
+                bo.writeUInt16((uint16)width);
+                bo.writeUInt16((uint16)height);
+                bo.writeUInt32(op);
+                bo.writeBytes(out, op);
+            }
+
+            bool decode(BinaryInput& bi, uint8* dst, ptrdiff_t stride, int width, int height) override {
+                int w, h;
+                if (!readSize(bi, width, height, w, h)) return false;
+
+                const int size = bi.readUInt32();
+                if (size < 0 || size > bi.getLength() - bi.getPosition()) return false;
+                const uint8* in = bi.getCArray() + bi.getPosition();
+                bi.skip(size);
+
+                uint8 index[64][3];
+                System::memset(index, 0, sizeof(index));
+
+                uint8 r = 0, g = 0, b = 0;
+                int run = 0;
+                int ip = 0;
+
+                for (int y = 0; y < h; y++) {
+                    uint8* px = dst + y * stride;
+                    for (int x = 0; x < w; x++, px += 3) {
+                        if (run > 0) {
+                            --run;
+                        } else if (ip < size) {
+                            const uint8 op = in[ip++];
+
+                            if (op == OP_RGB) {
+                                if (ip + 3 > size) return false;
+                                r = in[ip]; g = in[ip + 1]; b = in[ip + 2];
+                                ip += 3;
+                            } else if ((op & MASK) == OP_INDEX) {
+                                r = index[op][0]; g = index[op][1]; b = index[op][2];
+                            } else if ((op & MASK) == OP_DIFF) {
+                                r += ((op >> 4) & 3) - 2;
+                                g += ((op >> 2) & 3) - 2;
+                                b += (op & 3) - 2;
+                            } else if ((op & MASK) == OP_LUMA) {
+                                if (ip + 1 > size) return false;
+                                const uint8 next = in[ip++];
+                                const int dg = (op & 0x3F) - 32;
+                                r += dg - 8 + ((next >> 4) & 0x0F);
+                                g += dg;
+                                b += dg - 8 + (next & 0x0F);
+                            } else {
+                                run = op & 0x3F;
+                            }
+
+                            const int hh = hash(r, g, b);
+                            index[hh][0] = r; index[hh][1] = g; index[hh][2] = b;
+                        } else {
+                            return false;
+                        }
+
+                        px[0] = r; px[1] = g; px[2] = b;
+                    }
+                }
+
+                return true;
+            }
+    };
+
+    // =========================================
+    //                   JPEG
+    // =========================================
+
+    // The encoder hands FreeImage a view of the rows as they are. FreeImage
+    // takes the first row for the bottom one, so the JPEG is stored upside
+    // down by its own reckoning, and the decoder reads FreeImage's rows back
+    // in the same order. Neither end copies or flips to please FreeImage.
+    class JPEGCodec : public FrameCodec {
+        private:
+            // the last frame decoded, kept so the next one does not need a new image
+            fipImage decoded;
+
+        public:
+            CodecID id() const override { return JPEG_CODEC; }
+            const char* name() const override { return "JPEG"; }
+
+            void encode(const uint8* pixels, int width, int height, ptrdiff_t stride, BinaryOutput& bo) override {
+                // FreeImage cannot walk rows backwards, those have to be packed first
+                const uint8* rows = (stride > 0) ? pixels : packed(pixels, width, height, stride, false);
+                const shared_ptr<ImageDist>& image = ImageDist::view(rows, width, height, (stride > 0) ? stride : width * BYTES_PER_PIXEL, ImageFormat::RGB8());
+
+                // JPEG encoding/decoding takes more time but substantially less bandwidth than PNG,
+                // FreeImage takes the quality straight as the save flags
+                fipMemoryIO memory;
+                image->image()->saveToMemory(FIF_JPEG, memory, quality);
+
+                BYTE* data = nullptr;
+                DWORD size = 0;
+                memory.acquire(&data, &size);
+                bo.writeBytes(data, size);
+            }
+
+            bool decode(BinaryInput& bi, uint8* dst, ptrdiff_t stride, int width, int height) override {
+                // FreeImage only decodes into a bitmap of its own, loading it straight
+                // into the member skips the ImageDist, its format probing and the
+                // palette conversions every frame
+                fipMemoryIO memory(const_cast<uint8*>(bi.getCArray() + bi.getPosition()), static_cast<DWORD>(bi.getLength() - bi.getPosition()));
+                decoded = memory.load(FIF_JPEG, JPEG_DEFAULT);
+                bi.setPosition(bi.getLength());
+
+                if (!decoded.isValid() || decoded.getBitsPerPixel() != BYTES_PER_PIXEL * 8) return false;
+
+                const int w = (int)decoded.getWidth();
+                const int h = (int)decoded.getHeight();
+                if (w > width || h > height) return false;
+
+                for (int row = 0; row < h; row++) {
+                    Compositor::copyRow(dst + row * stride, decoded.getScanLine(row), w * BYTES_PER_PIXEL);
+                }
+                return true;
+            }
+    };
+
+    // =========================================
+    //               BLOCK DELTA
+    // =========================================
+
+    class BlockDeltaCodec : public FrameCodec {
+        private:
+            BlockDeltaEncoder encoder;
+
+        public:
+            BlockDeltaCodec(uint32 keyframe_interval) : encoder(keyframe_interval) {}
+
+            CodecID id() const override { return BLOCK_DELTA_CODEC; }
+            const char* name() const override { return "BLOCK_DELTA"; }
+            bool isTemporal() const override { return true; }
+
+            void encode(const uint8* pixels, int width, int height, ptrdiff_t stride, BinaryOutput& bo) override {
+                if (quantizeMask() != 0xFF) {
+                    pixels = packed(pixels, width, height, stride);
+                    stride = width * BYTES_PER_PIXEL;
+                }
+                encoder.encode(pixels, width, height, stride, bo);
+            }
+
+            bool decode(BinaryInput& bi, uint8* dst, ptrdiff_t stride, int width, int height) override {
+                return BlockDeltaDecoder::decode(bi, dst, stride, width, height);
+            }
+
+            void reset() override { encoder.forceKeyframe(); }
+    };
+
+    // =========================================
+    //                  MOTION
+    // =========================================
+
+    // Motion compensated prediction (see MotionPrediction.h) with the symbol
+    // stream LZ4 compressed, where skipped blocks and small residuals all but
+    // vanish. Without motion vectors (the router's stream to the client, the
+    // CPU backend) every block is predicted from where it was, which still
+    // beats block delta on anything that changes a little everywhere.
+    //
+    // Wire format: uint16 width, uint16 height, uint8 shift, uint32 symbol
+    // bytes, uint32 compressed bytes, the compressed symbols
+    class MotionCodec : public FrameCodec {
+        private:
+            MotionEncoder encoder;
+            MotionDecoder decoder;
+            LZ4Codec lz4;
+
+            Array<uint8> symbols;
+            Array<uint8> compressed;
+
+            const float* motion = nullptr;
+            ptrdiff_t motion_stride = 0;
+
+        public:
+            MotionCodec(uint32 refresh_interval) : encoder(refresh_interval) {}
+
+            CodecID id() const override { return MOTION_CODEC; }
+            const char* name() const override { return "MOTION"; }
+            bool isTemporal() const override { return true; }
+            bool usesMotion() const override { return true; }
+
+            void setMotion(const float* m, ptrdiff_t stride) override {
+                motion = m;
+                motion_stride = stride;
+            }
+
+            void encode(const uint8* pixels, int width, int height, ptrdiff_t stride, BinaryOutput& bo) override {
+                const int shift = droppedBits();
+
+                symbols.fastClear();
+                encoder.encode(pixels, width, height, stride, motion, motion_stride, shift, symbols);
+                motion = nullptr;
+
+                compressed.resize(LZ4Codec::compressBound(symbols.size()), false);
+                const int size = lz4.compress(symbols.getCArray(), symbols.size(), compressed.getCArray());
+
+                bo.writeUInt16((uint16)width);
+                bo.writeUInt16((uint16)height);
+                bo.writeUInt8((uint8)shift);
+                bo.writeUInt32(symbols.size());
+                bo.writeUInt32(size);
+                bo.writeBytes(compressed.getCArray(), size);
+            }
+
+            bool decode(BinaryInput& bi, uint8* dst, ptrdiff_t stride, int width, int height) override {
+                int w, h;
+                if (!readSize(bi, width, height, w, h)) return false;
+
+                const int shift = bi.readUInt8();
+                const int n = bi.readUInt32();
+                const int size = bi.readUInt32();
+                if (size < 0 || size > bi.getLength() - bi.getPosition()) return false;
+                const uint8* src = bi.getCArray() + bi.getPosition();
+                bi.skip(size);
+
+                if (shift > 7 || n < 0 || n > MotionPrediction::symbolBound(w, h)) return false;
+
+                scratch.resize(n, false);
+                if (!LZ4Codec::decompress(src, size, scratch.getCArray(), n)) return false;
+                if (!decoder.decode(scratch.getCArray(), n, w, h, shift)) return false;
+
+                const size_t row_bytes = w * BYTES_PER_PIXEL;
+                for (int row = 0; row < h; row++) {
+                    Compositor::copyRow(dst + row * stride, decoder.frame() + row * row_bytes, row_bytes);
+                }
+                return true;
+            }
+
+            void reset() override { encoder.forceKeyframe(); }
+    };
+
+    // =========================================
+    //                  YUV420
+    // =========================================
+
+    // Full range BT.601 (the JPEG flavour) in 8.8 fixed point, chroma averaged
+    // over every 2x2 block. The client's YUVToRGB.pix applies the same
+    // inverse as decode does here.
+    //
+    // Wire format: uint16 width, uint16 height, the Y plane, then the Cb and
+    // Cr planes at ceil(width / 2) x ceil(height / 2), all tightly packed
+    class YUV420Codec : public FrameCodec {
+        private:
+            static uint8 clamp8(int v) { return (uint8)iClamp(v, 0, 255); }
+
+        public:
+            CodecID id() const override { return YUV420_CODEC; }
+            const char* name() const override { return "YUV420"; }
+            bool decodesToPlanes() const override { return true; }
+
+            static int chromaSize(int length) { return (length + 1) / 2; }
+
+            void encode(const uint8* pixels, int width, int height, ptrdiff_t stride, BinaryOutput& bo) override {
+                const int cw = chromaSize(width);
+                const int ch = chromaSize(height);
+
+                scratch.resize(width * height + 2 * cw * ch, false);
+                uint8* y_plane = scratch.getCArray();
+                uint8* cb_plane = y_plane + width * height;
+                uint8* cr_plane = cb_plane + cw * ch;
+
+                runConcurrently(0, ch, [&](int cy) {
+                    const int y0 = cy * 2;
+                    const int rows = G3D::min(2, height - y0);
+
+                    for (int cx = 0; cx < cw; cx++) {
+                        const int x0 = cx * 2;
+                        const int cols = G3D::min(2, width - x0);
+                        int r = 0, g = 0, b = 0;
+
+                        for (int dy = 0; dy < rows; dy++) {
+                            const uint8* px = pixels + (y0 + dy) * stride + x0 * BYTES_PER_PIXEL;
+                            for (int dx = 0; dx < cols; dx++, px += BYTES_PER_PIXEL) {
+                                y_plane[(y0 + dy) * width + x0 + dx] = (uint8)((77 * px[0] + 150 * px[1] + 29 * px[2] + 128) >> 8);
+                                r += px[0]; g += px[1]; b += px[2];
+                            }
+                        }
+
+                        const int n = rows * cols;
+                        r /= n; g /= n; b /= n;
+                        cb_plane[cy * cw + cx] = clamp8(((-43 * r - 85 * g + 128 * b + 128) >> 8) + 128);
+                        cr_plane[cy * cw + cx] = clamp8(((128 * r - 107 * g - 21 * b + 128) >> 8) + 128);
+                    }
+                });
+
+                bo.writeUInt16((uint16)width);
+                bo.writeUInt16((uint16)height);
+                bo.writeBytes(scratch.getCArray(), scratch.size());
+            }
+
+            bool decodePlanes(BinaryInput& bi, uint8* const planes[3], const ptrdiff_t strides[3], int width, int height) override {
+                int w, h;
+                if (!readSize(bi, width, height, w, h)) return false;
+
+                const int cw = chromaSize(w);
+                const int ch = chromaSize(h);
+                if (bi.getLength() - bi.getPosition() < w * h + 2 * cw * ch) return false;
+
+                for (int row = 0; row < h; row++) bi.readBytes(planes[0] + row * strides[0], w);
+                for (int row = 0; row < ch; row++) bi.readBytes(planes[1] + row * strides[1], cw);
+                for (int row = 0; row < ch; row++) bi.readBytes(planes[2] + row * strides[2], cw);
+                return true;
+            }
+
+            bool decode(BinaryInput& bi, uint8* dst, ptrdiff_t stride, int width, int height) override {
+                int w, h;
+                if (!readSize(bi, width, height, w, h)) return false;
+
+                const int cw = chromaSize(w);
+                const int ch = chromaSize(h);
+                if (bi.getLength() - bi.getPosition() < w * h + 2 * cw * ch) return false;
+
+                const uint8* y_plane = bi.getCArray() + bi.getPosition();
+                const uint8* cb_plane = y_plane + w * h;
+                const uint8* cr_plane = cb_plane + cw * ch;
+                bi.skip(w * h + 2 * cw * ch);
+
+                runConcurrently(0, h, [&](int row) {
+                    uint8* px = dst + row * stride;
+                    const uint8* luma = y_plane + row * w;
+                    const uint8* cb = cb_plane + (row / 2) * cw;
+                    const uint8* cr = cr_plane + (row / 2) * cw;
+
+                    for (int x = 0; x < w; x++, px += BYTES_PER_PIXEL) {
+                        const int y = luma[x];
+                        const int u = cb[x / 2] - 128;
+                        const int v = cr[x / 2] - 128;
+                        px[0] = clamp8(y + ((359 * v + 128) >> 8));
+                        px[1] = clamp8(y - ((88 * u + 183 * v + 128) >> 8));
+                        px[2] = clamp8(y + ((454 * u + 128) >> 8));
+                    }
+                });
+                return true;
+            }
+    };
+
+    inline shared_ptr<FrameCodec> FrameCodec::create(CodecID id, uint32 keyframe_interval) {
+        switch (id) {
+            case LZ4_CODEC:         return createShared<LZ4Codec>();
+            case QOI_CODEC:         return createShared<QOICodec>();
+            case JPEG_CODEC:        return createShared<JPEGCodec>();
+            case BLOCK_DELTA_CODEC: return createShared<BlockDeltaCodec>(keyframe_interval);
+            case MOTION_CODEC:      return createShared<MotionCodec>(keyframe_interval);
+            case YUV420_CODEC:      return createShared<YUV420Codec>();
+            default:                return createShared<RawCodec>();
+        }
+    }
+
+}
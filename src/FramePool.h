@@ -0,0 +1,205 @@
+#pragma once
+#include <G3D/G3D.h>
+#include <mutex>
+#include <functional>
+#ifdef G3D_LINUX
+#include <sys/mman.h>
+#include <stdlib.h>
+#endif
+
+/* =========================================
+ *               Frame Pool
+ * =========================================
+ *
+ * Every frame the pipeline needs the same handful of multi-megabyte
+ * buffers: the GPU readback, the depth readback, the strips and the
+ * composite. FramePool keeps the buffers it hands out, keyed by
+ * (width, height, format), and hands one back out again once nobody else
+ * holds it. After the first frame nothing on the hot path allocates.
+ *
+ * A buffer nobody holds is dropped once it has not been asked for in
+ * STALE_FRAMES frames, or sooner once a request of its format misses and it
+ * was not asked for last frame either, so a resize does not leave the old
+ * sizes on the shelf for good.
+ *
+ * Misses are counted. Nodes call endFrame() once per frame, and after
+ * warm-up a nonzero count means a hot path is allocating.
+ *
+ * CPU buffers can optionally be backed by huge pages (2 MB pages through
+ * transparent huge pages on Linux, large pages on Windows when the
+ * process holds the privilege), which cuts TLB misses on full frame copies.
+ */
+
+namespace DistributedRenderer {
+
+    class ImageDist;
+
+    // MemoryManager that asks the OS for huge pages, falling back to normal pages
+    class HugePageMemoryManager : public MemoryManager {
+        protected:
+            HugePageMemoryManager() {}
+
+        public:
+            static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+            void* alloc(size_t s) override {
+#if defined(G3D_LINUX)
+                const size_t rounded = (s + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+                void* p = nullptr;
+                if (posix_memalign(&p, HUGE_PAGE_SIZE, rounded) != 0) return nullptr;
+                madvise(p, rounded, MADV_HUGEPAGE);
+                return p;
+#elif defined(G3D_WINDOWS)
+                void* p = nullptr;
+                const size_t large = GetLargePageMinimum();
+                if (large > 0) {
+                    p = VirtualAlloc(nullptr, (s + large - 1) & ~(large - 1), MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+                }
+                if (isNull(p)) p = VirtualAlloc(nullptr, s, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+                return p;
+#else
+                return System::alignedMalloc(s, 16);
+#endif
+            }
+
+            void free(void* p) override {
+                if (isNull(p)) return;
+#if defined(G3D_LINUX)
+                ::free(p);
+#elif defined(G3D_WINDOWS)
+                VirtualFree(p, 0, MEM_RELEASE);
+#else
+                System::alignedFree(p);
+#endif
+            }
+
+            bool isThreadsafe() const override { return true; }
+
+            static shared_ptr<HugePageMemoryManager> create() {
+                static const shared_ptr<HugePageMemoryManager> manager(new HugePageMemoryManager());
+                return manager;
+            }
+    };
+
+    class FramePool {
+        private:
+            template<class T>
+            struct entry_t {
+                int width;
+                int height;
+                const ImageFormat* format;
+                shared_ptr<T> item;
+                uint32 last_frame; // the frame it was last handed out in
+            };
+
+            std::mutex lock;
+            bool huge_pages = false;
+
+            // one shelf per type, picked by shelf((T*)nullptr)
+            Array<entry_t<CPUPixelTransferBuffer>> cpu_shelf;
+            Array<entry_t<GLPixelTransferBuffer>> gl_shelf;
+            Array<entry_t<ImageDist>> image_shelf;
+
+            Array<entry_t<CPUPixelTransferBuffer>>& shelf(CPUPixelTransferBuffer*) { return cpu_shelf; }
+            Array<entry_t<GLPixelTransferBuffer>>& shelf(GLPixelTransferBuffer*) { return gl_shelf; }
+            Array<entry_t<ImageDist>>& shelf(ImageDist*) { return image_shelf; }
+
+            uint32 frame = 0;
+            uint32 frame_allocations = 0;
+            uint32 total_allocations = 0;
+            uint32 total_evictions = 0;
+
+            FramePool() {}
+
+            // @pre: lock is held
+            // @post: drops the entries nobody holds that are stale, and those of format
+            // that were not handed out last frame either. Strips and regions of several
+            // sizes are asked for every frame, so a size only goes once it has sat one out
+            template<class T>
+            void evict(Array<entry_t<T>>& entries, const ImageFormat* format) {
+                for (int i = entries.size() - 1; i >= 0; i--) {
+                    const entry_t<T>& e = entries[i];
+                    if (e.item.use_count() != 1) continue;
+                    const uint32 idle = frame - e.last_frame;
+                    if (idle > STALE_FRAMES || (e.format == format && idle > 1)) {
+                        entries.fastRemove(i);
+                        ++total_evictions;
+                    }
+                }
+            }
+
+        public:
+            // frames a buffer nobody holds stays on the shelf without being asked for
+            static const uint32 STALE_FRAMES = 8;
+
+            static FramePool& instance() {
+                static FramePool pool;
+                return pool;
+            }
+
+            // back CPU buffers allocated from now on with huge pages
+            void setHugePages(bool enabled) { huge_pages = enabled; }
+
+            // @return: a pooled item of this size that nobody else holds, made with make if there is none
+            template<class T>
+            shared_ptr<T> acquire(int width, int height, const ImageFormat* format, const std::function<shared_ptr<T>()>& make) {
+                std::lock_guard<std::mutex> guard(lock);
+                Array<entry_t<T>>& entries = shelf((T*)nullptr);
+
+                for (int i = 0; i < entries.size(); i++) {
+                    entry_t<T>& e = entries[i];
+                    if (e.width == width && e.height == height && e.format == format && e.item.use_count() == 1) {
+                        e.last_frame = frame;
+                        return e.item;
+                    }
+                }
+
+                // a miss, other sizes of this format may be what it replaces
+                evict(entries, format);
+
+                entry_t<T> e;
+                e.width = width;
+                e.height = height;
+                e.format = format;
+                e.item = make();
+                e.last_frame = frame;
+                entries.append(e);
+
+                ++frame_allocations;
+                ++total_allocations;
+                return e.item;
+            }
+
+            shared_ptr<CPUPixelTransferBuffer> cpu(int width, int height, const ImageFormat* format = ImageFormat::RGB8()) {
+                return acquire<CPUPixelTransferBuffer>(width, height, format, [&]() {
+                    shared_ptr<MemoryManager> memory = AlignedMemoryManager::create();
+                    if (huge_pages) memory = HugePageMemoryManager::create();
+                    return CPUPixelTransferBuffer::create(width, height, format, memory, 1, 1);
+                });
+            }
+
+            // a pixel pack buffer for texture readback, same usage as Texture::toPixelTransferBuffer's own
+            shared_ptr<GLPixelTransferBuffer> gl(int width, int height, const ImageFormat* format) {
+                return acquire<GLPixelTransferBuffer>(width, height, format, [&]() {
+                    return GLPixelTransferBuffer::create(width, height, format, nullptr, 1, GL_STATIC_READ);
+                });
+            }
+
+            // @post: drops the stale entries of every shelf
+            // @return: items allocated since the last call
+            uint32 endFrame() {
+                std::lock_guard<std::mutex> guard(lock);
+                const uint32 n = frame_allocations;
+                frame_allocations = 0;
+                ++frame;
+                evict(cpu_shelf, nullptr);
+                evict(gl_shelf, nullptr);
+                evict(image_shelf, nullptr);
+                return n;
+            }
+
+            uint32 totalAllocations() const { return total_allocations; }
+
+            uint32 totalEvictions() const { return total_evictions; }
+    };
+}
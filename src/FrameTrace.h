@@ -0,0 +1,155 @@
+#pragma once
+#include <G3D/G3D.h>
+#include <mutex>
+#include <atomic>
+#include <cstdio>
+#include "ClockSync.h"
+#ifdef G3D_WINDOWS
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+/* =========================================
+ *               Frame Trace
+ * =========================================
+ *
+ * Every node can record spans of work, each keyed by the session and batch
+ * ID of the frame it was for, so one batch can be followed from the client's
+ * simulation through the router and the remotes and back to the present.
+ * Every client counts its batches from 0, the batch ID alone is not unique.
+ *
+ * Spans are buffered and written to <dir>/<node>-<host>-<pid>.trace, one
+ * per line as
+ *
+ *     <name> <session> <batch> <start us> <duration us> <thread>
+ *
+ * after a first line "# <node>-<host>-<pid>". Times are microseconds of
+ * cluster time, so spans from different machines line up as well as
+ * ClockSync keeps them. impl/TraceMerge.cpp merges the files of a run
+ * into one Chrome / Perfetto trace with a process per node.
+ *
+ * With no directory nothing is recorded and a Span costs a branch.
+ */
+
+namespace DistributedRenderer {
+
+    class FrameTrace {
+        private:
+
+            typedef struct {
+                const char* name; // a literal without spaces, spans only ever name themselves with one
+                uint8 session;
+                uint32 batch;
+                int64 start_us;
+                int64 duration_us;
+                int thread;
+            } span_t;
+
+            std::mutex lock;
+            FILE* file;
+            std::atomic<bool> recording; // file without the lock, for the check every span makes
+            Array<span_t> spans;
+            std::atomic<uint8> session;
+            std::atomic<uint32> batch;
+
+            FrameTrace() : file(nullptr), recording(false), session(0), batch(0) {}
+            ~FrameTrace() { close(); }
+
+            // small per-process thread numbers, Chrome lays out one row per thread
+            static int threadIndex() {
+                static std::atomic<int> next(0);
+                thread_local int index = next++;
+                return index;
+            }
+
+            // @pre: lock is held
+            void write() {
+                for (int i = 0; i < spans.size(); i++) {
+                    const span_t& s = spans[i];
+                    fprintf(file, "%s %u %u %lld %lld %d\n", s.name, (unsigned)s.session, s.batch, (long long)s.start_us, (long long)s.duration_us, s.thread);
+                }
+                spans.fastClear();
+            }
+
+        public:
+            static const int FLUSH_EVERY = 256;
+
+            static FrameTrace& instance() {
+                static FrameTrace trace;
+                return trace;
+            }
+
+            static int64 nowUs() {
+                return ClockSync::instance().clusterTimeNs() / 1000;
+            }
+
+            // @post: spans are recorded to dir under the node's name, host and process id,
+            // nothing is recorded if dir is empty
+            void open(const String& dir, const String& node) {
+                std::lock_guard<std::mutex> guard(lock);
+                if (dir == "" || notNull(file)) return;
+
+#ifdef G3D_WINDOWS
+                const int pid = _getpid();
+#else
+                const int pid = (int)getpid();
+#endif
+                const String name = format("%s-%s-%d", node.c_str(), NetAddress::localHostname().c_str(), pid);
+                FileSystem::createDirectory(dir);
+                file = fopen(FilePath::concat(dir, name + ".trace").c_str(), "w");
+                if (isNull(file)) {
+                    debugPrintf("Could not open a trace in %s\n", dir.c_str());
+                    return;
+                }
+                fprintf(file, "# %s\n", name.c_str());
+                recording = true;
+            }
+
+            bool enabled() const { return recording; }
+
+            // the session and batch spans are recorded against when they do not say
+            void setSession(uint8 id) { session = id; }
+            uint8 currentSession() const { return session; }
+            void setBatch(uint32 b) { batch = b; }
+            uint32 currentBatch() const { return batch; }
+
+            void record(const char* name, uint8 id, uint32 b, int64 start_us, int64 end_us) {
+                if (!enabled()) return;
+                span_t s = { name, id, b, start_us, end_us - start_us, threadIndex() };
+
+                std::lock_guard<std::mutex> guard(lock);
+                if (isNull(file)) return;
+                spans.append(s);
+                if (spans.size() >= FLUSH_EVERY) write();
+            }
+
+            void close() {
+                std::lock_guard<std::mutex> guard(lock);
+                if (isNull(file)) return;
+                recording = false;
+                write();
+                fclose(file);
+                file = nullptr;
+            }
+
+            // records the time from construction to destruction
+            class Span {
+                private:
+                    const char* name;
+                    uint8 session;
+                    uint32 batch;
+                    int64 start_us;
+
+                public:
+                    Span(const char* n) : Span(n, FrameTrace::instance().currentBatch()) {}
+                    Span(const char* n, uint32 b) : Span(n, FrameTrace::instance().currentSession(), b) {}
+                    // the router serves every session on the same threads, it always names the session
+                    Span(const char* n, uint8 id, uint32 b) : name(n), session(id), batch(b), start_us(FrameTrace::instance().enabled() ? FrameTrace::nowUs() : 0) {}
+                    ~Span() {
+                        FrameTrace& trace = FrameTrace::instance();
+                        if (trace.enabled()) trace.record(name, session, batch, start_us, FrameTrace::nowUs());
+                    }
+            };
+    };
+}
@@ -3,10 +3,15 @@
 #include "G3D-base/PixelTransferBuffer.h"
 #include "G3D-base/platform.h"
 #include "../../external/freeimage.lib/include/FreeImagePlus.h"
+#include "Compositor.h"
+#include "FramePool.h"
 
 
 namespace DistributedRenderer {
 
+	// Scanline i of an ImageDist is row i in whatever order the pipeline holds
+	// its rows (see frame_header_t), nothing here flips to suit FreeImage's
+	// bottom-up convention. That only matters for images loaded from files
 	class ImageDist : public Image {
 	
 	public:
@@ -118,7 +123,7 @@ namespace DistributedRenderer {
 			}
 
 			if (isNull(buffer)) {
-				buffer = CPUPixelTransferBuffer::create((int)rect.width(), (int)rect.height(), m_format, AlignedMemoryManager::create(), 1, 1);
+				buffer = FramePool::instance().cpu((int)rect.width(), (int)rect.height(), m_format);
 			}
 			else {
 				debugAssert(buffer->width() == rect.width());
@@ -134,12 +139,10 @@ namespace DistributedRenderer {
 
 				debugAssert(isFinite(rect.width()) && isFinite(rect.height()));
 
+				// scanlines are rows in pipeline order, no flip
 				uint8* ptr = (uint8*)buffer->mapWrite();
 				for (int row = 0; row < int(rect.height()); ++row) {
-					// Note that we flip vertically while copying
-					System::memcpy(ptr + buffer->rowOffset(row), m_image->getScanLine(rect.y0() + rect.height() - 1 - row + offsetStride), rowStride);
-
-					//int(rect.height()) - 1 - (row + int(rect.y0()))) + offsetStride, rowStride);
+					Compositor::copyRow(ptr + buffer->rowOffset(row), m_image->getScanLine(int(rect.y0()) + row) + offsetStride, rowStride);
 				}
 				buffer->unmap();
 			}
@@ -216,13 +219,13 @@ namespace DistributedRenderer {
 
 
 		static shared_ptr<ImageDist> fromPixelTransferBuffer(const shared_ptr<PixelTransferBuffer>& buffer, Rect2D bounds) {
-			const shared_ptr<ImageDist>& img = create(bounds.width(), bounds.height(), buffer->format());
+			const shared_ptr<ImageDist>& img = acquire(bounds.width(), bounds.height(), buffer->format());
 			img->set1(buffer, bounds);
 			return img;
 		}
 
 		static shared_ptr<ImageDist> fromPixelTransferBuffer(const shared_ptr<PixelTransferBuffer>& buffer) {
-			const shared_ptr<ImageDist>& img = create(buffer->width(), buffer->height(), buffer->format());
+			const shared_ptr<ImageDist>& img = acquire(buffer->width(), buffer->height(), buffer->format());
 			img->set(buffer);
 			return img;
 		}
@@ -235,34 +238,54 @@ namespace DistributedRenderer {
 			return img;
 		}
 
+		// A pooled image of this size, its fipImage is reused once nobody else holds it
+		static shared_ptr<ImageDist> acquire(int width, int height, const ImageFormat* imageFormat) {
+			return FramePool::instance().acquire<ImageDist>(width, height, imageFormat, [&]() {
+				return create(width, height, imageFormat);
+			});
+		}
+
+		// A view of rows that already exist, nothing is copied. Scanline i of the
+		// view is row i of pixels, the caller keeps pixels alive as long as the view
+		static shared_ptr<ImageDist> view(const uint8* pixels, int width, int height, size_t pitch, const ImageFormat* imageFormat) {
+			const shared_ptr<ImageDist>& img = createShared<ImageDist>();
+			*img->m_image = FreeImage_ConvertFromRawBitsEx(FALSE, const_cast<BYTE*>(pixels), FIT_BITMAP, width, height, (int)pitch,
+				imageFormat->cpuBitsPerPixel, FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK, FALSE);
+			img->m_format = imageFormat;
+			return img;
+		}
+
+		// This image as a compositor region placed at dst
+		Compositor::region_t region(const Rect2D& dst) const {
+			return Compositor::region(dst, m_image->getScanLine(0), m_image->getScanWidth());
+		}
+
+		// Stacks the images top to bottom, each keeps its own height
 		static shared_ptr<PixelTransferBuffer> CombineImages(const Array<shared_ptr<ImageDist> >& images) {
 			if (images.size() == 0) {
 				return nullptr;
 			}
 
 			const int width = images[0]->width();
-			const int perImageHeight = images[0]->height();
-			const int height = images[0]->height() * images.size();
-
-			const shared_ptr<CPUPixelTransferBuffer>& buffer = CPUPixelTransferBuffer::create(width, height, images[0]->format(), AlignedMemoryManager::create(), images.size(), 1);
+			int height = 0;
 
-			const int bytesPerPixel = iCeil(buffer->format()->cpuBitsPerPixel / 8.0f);
-			const int memoryPerImage = width * perImageHeight * bytesPerPixel;
-			const int memoryPerRow = width * bytesPerPixel;
-
-			uint8 *data = static_cast<uint8*>(buffer->buffer());
+			Array<Compositor::region_t> regions;
 			for (int i = 0; i < images.size(); ++i) {
-				fipImage *currentImage = images[i]->m_image;
-				for (int row = 0; row < perImageHeight; ++row) {
-					System::memcpy(data + (i * memoryPerImage) + row * memoryPerRow, currentImage->getScanLine(perImageHeight - 1 - row), memoryPerRow);
-				}
+				regions.append(images[i]->region(Rect2D::xywh(0, (float)height, (float)images[i]->width(), (float)images[i]->height())));
+				height += images[i]->height();
 			}
 
-			return buffer;
+			Compositor compositor(width, height, images[0]->format());
+			compositor.composite(regions);
+
+			return compositor.buffer();
 		}
 
 		void set1(const shared_ptr<PixelTransferBuffer>& buffer, Rect2D bounds) {
-			setSize(bounds.width(), bounds.height(), buffer->format());
+			// pooled images already have the right size, resizing would reallocate the fipImage
+			if (width() != int(bounds.width()) || height() != int(bounds.height()) || m_format != buffer->format()) {
+				setSize(bounds.width(), bounds.height(), buffer->format());
+			}
 
 			set2(buffer, bounds);
 		}
@@ -291,10 +314,9 @@ namespace DistributedRenderer {
 					const uint8* src = static_cast<const uint8*>(buffer->mapRead());
 					debugAssert(notNull(src));
 
-					// For each row in the rectangle
+					// For each row in the rectangle, scanlines keep the buffer's row order
 					for (int row = 0; row < rect.height(); ++row) {
-						BYTE* dst = m_image->getScanLine(int(rect.height() - row - 1));
-						System::memcpy(dst, src + buffer->width() * (row + int(rect.y0())) * bytesPerPixel, rowStride);
+						Compositor::copyRow(m_image->getScanLine(row), src + buffer->rowOffset(row + int(rect.y0())), rowStride);
 					}
 					buffer->unmap();
 				}
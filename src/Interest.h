@@ -0,0 +1,150 @@
+#pragma once
+#include <G3D/G3D.h>
+#include <map>
+#include "DistributedRenderer.h"
+
+/* =========================================
+ *            Interest Management
+ * =========================================
+ *
+ * A remote only needs to hear about the entities that can show up in its
+ * part of the screen. With interest management on, the client's UPDATE
+ * header carries after the views
+ *
+ *     tan(vertical fov / 2), count, then per entity with a record in the body:
+ *         NetID, bounding sphere centre and radius (float32 each)
+ *
+ * and the router projects every sphere into every view of the batch and
+ * sends each remote only the records of entities that land in its rows,
+ * give or take INTEREST_MARGIN. Sort-first that is the remote's strip,
+ * otherwise the whole screen, which still leaves out whatever is behind
+ * or beside every camera. Spawns and despawns go to everyone, so every
+ * remote's table stays the same, and so does anything without bounds to
+ * speak of, lights and entities that have not been posed yet.
+ *
+ * A remote that missed a record has a stale copy of the entity, which is
+ * fine as long as neither that copy nor the entity itself is anywhere it
+ * draws. The router keeps, per remote and session, the sphere each stale
+ * copy was last at, and once either sphere comes into the remote's rows,
+ * because the entity moved or the camera did, sends the entity's whole
+ * state from the session's snapshot in place of (or ahead of) its record,
+ * see SceneSnapshot::catchUp.
+ *
+ * Entities cast shadows into rows they are not in. The margin covers the
+ * usual short ones, a long shadow from an entity well outside it can be
+ * stale until the entity comes into interest.
+ */
+
+namespace DistributedRenderer {
+
+    class Interest {
+        public:
+            typedef struct {
+                EntityTable::NetID id;
+                Sphere bounds;
+            } entry_t;
+
+            // per remote and session, the entities whose copy there missed records, and where that copy was
+            typedef std::map<EntityTable::NetID, Sphere> stale_t;
+
+            // lights and entities not posed yet could be anywhere
+            static bool everywhere(const Sphere& s) { return !(s.radius > 0.0f) || !isFinite(s.radius); }
+
+            // @return: the bounds to send for an entity, from its last pose, grown by how far it moved since
+            // it was last sent so a pose that lags the frame is still inside
+            static Sphere boundsOf(const shared_ptr<Entity>& e, const Vector3& moved) {
+                if (notNull(dynamic_pointer_cast<Light>(e))) return Sphere(e->frame().translation, finf());
+
+                Sphere s;
+                e->getLastBounds(s);
+                s.radius += moved.length();
+                return s;
+            }
+
+            static void write(BinaryOutput& bo, float tan_half_fov_y, const Array<entry_t>& entries) {
+                bo.writeFloat32(tan_half_fov_y);
+                bo.writeUInt32((uint32)entries.size());
+                for (int i = 0; i < entries.size(); i++) {
+                    bo.writeUInt32(entries[i].id);
+                    bo.writeFloat32(entries[i].bounds.center.x);
+                    bo.writeFloat32(entries[i].bounds.center.y);
+                    bo.writeFloat32(entries[i].bounds.center.z);
+                    bo.writeFloat32(entries[i].bounds.radius);
+                }
+            }
+
+            static void read(BinaryInput& in, float& tan_half_fov_y, Array<entry_t>& entries) {
+                tan_half_fov_y = in.readFloat32();
+                entries.resize(in.readUInt32());
+                for (int i = 0; i < entries.size(); i++) {
+                    entries[i].id = in.readUInt32();
+                    entries[i].bounds.center.x = in.readFloat32();
+                    entries[i].bounds.center.y = in.readFloat32();
+                    entries[i].bounds.center.z = in.readFloat32();
+                    entries[i].bounds.radius = in.readFloat32();
+                }
+            }
+
+            // @return: whether the sphere, seen from any of the views, covers any of rows [y, y + h)
+            // of a width by height screen, widened by margin rows each way. Conservative, a sphere
+            // the near plane cuts counts as covering everything
+            static bool covers(const Sphere& s, const Array<MultiView::view_t>& views, float tan_half_fov_y, float width, float height, float y, float h, float margin) {
+                if (everywhere(s)) return true;
+
+                const float tan_half_fov_x = tan_half_fov_y * width / height;
+                for (int v = 0; v < views.size(); v++) {
+                    // camera space, looking down -z
+                    const Vector3 p = views[v].frame.pointToObjectSpace(s.center);
+                    const float z_near = -p.z - s.radius;
+                    const float z_far = -p.z + s.radius;
+                    if (z_far <= 0.0f) continue;  // behind the camera
+                    if (z_near <= 1e-3f) return true;
+
+                    // the extremes of the sphere's box over its nearest and farthest depth
+                    const float x_lo = G3D::min((p.x - s.radius) / z_near, (p.x - s.radius) / z_far) / tan_half_fov_x;
+                    const float x_hi = G3D::max((p.x + s.radius) / z_near, (p.x + s.radius) / z_far) / tan_half_fov_x;
+                    if (x_hi < -1.0f || x_lo > 1.0f) continue;
+
+                    const float y_lo = G3D::min((p.y - s.radius) / z_near, (p.y - s.radius) / z_far) / tan_half_fov_y;
+                    const float y_hi = G3D::max((p.y + s.radius) / z_near, (p.y + s.radius) / z_far) / tan_half_fov_y;
+
+                    // rows count from the top
+                    const float top = (1.0f - y_hi) * 0.5f * height;
+                    const float bottom = (1.0f - y_lo) * 0.5f * height;
+                    if (bottom >= y - margin && top < y + h + margin) return true;
+                }
+                return false;
+            }
+
+            // @pre: body at the start of an UPDATE record
+            // @post: body is past it, kind and id are the record's
+            // @return: false at a record it does not know, the rest of the body cannot be split
+            static bool nextRecord(BinaryInput& body, uint8& kind, EntityTable::NetID& id) {
+                kind = body.readUInt8();
+                id = body.readUInt32();
+                switch (kind) {
+                    case ENTITY_FRAME:
+                        body.skip(6 * sizeof(float));
+                        return true;
+                    case ENTITY_SPAWN:
+                        body.readString();
+                        body.readString();
+                        body.skip(6 * sizeof(float));
+                        return true;
+                    case ENTITY_DESPAWN:
+                        return true;
+                    case ENTITY_PROPERTIES: {
+                        PropertyReplication::state_t scratch = PropertyReplication::state_t();
+                        PropertyReplication::read(body, scratch);
+                        return true;
+                    }
+                    case ENTITY_FRAME_BLOCK:
+                        // id is the count, the router splits a block entity by entity itself
+                        TransformBlock::skip(body, id);
+                        return true;
+                    default:
+                        return false;
+                }
+            }
+    };
+}
@@ -0,0 +1,362 @@
+#pragma once
+#include <G3D/G3D.h>
+#include <emmintrin.h>
+
+/* =========================================
+ *        Motion Compensated Prediction
+ * =========================================
+ *
+ * Predicts every 16x16 block of an RGB8 strip from the previous frame,
+ * displaced by the screen-space motion the renderer already computed for
+ * motion blur (GBuffer::Field::SS_POSITION_CHANGE, in pixels, current
+ * minus previous). There is no motion search: the encoder only weighs the
+ * engine's vector at the block's centre against no motion at all and keeps
+ * whichever predicts the block better. Per block it then sends
+ *
+ *   INTRA    the block itself
+ *   SKIP     a vector, the prediction needs no correction
+ *   PREDICT  a vector and the residual against the prediction
+ *
+ * Residuals are exact at shift 0 (differences mod 256) and quantized to a
+ * step of 1 << shift otherwise. The encoder predicts from what the decoder
+ * will reconstruct rather than from the frames it is given, so quantized
+ * residuals never drift. A run of blocks is sent INTRA every frame
+ * whatever they look like, cycling through the strip so every block is
+ * refreshed once every refresh_interval frames. The first frame, and the
+ * first after a size change or forceKeyframe(), is INTRA throughout.
+ *
+ * Symbol stream, which the codec compresses as a whole:
+ *   per block, in block order: uint8 mode, then for SKIP and PREDICT
+ *   int16 dx, int16 dy (the block was at block - (dx, dy) last frame),
+ *   then for INTRA and PREDICT the rows of the block, clipped to the image
+ */
+
+namespace DistributedRenderer {
+
+    class MotionPrediction {
+        public:
+            static const int BLOCK_SIZE = 16;
+            static const int BYTES_PER_PIXEL = 3;
+
+            enum BlockMode {
+                INTRA,
+                SKIP,
+                PREDICT
+            };
+
+            static int blocksAcross(int width) { return (width + BLOCK_SIZE - 1) / BLOCK_SIZE; }
+            static int blocksDown(int height) { return (height + BLOCK_SIZE - 1) / BLOCK_SIZE; }
+
+            // worst case size of the symbol stream for one frame
+            static int symbolBound(int width, int height) { return blocksAcross(width) * blocksDown(height) * 5 + width * height * BYTES_PER_PIXEL; }
+
+            // @return: sum of absolute differences of two blocks of rows x n bytes
+            static uint32 sad(const uint8* a, ptrdiff_t a_stride, const uint8* b, ptrdiff_t b_stride, int rows, int n) {
+                uint32 total = 0;
+                for (int r = 0; r < rows; r++) {
+                    const uint8* pa = a + r * a_stride;
+                    const uint8* pb = b + r * b_stride;
+                    int i = 0;
+                    __m128i acc = _mm_setzero_si128();
+                    for (; i + 16 <= n; i += 16) {
+                        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(pa + i)), _mm_loadu_si128((const __m128i*)(pb + i))));
+                    }
+                    total += _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+                    for (; i < n; i++) total += abs(pa[i] - pb[i]);
+                }
+                return total;
+            }
+
+            // @post: out and recon hold the row with the low bits mask drops cleared
+            static void intraRow(const uint8* cur, uint8* out, uint8* recon, int n, uint8 mask) {
+                const __m128i m = _mm_set1_epi8((char)mask);
+                int i = 0;
+                for (; i + 16 <= n; i += 16) {
+                    const __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i*)(cur + i)), m);
+                    _mm_storeu_si128((__m128i*)(out + i), v);
+                    _mm_storeu_si128((__m128i*)(recon + i), v);
+                }
+                for (; i < n; i++) out[i] = recon[i] = cur[i] & mask;
+            }
+
+            // @post: res holds cur - pred at this shift and recon what the decoder will rebuild from it
+            // @return: true if any residual is nonzero
+            static bool residualRow(const uint8* cur, const uint8* pred, uint8* res, uint8* recon, int n, int shift) {
+                int i = 0;
+
+                if (shift == 0) {
+                    __m128i any = _mm_setzero_si128();
+                    for (; i + 16 <= n; i += 16) {
+                        const __m128i d = _mm_sub_epi8(_mm_loadu_si128((const __m128i*)(cur + i)), _mm_loadu_si128((const __m128i*)(pred + i)));
+                        _mm_storeu_si128((__m128i*)(res + i), d);
+                        any = _mm_or_si128(any, d);
+                    }
+                    bool nonzero = _mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) != 0xFFFF;
+                    for (; i < n; i++) {
+                        res[i] = (uint8)(cur[i] - pred[i]);
+                        nonzero = nonzero || res[i] != 0;
+                    }
+                    System::memcpy(recon, cur, n);
+                    return nonzero;
+                }
+
+                const int step = 1 << shift;
+                const int half = step >> 1;
+                bool nonzero = false;
+                for (; i < n; i++) {
+                    // round to nearest, ties towards zero so differences within half a step skip
+                    const int d = cur[i] - pred[i];
+                    const int q = iClamp((d >= 0) ? (d + half - 1) / step : -((half - 1 - d) / step), -128, 127);
+                    res[i] = (uint8)(int8)q;
+                    recon[i] = (uint8)iClamp(pred[i] + q * step, 0, 255);
+                    nonzero = nonzero || q != 0;
+                }
+                return nonzero;
+            }
+
+            // @post: recon holds pred corrected by the residual, the inverse of residualRow
+            static void reconstructRow(const uint8* pred, const uint8* res, uint8* recon, int n, int shift) {
+                int i = 0;
+
+                if (shift == 0) {
+                    for (; i + 16 <= n; i += 16) {
+                        _mm_storeu_si128((__m128i*)(recon + i), _mm_add_epi8(_mm_loadu_si128((const __m128i*)(pred + i)), _mm_loadu_si128((const __m128i*)(res + i))));
+                    }
+                    for (; i < n; i++) recon[i] = (uint8)(pred[i] + res[i]);
+                    return;
+                }
+
+                const int step = 1 << shift;
+                for (; i < n; i++) recon[i] = (uint8)iClamp(pred[i] + (int8)res[i] * step, 0, 255);
+            }
+
+            // @post: writes width x height motion vectors, 2 floats a pixel and stride floats a row, to filename
+            static void saveMotion(const String& filename, const float* motion, int width, int height, ptrdiff_t stride) {
+                BinaryOutput bo(filename, G3D_LITTLE_ENDIAN);
+                bo.writeUInt32(width);
+                bo.writeUInt32(height);
+                for (int row = 0; row < height; row++) {
+                    bo.writeBytes(motion + row * stride, width * 2 * sizeof(float));
+                }
+                bo.commit();
+            }
+
+            // @post: reads motion vectors written by saveMotion, tightly packed
+            static void loadMotion(const String& filename, Array<float>& motion, int& width, int& height) {
+                BinaryInput bi(filename, G3D_LITTLE_ENDIAN);
+                width = bi.readUInt32();
+                height = bi.readUInt32();
+                motion.resize(width * height * 2, false);
+                bi.readBytes(motion.getCArray(), motion.size() * sizeof(float));
+            }
+    };
+
+    class MotionEncoder {
+        private:
+            // what the decoder holds after the last frame, and what it will hold after this one
+            Array<uint8> frames[2];
+            int current = 0;
+
+            int width = 0;
+            int height = 0;
+
+            int refresh_cursor = 0;
+            bool force_keyframe = true;
+
+            static void writeInt16(uint8* out, int& op, int v) {
+                const int16 s = (int16)v;
+                System::memcpy(out + op, &s, 2);
+                op += 2;
+            }
+
+        public:
+            uint32 refresh_interval;
+
+            MotionEncoder(uint32 interval = 60) : refresh_interval(interval) {}
+
+            // the next frame will be sent INTRA throughout
+            void forceKeyframe() { force_keyframe = true; }
+
+            // @pre: pixels points to the first row of a width x height RGB8 image, rows stride bytes apart.
+            // motion is nullptr or points to the vectors of the same first row, 2 floats a pixel, rows
+            // motion_stride floats apart. Residuals are quantized to a step of 1 << shift
+            // @post: appends the frame's symbols to symbols and remembers the reconstruction as the new reference
+            // @return: the number of blocks that were not skipped
+            int encode(const uint8* pixels, int w, int h, ptrdiff_t stride, const float* motion, ptrdiff_t motion_stride, int shift, Array<uint8>& symbols) {
+
+                const int row_bytes = w * MotionPrediction::BYTES_PER_PIXEL;
+
+                if (w != width || h != height) {
+                    width = w;
+                    height = h;
+                    frames[0].resize(row_bytes * h);
+                    frames[1].resize(row_bytes * h);
+                    force_keyframe = true;
+                }
+
+                const int across = MotionPrediction::blocksAcross(width);
+                const int down = MotionPrediction::blocksDown(height);
+                const int blocks = across * down;
+
+                // blocks sent INTRA this frame regardless, so the whole strip cycles through in refresh_interval frames
+                const int refresh = force_keyframe ? blocks : (refresh_interval > 0) ? (blocks + refresh_interval - 1) / refresh_interval : 0;
+                const uint8 intra_mask = (uint8)(0xFF << shift);
+
+                const int start = symbols.size();
+                symbols.resize(start + MotionPrediction::symbolBound(width, height), false);
+                uint8* out = symbols.getCArray() + start;
+                int op = 0;
+
+                const uint8* reference = frames[current ^ 1].getCArray();
+                uint8* recon = frames[current].getCArray();
+                int sent = 0;
+
+                for (int block = 0; block < blocks; block++) {
+                    const int x0 = (block % across) * MotionPrediction::BLOCK_SIZE;
+                    const int y0 = (block / across) * MotionPrediction::BLOCK_SIZE;
+                    const int bw = G3D::min(MotionPrediction::BLOCK_SIZE, width - x0);
+                    const int bh = G3D::min(MotionPrediction::BLOCK_SIZE, height - y0);
+                    const int n = bw * MotionPrediction::BYTES_PER_PIXEL;
+
+                    const uint8* cur = pixels + y0 * stride + x0 * MotionPrediction::BYTES_PER_PIXEL;
+                    uint8* rec = recon + y0 * row_bytes + x0 * MotionPrediction::BYTES_PER_PIXEL;
+
+                    if (((block - refresh_cursor + blocks) % blocks) < refresh) {
+                        out[op++] = MotionPrediction::INTRA;
+                        for (int r = 0; r < bh; r++) {
+                            MotionPrediction::intraRow(cur + r * stride, out + op, rec + r * row_bytes, n, intra_mask);
+                            op += n;
+                        }
+                        ++sent;
+                        continue;
+                    }
+
+                    // the engine's vector, clamped so the whole source block lies inside the reference
+                    int sx = x0;
+                    int sy = y0;
+                    if (notNull(motion)) {
+                        const float* mv = motion + (y0 + bh / 2) * motion_stride + (x0 + bw / 2) * 2;
+                        if (G3D::isFinite(mv[0]) && G3D::isFinite(mv[1])) {
+                            sx = iClamp(x0 - iRound(G3D::clamp(mv[0], -(float)width, (float)width)), 0, width - bw);
+                            sy = iClamp(y0 - iRound(G3D::clamp(mv[1], -(float)height, (float)height)), 0, height - bh);
+                        }
+                    }
+
+                    const uint8* still = reference + y0 * row_bytes + x0 * MotionPrediction::BYTES_PER_PIXEL;
+                    const uint8* pred = reference + sy * row_bytes + sx * MotionPrediction::BYTES_PER_PIXEL;
+
+                    // keep the vector only if it beats standing still
+                    if (pred != still && MotionPrediction::sad(cur, stride, still, row_bytes, bh, n) <= MotionPrediction::sad(cur, stride, pred, row_bytes, bh, n)) {
+                        sx = x0;
+                        sy = y0;
+                        pred = still;
+                    }
+
+                    const int mode_pos = op++;
+                    writeInt16(out, op, x0 - sx);
+                    writeInt16(out, op, y0 - sy);
+
+                    bool nonzero = false;
+                    for (int r = 0; r < bh; r++) {
+                        nonzero = MotionPrediction::residualRow(cur + r * stride, pred + r * row_bytes, out + op + r * n, rec + r * row_bytes, n, shift) || nonzero;
+                    }
+
+                    if (nonzero) {
+                        out[mode_pos] = MotionPrediction::PREDICT;
+                        op += bh * n;
+                        ++sent;
+                    } else {
+                        out[mode_pos] = MotionPrediction::SKIP;
+                    }
+                }
+
+                symbols.resize(start + op, false);
+
+                refresh_cursor = (refresh_cursor + refresh) % G3D::max(blocks, 1);
+                force_keyframe = false;
+                current ^= 1;
+                return sent;
+            }
+    };
+
+    class MotionDecoder {
+        private:
+            // the last frame decoded, and the one being decoded
+            Array<uint8> frames[2];
+            int current = 0;
+
+            int width = 0;
+            int height = 0;
+
+        public:
+            // @pre: one frame's symbols, n bytes, for a width x height strip quantized at shift
+            // @post: frame() holds the decoded strip, tightly packed
+            // @return: false if the symbols are malformed
+            bool decode(const uint8* in, int n, int w, int h, int shift) {
+
+                const int row_bytes = w * MotionPrediction::BYTES_PER_PIXEL;
+
+                if (w != width || h != height) {
+                    width = w;
+                    height = h;
+                    frames[0].resize(row_bytes * h);
+                    frames[1].resize(row_bytes * h);
+                    System::memset(frames[0].getCArray(), 0, frames[0].size());
+                    System::memset(frames[1].getCArray(), 0, frames[1].size());
+                }
+
+                current ^= 1;
+                const uint8* reference = frames[current ^ 1].getCArray();
+                uint8* recon = frames[current].getCArray();
+
+                const int across = MotionPrediction::blocksAcross(width);
+                const int blocks = across * MotionPrediction::blocksDown(height);
+                int ip = 0;
+
+                for (int block = 0; block < blocks; block++) {
+                    const int x0 = (block % across) * MotionPrediction::BLOCK_SIZE;
+                    const int y0 = (block / across) * MotionPrediction::BLOCK_SIZE;
+                    const int bw = G3D::min(MotionPrediction::BLOCK_SIZE, width - x0);
+                    const int bh = G3D::min(MotionPrediction::BLOCK_SIZE, height - y0);
+                    const int bn = bw * MotionPrediction::BYTES_PER_PIXEL;
+
+                    uint8* rec = recon + y0 * row_bytes + x0 * MotionPrediction::BYTES_PER_PIXEL;
+
+                    if (ip >= n) return false;
+                    const uint8 mode = in[ip++];
+
+                    if (mode == MotionPrediction::INTRA) {
+                        if (ip + bh * bn > n) return false;
+                        for (int r = 0; r < bh; r++, ip += bn) System::memcpy(rec + r * row_bytes, in + ip, bn);
+                        continue;
+                    }
+
+                    if (mode > MotionPrediction::PREDICT || ip + 4 > n) return false;
+                    int16 dx, dy;
+                    System::memcpy(&dx, in + ip, 2);
+                    System::memcpy(&dy, in + ip + 2, 2);
+                    ip += 4;
+
+                    const int sx = x0 - dx;
+                    const int sy = y0 - dy;
+                    if (sx < 0 || sy < 0 || sx + bw > width || sy + bh > height) return false;
+                    const uint8* pred = reference + sy * row_bytes + sx * MotionPrediction::BYTES_PER_PIXEL;
+
+                    if (mode == MotionPrediction::SKIP) {
+                        for (int r = 0; r < bh; r++) System::memcpy(rec + r * row_bytes, pred + r * row_bytes, bn);
+                        continue;
+                    }
+
+                    if (ip + bh * bn > n) return false;
+                    for (int r = 0; r < bh; r++, ip += bn) {
+                        MotionPrediction::reconstructRow(pred + r * row_bytes, in + ip, rec + r * row_bytes, bn, shift);
+                    }
+                }
+
+                return true;
+            }
+
+            // the strip last decoded, width x height RGB8 rows, tightly packed
+            const uint8* frame() const { return frames[current].getCArray(); }
+    };
+}
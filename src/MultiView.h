@@ -0,0 +1,144 @@
+#pragma once
+#include <G3D/G3D.h>
+
+/* =========================================
+ *                Multi View
+ * =========================================
+ *
+ * A batch can be rendered from several cameras at once, both eyes for
+ * stereo or the player's view and a minimap above it. The client sends
+ * the views of the layout with every UPDATE, and the router deals each
+ * (view, region) work item to a remote: every remote its own strip of
+ * every view in sort-first, its entities in every view in sort-last, and
+ * one remote per view when alternate-frame. A remote syncs and poses the
+ * scene once and renders all the views it was dealt from it, so entity
+ * sync, posing and shadow maps (which only redraw when something moved)
+ * are paid once per batch rather than once per view.
+ *
+ * FRAGMENT and FRAME bodies carry one layer per view, back to back, with
+ * a table in the header of which view each layer is and how many bytes it
+ * takes. Every view is its own stream, coded with a codec instance of its own.
+ *
+ * Every view is rendered at the size of the whole frame, the client lays
+ * them out on the window:
+ *
+ *     SINGLE_VIEW   the camera, over the whole window
+ *     STEREO_VIEWS  the left and right eye, each squeezed into half of it (half side-by-side)
+ *     MINIMAP_VIEW  the camera, and a top-down view above it in the top right corner
+ */
+
+namespace DistributedRenderer {
+
+    enum ViewLayout {
+        SINGLE_VIEW,
+        STEREO_VIEWS,
+        MINIMAP_VIEW
+    };
+
+    class MultiView {
+        public:
+            static const int MAX_VIEWS = 8; // render masks are a byte
+
+            // one camera of a batch
+            typedef struct {
+                CoordinateFrame frame;
+                float fov; // radians, in the direction the camera measures it
+            } view_t;
+
+            // one view's part of a FRAGMENT or FRAME body
+            typedef struct {
+                uint8 view;
+                uint32 bytes;
+            } layer_t;
+
+            static int count(ViewLayout layout) { return (layout == SINGLE_VIEW) ? 1 : 2; }
+
+            // @post: out holds the layout's views of a camera at frame with field of view fov
+            static void fromCamera(const CoordinateFrame& frame, float fov, ViewLayout layout, float eye_separation, float minimap_height, Array<view_t>& out) {
+                out.fastClear();
+                view_t v;
+                v.frame = frame;
+                v.fov = fov;
+
+                if (layout == STEREO_VIEWS) {
+                    const Vector3 right = frame.rightVector() * (eye_separation * 0.5f);
+                    v.frame.translation = frame.translation - right;
+                    out.append(v);
+                    v.frame.translation = frame.translation + right;
+                    out.append(v);
+                    return;
+                }
+
+                out.append(v);
+                if (layout == MINIMAP_VIEW) {
+                    // straight down, with the way the camera faces at the top
+                    Vector3 ahead = frame.lookVector();
+                    ahead.y = 0;
+                    if (ahead.squaredLength() < 1e-6f) ahead = -Vector3::unitZ();
+
+                    v.frame = CoordinateFrame(frame.translation + Vector3::unitY() * minimap_height);
+                    v.frame.lookAt(v.frame.translation - Vector3::unitY(), ahead.direction());
+                    out.append(v);
+                }
+            }
+
+            // @return: where view goes on a window w by h
+            static Rect2D screenRect(ViewLayout layout, int view, float w, float h, float minimap_fraction) {
+                if (layout == STEREO_VIEWS) return Rect2D::xywh(view * w * 0.5f, 0, w * 0.5f, h);
+                if (layout == MINIMAP_VIEW && view == 1) {
+                    const float mw = w * minimap_fraction;
+                    const float mh = h * minimap_fraction;
+                    return Rect2D::xywh(w - mw, 0, mw, mh);
+                }
+                return Rect2D::xywh(0, 0, w, h);
+            }
+
+            // the view table of an UPDATE
+            static void write(BinaryOutput& bo, const Array<view_t>& views) {
+                bo.writeUInt8((uint8)views.size());
+                for (int i = 0; i < views.size(); i++) {
+                    float x, y, z, yaw, pitch, roll;
+                    views[i].frame.getXYZYPRRadians(x, y, z, yaw, pitch, roll);
+                    bo.writeFloat32(x);
+                    bo.writeFloat32(y);
+                    bo.writeFloat32(z);
+                    bo.writeFloat32(yaw);
+                    bo.writeFloat32(pitch);
+                    bo.writeFloat32(roll);
+                    bo.writeFloat32(views[i].fov);
+                }
+            }
+
+            static void read(BinaryInput& in, Array<view_t>& views) {
+                const int n = G3D::min((int)in.readUInt8(), MAX_VIEWS);
+                views.resize(n);
+                for (int i = 0; i < n; i++) {
+                    const float x = in.readFloat32();
+                    const float y = in.readFloat32();
+                    const float z = in.readFloat32();
+                    const float yaw = in.readFloat32();
+                    const float pitch = in.readFloat32();
+                    const float roll = in.readFloat32();
+                    views[i].frame = CoordinateFrame::fromXYZYPRRadians(x, y, z, yaw, pitch, roll);
+                    views[i].fov = in.readFloat32();
+                }
+            }
+
+            // the layer table of a FRAGMENT or FRAME
+            static void writeLayers(BinaryOutput& bo, const Array<layer_t>& layers) {
+                bo.writeUInt8((uint8)layers.size());
+                for (int i = 0; i < layers.size(); i++) {
+                    bo.writeUInt8(layers[i].view);
+                    bo.writeUInt32(layers[i].bytes);
+                }
+            }
+
+            static void readLayers(BinaryInput& in, Array<layer_t>& layers) {
+                layers.resize(in.readUInt8());
+                for (int i = 0; i < layers.size(); i++) {
+                    layers[i].view = in.readUInt8();
+                    layers[i].bytes = in.readUInt32();
+                }
+            }
+    };
+}
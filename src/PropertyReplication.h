@@ -0,0 +1,249 @@
+#pragma once
+#include <G3D/G3D.h>
+
+/* =========================================
+ *           Property Replication
+ * =========================================
+ *
+ * What the remotes see of an entity beyond its frame. Every replicated
+ * entity's state is a state_t, the client keeps the last one it sent and
+ * each UPDATE carries only what changed since, behind a change mask:
+ *
+ *     properties (uint8), [parameters (uint8),] then the changed ones in bit order
+ *
+ *     FRAME          x, y, z, yaw, pitch, roll, float32 each, exact
+ *     VISIBLE        } one byte between them, bit 0 visible, bit 1 enabled
+ *     LIGHT_ENABLED  }
+ *     LIGHT_COLOR    RGB9E5, a shared exponent and 9 bits a channel, 4 bytes
+ *     ANIMATION      float64 simulation time the entity's pose animation counts from
+ *     PARAMETERS     float32 for each bit of the parameter mask
+ *
+ * Lights are G3D's own. Animation and material parameters belong to the
+ * game's entity classes, which opt in by implementing ReplicatedEntity.
+ * Only where an entity's animation starts is replicated, and only when it
+ * restarts. Every batch carries the client's simulation time, and the
+ * remote poses each entity at it, MD3 or articulated, exactly as the
+ * client's did.
+ */
+
+namespace DistributedRenderer {
+
+    // Implemented by game entities with visual state of their own
+    class ReplicatedEntity {
+        public:
+            virtual ~ReplicatedEntity() {}
+
+            // the simulation time the entity's pose animation counts from
+            virtual SimTime animationStart() const = 0;
+            virtual void setAnimationStart(SimTime start) = 0;
+
+            // @post: posed at simulation time t, on remotes instead of simulating
+            virtual void poseAt(SimTime t) = 0;
+
+            // animated material parameters, emissive strength, UV scroll and the like
+            virtual int parameterCount() const { return 0; }
+            virtual float parameter(int i) const { return 0.0f; }
+            virtual void setParameter(int i, float value) {}
+    };
+
+    class PropertyReplication {
+        public:
+            enum Property {
+                FRAME         = 1 << 0,
+                VISIBLE       = 1 << 1,
+                LIGHT_ENABLED = 1 << 2,
+                LIGHT_COLOR   = 1 << 3,
+                ANIMATION     = 1 << 4,
+                PARAMETERS    = 1 << 5
+            };
+
+            static const int MAX_PARAMETERS = 8; // the parameter mask is a byte
+
+            // low byte properties, high byte which parameters
+            typedef uint16 mask_t;
+
+            typedef struct {
+                uint8 has; // the properties the entity has at all
+                CoordinateFrame frame;
+                bool visible;
+                bool light_enabled;
+                Color3 light_color;
+                SimTime animation_start;
+                uint8 parameter_count;
+                float parameters[MAX_PARAMETERS];
+            } state_t;
+
+        private:
+            // RGB9E5 as OpenGL defines it, non-negative and up to 65408
+            static uint32 packColor(const Color3& c) {
+                const float max_value = 65408.0f;
+                const float r = G3D::clamp(c.r, 0.0f, max_value);
+                const float g = G3D::clamp(c.g, 0.0f, max_value);
+                const float b = G3D::clamp(c.b, 0.0f, max_value);
+                const float largest = G3D::max(r, G3D::max(g, b));
+
+                int exponent = G3D::max(-16, (int)floor(log2(G3D::max(largest, 1e-30f)))) + 1 + 15;
+                float scale = (float)pow(2.0, exponent - 15 - 9);
+                if ((int)floor(largest / scale + 0.5f) == 512) {
+                    ++exponent;
+                    scale *= 2.0f;
+                }
+                const uint32 rm = (uint32)floor(r / scale + 0.5f);
+                const uint32 gm = (uint32)floor(g / scale + 0.5f);
+                const uint32 bm = (uint32)floor(b / scale + 0.5f);
+                return rm | (gm << 9) | (bm << 18) | ((uint32)iClamp(exponent, 0, 31) << 27);
+            }
+
+            static Color3 unpackColor(uint32 v) {
+                const float scale = (float)pow(2.0, (int)(v >> 27) - 15 - 9);
+                return Color3((v & 511) * scale, ((v >> 9) & 511) * scale, ((v >> 18) & 511) * scale);
+            }
+
+        public:
+            // @post: s holds the entity's replicated state as it is now
+            static void capture(const shared_ptr<Entity>& e, state_t& s) {
+                s.has = FRAME;
+                s.frame = e->frame();
+
+                const shared_ptr<VisibleEntity> visible = dynamic_pointer_cast<VisibleEntity>(e);
+                if (notNull(visible)) {
+                    s.has |= VISIBLE;
+                    s.visible = visible->visible();
+                }
+
+                const shared_ptr<Light> light = dynamic_pointer_cast<Light>(e);
+                if (notNull(light)) {
+                    s.has |= LIGHT_ENABLED | LIGHT_COLOR;
+                    s.light_enabled = light->enabled();
+                    s.light_color = light->color();
+                }
+
+                const shared_ptr<ReplicatedEntity> replicated = dynamic_pointer_cast<ReplicatedEntity>(e);
+                if (notNull(replicated)) {
+                    s.has |= ANIMATION;
+                    s.animation_start = replicated->animationStart();
+                    s.parameter_count = (uint8)iClamp(replicated->parameterCount(), 0, MAX_PARAMETERS);
+                    if (s.parameter_count > 0) s.has |= PARAMETERS;
+                    for (int i = 0; i < s.parameter_count; i++) s.parameters[i] = replicated->parameter(i);
+                }
+            }
+
+            // @return: what differs between the state last sent and the state now
+            static mask_t changed(const state_t& sent, const state_t& now) {
+                mask_t mask = now.has & ~sent.has;
+                const uint8 both = now.has & sent.has;
+                if ((both & FRAME) && sent.frame != now.frame) mask |= FRAME;
+                if ((both & VISIBLE) && sent.visible != now.visible) mask |= VISIBLE;
+                if ((both & LIGHT_ENABLED) && sent.light_enabled != now.light_enabled) mask |= LIGHT_ENABLED;
+                if ((both & LIGHT_COLOR) && sent.light_color != now.light_color) mask |= LIGHT_COLOR;
+                if ((both & ANIMATION) && sent.animation_start != now.animation_start) mask |= ANIMATION;
+                if (now.has & PARAMETERS) {
+                    for (int i = 0; i < now.parameter_count; i++) {
+                        if (!(sent.has & PARAMETERS) || i >= sent.parameter_count || sent.parameters[i] != now.parameters[i]) mask |= PARAMETERS | (1 << (8 + i));
+                    }
+                }
+                return mask;
+            }
+
+            // @return: every property the state has, all of its parameters
+            static mask_t all(const state_t& s) {
+                mask_t mask = s.has;
+                if (s.has & PARAMETERS) mask |= (mask_t)(((1 << s.parameter_count) - 1) << 8);
+                return mask;
+            }
+
+            static void write(BinaryOutput& bo, const state_t& s, mask_t mask) {
+                const uint8 properties = (uint8)(mask & 0xFF);
+                bo.writeUInt8(properties);
+                if (properties & PARAMETERS) bo.writeUInt8((uint8)(mask >> 8));
+
+                if (properties & FRAME) {
+                    float x, y, z, yaw, pitch, roll;
+                    s.frame.getXYZYPRRadians(x, y, z, yaw, pitch, roll);
+                    bo.writeFloat32(x);
+                    bo.writeFloat32(y);
+                    bo.writeFloat32(z);
+                    bo.writeFloat32(yaw);
+                    bo.writeFloat32(pitch);
+                    bo.writeFloat32(roll);
+                }
+                if (properties & (VISIBLE | LIGHT_ENABLED)) bo.writeUInt8((s.visible ? 1 : 0) | (s.light_enabled ? 2 : 0));
+                if (properties & LIGHT_COLOR) bo.writeUInt32(packColor(s.light_color));
+                if (properties & ANIMATION) bo.writeFloat64(s.animation_start);
+                if (properties & PARAMETERS) {
+                    for (int i = 0; i < MAX_PARAMETERS; i++) {
+                        if (mask & (1 << (8 + i))) bo.writeFloat32(s.parameters[i]);
+                    }
+                }
+            }
+
+            // @post: the properties in the mask read are set in s, the rest are left as they were
+            // @return: the mask read
+            static mask_t read(BinaryInput& in, state_t& s) {
+                const uint8 properties = in.readUInt8();
+                mask_t mask = properties;
+                if (properties & PARAMETERS) mask |= (mask_t)in.readUInt8() << 8;
+                s.has |= properties;
+
+                if (properties & FRAME) {
+                    const float x = in.readFloat32();
+                    const float y = in.readFloat32();
+                    const float z = in.readFloat32();
+                    const float yaw = in.readFloat32();
+                    const float pitch = in.readFloat32();
+                    const float roll = in.readFloat32();
+                    s.frame = CoordinateFrame::fromXYZYPRRadians(x, y, z, yaw, pitch, roll);
+                }
+                if (properties & (VISIBLE | LIGHT_ENABLED)) {
+                    const uint8 bits = in.readUInt8();
+                    if (properties & VISIBLE) s.visible = (bits & 1) != 0;
+                    if (properties & LIGHT_ENABLED) s.light_enabled = (bits & 2) != 0;
+                }
+                if (properties & LIGHT_COLOR) s.light_color = unpackColor(in.readUInt32());
+                if (properties & ANIMATION) s.animation_start = in.readFloat64();
+                if (properties & PARAMETERS) {
+                    for (int i = 0; i < MAX_PARAMETERS; i++) {
+                        if (!(mask & (1 << (8 + i)))) continue;
+                        s.parameters[i] = in.readFloat32();
+                        s.parameter_count = (uint8)G3D::max((int)s.parameter_count, i + 1);
+                    }
+                }
+                return mask;
+            }
+
+            // @post: the properties in mask are set on the entity, those it does not have are skipped
+            static void apply(const shared_ptr<Entity>& e, const state_t& s, mask_t mask) {
+                if (mask & FRAME) e->setFrame(s.frame, true);
+
+                if (mask & VISIBLE) {
+                    const shared_ptr<VisibleEntity> visible = dynamic_pointer_cast<VisibleEntity>(e);
+                    if (notNull(visible)) visible->setVisible(s.visible);
+                }
+
+                if (mask & (LIGHT_ENABLED | LIGHT_COLOR)) {
+                    const shared_ptr<Light> light = dynamic_pointer_cast<Light>(e);
+                    if (notNull(light)) {
+                        if (mask & LIGHT_ENABLED) light->setEnabled(s.light_enabled);
+                        if (mask & LIGHT_COLOR) light->setColor(s.light_color);
+                    }
+                }
+
+                if (mask & (ANIMATION | PARAMETERS)) {
+                    const shared_ptr<ReplicatedEntity> replicated = dynamic_pointer_cast<ReplicatedEntity>(e);
+                    if (notNull(replicated)) {
+                        if (mask & ANIMATION) replicated->setAnimationStart(s.animation_start);
+                        for (int i = 0; i < MAX_PARAMETERS; i++) {
+                            if (mask & (1 << (8 + i))) replicated->setParameter(i, s.parameters[i]);
+                        }
+                    }
+                }
+            }
+
+            // @post: an animated entity is posed at the batch's simulation time t
+            static void pose(const shared_ptr<Entity>& e, const state_t& s, SimTime t) {
+                if (!(s.has & ANIMATION)) return;
+                const shared_ptr<ReplicatedEntity> replicated = dynamic_pointer_cast<ReplicatedEntity>(e);
+                if (notNull(replicated)) replicated->poseAt(t);
+            }
+    };
+}
@@ -15,11 +15,58 @@ namespace DistributedRenderer {
 	OSWindow* os_window = nullptr;
 	RenderDevice* render_device = nullptr;
 
+	// Point the GL driver's own program binary cache at a directory that survives restarts,
+	// so a remote only compiles G3D's shaders the first time it runs on a machine. This has
+	// to happen before the context is created. G3D doesn't expose its compiled programs, so
+	// the driver cache (NVIDIA and Mesa both honor these) stands in for glProgramBinary
+	static void enableShaderCache() {
+		const String& dir = FilePath::concat(FileSystem::currentDirectory(), Constants::SHADER_CACHE_DIR);
+		if (!FileSystem::exists(dir)) FileSystem::createDirectory(dir);
+
+#ifdef G3D_WINDOWS
+		_putenv_s("__GL_SHADER_DISK_CACHE", "1");
+		_putenv_s("__GL_SHADER_DISK_CACHE_SKIP_CLEANUP", "1");
+		_putenv_s("__GL_SHADER_DISK_CACHE_PATH", dir.c_str());
+#else
+		setenv("__GL_SHADER_DISK_CACHE", "1", 0);
+		setenv("__GL_SHADER_DISK_CACHE_SKIP_CLEANUP", "1", 0);
+		setenv("__GL_SHADER_DISK_CACHE_PATH", dir.c_str(), 0);
+		setenv("MESA_SHADER_CACHE_DIR", dir.c_str(), 0);
+#endif
+	}
+
 	static void createRenderDevice(const GApp::Settings& settings) {
+		enableShaderCache();
 		render_device = RenderDeviceDist::create(settings);
 		os_window = render_device->window();
 	}
 
+	// A headless remote only renders into its own framebuffers and reads them back, so its window
+	// is never shown, never swapped and never waits for vsync, and it skips the developer GUI.
+	// G3D's only context is a GLFW window, so a hidden one stands in for an offscreen context.
+	// A CPU backend remote never draws with GL, so it only gets a tiny hidden window. It is
+	// not GL-free though: GApp, the scene and its assets all need a context, so a node without
+	// a GPU still needs a software GL (e.g. Mesa llvmpipe) and a display for the window
+	static GApp::Settings getConstructorSettings(const GApp::Settings& settings, NodeType type) {
+		GApp::Settings s = settings;
+
+		if (type == NodeType::REMOTE && Constants::HEADLESS_REMOTES) {
+			s.window.visible = false;
+			s.window.framed = false;
+			s.window.resizable = false;
+			s.window.asynchronous = true;
+			s.useDeveloperTools = false;
+		}
+
+		if (type == NodeType::REMOTE && Constants::REMOTE_BACKEND == CPU_BACKEND) {
+			s.window.width = 64;
+			s.window.height = 64;
+			s.window.visible = false;
+		}
+
+		return s;
+	}
+
 	static OSWindow* getConstructorOSWindow(const GApp::Settings& settings, NodeType type) {
 
 		if (notNull(os_window)) {
@@ -54,18 +101,28 @@ namespace DistributedRenderer {
 
 	}
 
+	RApp::RApp(const GApp::Settings& settings, NodeType type) : RApp(type, getConstructorSettings(settings, type)) {}
+
 	//OSWindow::create(settings.window)
-	RApp::RApp(const GApp::Settings& settings, NodeType type) : 
-		GApp(settings, getConstructorOSWindow(settings,type), getConstructorRenderDevice(settings,type), true), 
+	RApp::RApp(NodeType type, const GApp::Settings& adjusted) : 
+		GApp(adjusted, getConstructorOSWindow(adjusted, type), getConstructorRenderDevice(adjusted, type), true), 
 		r_lastWaitTime(System::time()) 
 	{
+		FramePool::instance().setHugePages(Constants::USE_HUGE_PAGES);
+
 		// create node
 		if (type == NodeType::CLIENT) network_node = new Client(this);
-		else network_node = new Remote(this, true);
+		else network_node = new Remote(this, Constants::HEADLESS_REMOTES);
+
+		// nothing a headless remote draws is ever presented
+		if (network_node->isHeadless()) renderDevice->setSwapBuffersAutomatically(false);
 	}
 
 	void DistributedRenderer::RApp::onInit(){
 		GApp::onInit();
+
+		// keep screen-space motion in the G-buffer even with motion blur off, the motion codec predicts along it
+		m_gbufferSpecification.encoding[GBuffer::Field::SS_POSITION_CHANGE] = ImageFormat::RG16F();
 	}
 
 	int RApp::run() {
@@ -141,6 +198,11 @@ namespace DistributedRenderer {
 				network_node->trackEntities(entities);
 			}
 
+			// remotes render a warm-up frame during CONFIG, so the target has to exist first
+			if (network_node->isTypeOf(NodeType::REMOTE)) {
+				m_finalFrameBuffer = FramebufferDist::create(TextureDist::createEmpty("RApp::m_finalFramebuffer[0]", renderDevice->width(), renderDevice->height(), ImageFormat::RGB8(), Texture::DIM_2D));
+			}
+
 			// initialize the connection and wait for the ready
 			network_node->init_connection(Constants::ROUTER_ADDR);
 
@@ -155,7 +217,6 @@ namespace DistributedRenderer {
 				Remote* remote = (Remote*) network_node;
 				// set the clipping
 				//renderDevice->setClipping(remote->getClip());
-				m_finalFrameBuffer = FramebufferDist::create(TextureDist::createEmpty("RApp::m_finalFramebuffer[0]", renderDevice->width(), renderDevice->height(), ImageFormat::RGB8(), Texture::DIM_2D));
 
 				// Busy wait for a message and let receive trigger a render
 				do {
@@ -170,13 +231,25 @@ namespace DistributedRenderer {
 	// Similar to oneFrame, this method will call onPose nad onGraphics but will not listen for any
 	// user input or do any logic or simulation. Only called by a remote node when it receives network updates
 	void RApp::oneFrameAdHoc() {
+		poseAdHoc();
+		graphicsAdHoc();
+	}
 
+	// The pose half of oneFrameAdHoc. The surfaces stay posed until the next call, so a remote
+	// poses the scene once and draws it from every camera of a batch
+	void RApp::poseAdHoc() {
 		// Pose
 		BEGIN_PROFILER_EVENT("Pose");
 		m_poseWatch.tick(); {
+			FrameTrace::Span span("pose");
 			m_posed3D.fastClear();
 			m_posed2D.fastClear();
+
+			// entities no view will see are hidden for the pose only
+			Array<shared_ptr<VisibleEntity>> hidden;
+			cullBeforePose(hidden);
 			onPose(m_posed3D, m_posed2D);
+			rememberReach(hidden);
 
 			// The debug camera is not in the scene, so we have
 			// to explicitly pose it. This actually does nothing, but
@@ -184,10 +257,69 @@ namespace DistributedRenderer {
 			m_debugCamera->onPose(m_posed3D);
 		} m_poseWatch.tock();
 		END_PROFILER_EVENT();
+	}
+
+	// @pre: the regions of the views the pose is for, set by the remote, empty for all of the screen
+	// @post: hidden holds the visible entities outside every region, hidden for the pose. Nothing is
+	// hidden if a light casts shadows, or that has not been posed before
+	void RApp::cullBeforePose(Array<shared_ptr<VisibleEntity>>& hidden) {
+		m_cullStats = RegionCull::stats_t();
+		if (isNull(scene())) return;
+
+		bool shadows = false;
+		const Array<shared_ptr<Light>>& lights = scene()->lightingEnvironment().lightArray;
+		for (int i = 0; i < lights.size(); i++) shadows = shadows || (lights[i]->enabled() && lights[i]->castsShadows());
+		const bool cull = Constants::REGION_CULLING && m_cullRegions.size() > 0 && !shadows;
+
+		Array<shared_ptr<VisibleEntity>> entities;
+		scene()->getTypedEntityArray<VisibleEntity>(entities);
+		for (int i = 0; i < entities.size(); i++) {
+			const shared_ptr<VisibleEntity>& e = entities[i];
+			if (!e->visible()) continue;
+			++m_cullStats.entities;
+			if (!cull) continue;
+
+			// a sphere about the origin through the farthest of its last bounds, right whatever it did since
+			map<shared_ptr<Entity>, float>::const_iterator it = m_poseReach.find(e);
+			if (it != m_poseReach.end() && !RegionCull::intersectsAny(m_cullRegions, Sphere(e->frame().translation, it->second))) {
+				e->setVisible(false);
+				hidden.append(e);
+			}
+		}
+		m_cullStats.entities_culled = hidden.size();
+	}
+
+	// @pre: the scene just posed, hidden the entities cullBeforePose hid for it
+	// @post: they are visible again, and how far every entity reaches from its origin is remembered
+	// for the next pose, from its bounds now if it was posed. Only entities still in the scene are kept
+	void RApp::rememberReach(const Array<shared_ptr<VisibleEntity>>& hidden) {
+		map<shared_ptr<Entity>, float> reach;
+		for (int i = 0; i < hidden.size(); i++) {
+			hidden[i]->setVisible(true);
+			reach[hidden[i]] = m_poseReach[hidden[i]];
+		}
+		if (!Constants::REGION_CULLING || isNull(scene())) return;
+
+		Array<shared_ptr<VisibleEntity>> entities;
+		scene()->getTypedEntityArray<VisibleEntity>(entities);
+		for (int i = 0; i < entities.size(); i++) {
+			const shared_ptr<VisibleEntity>& e = entities[i];
+			if (!e->visible() || reach.find(e) != reach.end()) continue;
+
+			Sphere bounds;
+			e->getLastBounds(bounds);
+			reach[e] = (bounds.center - e->frame().translation).length() + bounds.radius;
+		}
+		m_poseReach = reach;
+	}
+
+	// The graphics half of oneFrameAdHoc, draws what poseAdHoc posed from the active camera
+	void RApp::graphicsAdHoc() {
+		const bool headless = network_node->isHeadless();
 
 		// Graphics
 		debugAssertGLOk();
-		if ((submitToDisplayMode() == SubmitToDisplayMode::BALANCE) && (!renderDevice->swapBuffersAutomatically())) {
+		if (!headless && (submitToDisplayMode() == SubmitToDisplayMode::BALANCE) && (!renderDevice->swapBuffersAutomatically())) {
 			swapBuffers();
 		}
 
@@ -195,6 +327,7 @@ namespace DistributedRenderer {
 		renderDevice->beginFrame();
 		// m_widgetManager->onBeforeGraphics();
 		m_graphicsWatch.tick(); {
+			FrameTrace::Span span("graphics");
 			debugAssertGLOk();
 			renderDevice->pushState(); {
 				debugAssertGLOk();
@@ -202,7 +335,7 @@ namespace DistributedRenderer {
 			} renderDevice->popState();
 		}  m_graphicsWatch.tock();
 		renderDevice->endFrame();
-		if ((submitToDisplayMode() == SubmitToDisplayMode::MINIMIZE_LATENCY) && (!renderDevice->swapBuffersAutomatically())) {
+		if (!headless && (submitToDisplayMode() == SubmitToDisplayMode::MINIMIZE_LATENCY) && (!renderDevice->swapBuffersAutomatically())) {
 			swapBuffers();
 		}
 		END_PROFILER_EVENT();
@@ -224,9 +357,6 @@ namespace DistributedRenderer {
 
 		debugText.fastClear();
 
-		m_posed3D.fastClear();
-		m_posed2D.fastClear();
-
 		if (m_endProgram && window()->requiresMainLoop()) {
 			window()->popLoopBody();
 		}
@@ -269,6 +399,8 @@ namespace DistributedRenderer {
 			m_simulationWatch.tick();
 			//BEGIN_PROFILER_EVENT("Simulation");
 			{
+				// spans the batch the update about to go out will carry
+				FrameTrace::Span span("simulation", ((Client*)network_node)->nextBatchId());
 				RealTime rdt = timeStep;
 
 				SimTime sdt = simStepDuration();
@@ -304,14 +436,52 @@ namespace DistributedRenderer {
 		bool update_sent = client->sendUpdate();
 		bool frame_arrived = false;
 
-		if(update_sent)
-			while (!frame_arrived) frame_arrived = client->checkNetwork();
+		// a frame is waited for only once the pipeline is full, until then the next
+		// update goes out and whatever frame is in is drawn
+		if (update_sent || client->framesInFlight() > 0) {
+			do frame_arrived = client->checkNetwork(); while (!frame_arrived && client->pipelineFull());
+		}
+
+		// if there was no update sent, or the frame for it is still on its way, just draw the previous frame
+		if (frame_arrived || !update_sent || client->framesInFlight() > 0) {
+			FrameTrace::Span span("present");
 
-		// if there was no update sent, just draw the previous frame
-		if (frame_arrived || !update_sent) {
 			// display network frame by writing net buffer into native window buffer
 			renderDevice->push2D(); {
-				Draw::rect2D(finalFrameBuffer()->texture(0)->rect2DBounds(), renderDevice, Color3::white(), finalFrameBuffer()->texture(0));
+				// the only flip in the pipeline, done by the texture coordinates. Frames below
+				// full resolution are stretched over their part of the window and sharpened on the way
+				const float w = (float)renderDevice->width();
+				const float h = (float)renderDevice->height();
+				const Rect2D screen = Rect2D::xywh(0, 0, w, h);
+				if (notNull(m_finalFramePlanes[0])) {
+					// YUV420 planes, converted to RGB by the pixel shader as they are drawn
+					Args args;
+					args.setUniform("yPlane", m_finalFramePlanes[0], Sampler::video());
+					args.setUniform("cbPlane", m_finalFramePlanes[1], Sampler::video());
+					args.setUniform("crPlane", m_finalFramePlanes[2], Sampler::video());
+					args.setUniform("rectMin", Vector2(screen.x0(), renderDevice->height() - screen.y1()));
+					args.setUniform("rectSize", screen.wh());
+					args.setUniform("invertY", m_finalFrameBottomUp);
+					args.setUniform("sharpness", m_finalFrameSharpness);
+					args.setRect(screen);
+					LAUNCH_SHADER("YUVToRGB.pix", args);
+				} else if (m_finalFrameRegionTextures.size() == 0) {
+					drawFinalFrameTexture(MultiView::screenRect(Constants::VIEW_LAYOUT, 0, w, h, Constants::MINIMAP_FRACTION), finalFrameBuffer()->texture(0));
+				} else {
+					// foveated, reduced regions are upscaled by the bilinear sampler on the way to the screen
+					const float sx = renderDevice->width() / (float)Constants::SCREEN_WIDTH;
+					const float sy = renderDevice->height() / (float)Constants::SCREEN_HEIGHT;
+					for (int i = 0; i < m_finalFrameRegions.size(); i++) {
+						const Foveation::region_t& r = m_finalFrameRegions[i];
+						const Rect2D rect = Rect2D::xywh(0, r.screen_y * sy, Constants::SCREEN_WIDTH * sx, r.screen_h * sy);
+						drawFinalFrameTexture(rect, m_finalFrameRegionTextures[i]);
+					}
+				}
+
+				// the other views of the layout, over the first
+				for (int v = 0; v < m_finalFrameViews.size(); v++) {
+					drawFinalFrameTexture(MultiView::screenRect(Constants::VIEW_LAYOUT, v + 1, w, h, Constants::MINIMAP_FRACTION), m_finalFrameViews[v]);
+				}
 			} renderDevice->pop2D();
 			
 			//if (!renderDevice->swapBuffersAutomatically()) {
@@ -451,14 +621,24 @@ namespace DistributedRenderer {
 
 	void RApp::onGraphics3D(RenderDevice* rd, Array<shared_ptr<Surface> >& allSurfaces) {
 
+		// below full resolution the G-buffer is shaded smaller, and a remote's film pass writes it out at
+		// that size for the readback instead of scaling it back up to the window's
+		Vector2int32 deviceSize(m_deviceFramebuffer->vector2Bounds());
+		if (m_renderScale < ResolutionController::MAX_SCALE) {
+			deviceSize = Vector2int32((int)Foveation::atPercent((uint32)deviceSize.x, m_renderScale), (int)Foveation::atPercent((uint32)deviceSize.y, m_renderScale));
+		}
+
 		//Gate to only bind frame buffer if it is a remote node
 		if (network_node->isTypeOf(NodeType::REMOTE)) {
-			rd->pushState(m_finalFrameBuffer);
-			rd->setClip2D(((Remote*)network_node)->getClip());
+			if (m_renderScale < ResolutionController::MAX_SCALE && (isNull(m_scaledFrameBuffer) || m_scaledFrameBuffer->width() != deviceSize.x || m_scaledFrameBuffer->height() != deviceSize.y)) {
+				m_scaledFrameBuffer = FramebufferDist::create(TextureDist::createEmpty("RApp::m_scaledFramebuffer[0]", deviceSize.x, deviceSize.y, ImageFormat::RGB8(), Texture::DIM_2D));
+			}
+			rd->pushState(renderedFrameBuffer());
+			rd->setClip2D(((Remote*)network_node)->getRenderedClip());
 		}
 
 	    if (!scene()) {
-	        if ((submitToDisplayMode() == SubmitToDisplayMode::MAXIMIZE_THROUGHPUT) && (! rd->swapBuffersAutomatically())) {
+	        if (!network_node->isHeadless() && (submitToDisplayMode() == SubmitToDisplayMode::MAXIMIZE_THROUGHPUT) && (! rd->swapBuffersAutomatically())) {
 	            swapBuffers();
 	        }
 	        rd->clear();
@@ -474,13 +654,42 @@ namespace DistributedRenderer {
 	    extendGBufferSpecification(gbufferSpec);
 	    m_gbuffer->setSpecification(gbufferSpec);
 
-	    const Vector2int32 framebufferSize = m_settings.hdrFramebuffer.hdrFramebufferSizeFromDeviceSize(Vector2int32(m_deviceFramebuffer->vector2Bounds()));
+	    const Vector2int32 framebufferSize = m_settings.hdrFramebuffer.hdrFramebufferSizeFromDeviceSize(deviceSize);
 	    m_framebuffer->resize(framebufferSize);
 	    m_gbuffer->resize(framebufferSize);
 	    m_gbuffer->prepare(rd, activeCamera(), 0, -(float)previousSimTimeStep(), m_settings.hdrFramebuffer.depthGuardBandThickness, m_settings.hdrFramebuffer.colorGuardBandThickness);
 
+	    // a remote only shades its rect, surfaces outside the frustum behind it are left out of shading, and
+	    // sort-last only shades the entities it owns. The shadow maps are drawn from everything posed first,
+	    // a caster outside or someone else's still shadows ours, and the renderer then finds them current
+	    Array<shared_ptr<Surface>>* shaded = &allSurfaces;
+	    Array<shared_ptr<Surface>> inRegion;
+	    Array<shared_ptr<Surface>> owned;
+	    const bool remote = network_node->isTypeOf(NodeType::REMOTE);
+	    const bool partitioned = remote && Constants::RENDER_MODE == SORT_LAST;
+	    if (remote && (Constants::REGION_CULLING || partitioned)) {
+	        Light::renderShadowMaps(rd, scene()->lightingEnvironment().lightArray, allSurfaces);
+	    }
+	    if (Constants::REGION_CULLING && remote) {
+	        const float w = (float)Constants::SCREEN_WIDTH;
+	        const float h = (float)Constants::SCREEN_HEIGHT;
+	        RegionCull::frustum_t region;
+	        RegionCull::fromView(activeCamera()->frame(), RegionCull::tanHalfFovY(activeCamera(), w, h), activeCamera()->nearPlaneZ(),
+	            ((Remote*)network_node)->getClip(), w, h, Constants::REGION_CULL_MARGIN, region);
+	        m_cullStats.surfaces += allSurfaces.size();
+	        m_cullStats.surfaces_culled += RegionCull::cull(region, allSurfaces, inRegion);
+	        shaded = &inRegion;
+	    }
+	    if (partitioned) {
+	        const Remote* node = (const Remote*)network_node;
+	        for (int i = 0; i < shaded->size(); i++) {
+	            if (node->shades((*shaded)[i]->entity())) owned.append((*shaded)[i]);
+	        }
+	        shaded = &owned;
+	    }
+
 	    m_renderer->render(rd, activeCamera(), m_framebuffer, scene()->lightingEnvironment().ambientOcclusionSettings.enabled ? m_depthPeelFramebuffer : nullptr, 
-	        scene()->lightingEnvironment(), m_gbuffer, allSurfaces);
+	        scene()->lightingEnvironment(), m_gbuffer, *shaded);
 
 	    // Debug visualizations and post-process effects
 		rd->pushState(m_framebuffer); {
@@ -496,8 +705,8 @@ namespace DistributedRenderer {
 
 	    // We're about to render to the actual back buffer, so swap the buffers now.
 	    // This call also allows the screenshot and video recording to capture the
-	    // previous frame just before it is displayed.
-	    if (submitToDisplayMode() == SubmitToDisplayMode::MAXIMIZE_THROUGHPUT) {
+	    // previous frame just before it is displayed. A headless remote has no back buffer to show
+	    if (!network_node->isHeadless() && submitToDisplayMode() == SubmitToDisplayMode::MAXIMIZE_THROUGHPUT) {
 	        swapBuffers();
 	    }
 
@@ -519,7 +728,25 @@ namespace DistributedRenderer {
 
 	}
 
+	// @post: texture is drawn over rect, sharpened by Upscale.pix if the frame is below full resolution
+	void RApp::drawFinalFrameTexture(const Rect2D& rect, const shared_ptr<Texture>& texture) {
+		if (m_finalFrameSharpness <= 0.0f) {
+			Draw::rect2D(rect, renderDevice, Color3::white(), texture, Sampler::video(), m_finalFrameBottomUp);
+			return;
+		}
+
+		Args args;
+		args.setUniform("source", texture, Sampler::video());
+		args.setUniform("rectMin", Vector2(rect.x0(), renderDevice->height() - rect.y1()));
+		args.setUniform("rectSize", rect.wh());
+		args.setUniform("invertY", m_finalFrameBottomUp);
+		args.setUniform("sharpness", m_finalFrameSharpness);
+		args.setRect(rect);
+		LAUNCH_SHADER("Upscale.pix", args);
+	}
+
 	void RApp::onCleanup(){
+		FrameTrace::instance().close();
 	}
 
 	void RApp::endProgram(){
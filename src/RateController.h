@@ -0,0 +1,92 @@
+#pragma once
+#include <G3D/G3D.h>
+
+/* =========================================
+ *             Rate Controller
+ * =========================================
+ *
+ * Picks the encoder quality for one link, frame by frame. Every frame that
+ * makes it across gives one sample: its size, when it was sent on the
+ * sender's clock, when it arrived on the receiver's clock and the round
+ * trip time with the far end's processing taken out. Only differences of
+ * times from the same clock are used, so the two clocks never have to agree.
+ *
+ * From the samples the controller keeps smoothed estimates of
+ *   - the rate the stream is sent at (frame size over time between sends),
+ *   - the rate it is delivered at (frame size over time between arrivals),
+ *   - the round trip time.
+ *
+ * Quality backs off multiplicatively when the round trip blows the latency
+ * budget, when frames arrive slower than they are sent (they are queueing
+ * in the NetConnection) or when the stream runs over the target bitrate,
+ * and creeps back up additively once there is headroom on all three.
+ */
+
+namespace DistributedRenderer {
+
+    class RateController {
+        public:
+            static const int MIN_QUALITY = 30;
+            static const int MAX_QUALITY = 100;
+
+        private:
+            double target_bps;
+            double budget_ms;
+
+            float quality = (float)MAX_QUALITY;
+
+            double srtt_ms = 0;
+            double send_bps = 0;
+            double delivery_bps = 0;
+
+            bool has_sample = false;
+            uint32 last_sent_ms = 0;
+            uint32 last_delivered_ms = 0;
+
+            // weight of a new sample in the smoothed estimates
+            static double smooth(double average, double sample) { return average + 0.125 * (sample - average); }
+
+            void adapt() {
+                const bool late = srtt_ms > budget_ms;
+                const bool queueing = delivery_bps > 0 && send_bps > delivery_bps * 1.1;
+                const bool over = send_bps > target_bps;
+
+                if (late || queueing || over) {
+                    quality = G3D::max((float)MIN_QUALITY, quality * 0.85f);
+                } else if (srtt_ms < budget_ms * 0.75 && send_bps < target_bps * 0.8) {
+                    quality = G3D::min((float)MAX_QUALITY, quality + 2.0f);
+                }
+            }
+
+        public:
+            RateController(double target_mbps = 1000.0, double latency_budget_ms = 33.0) :
+                target_bps(target_mbps * 1e6), budget_ms(latency_budget_ms) {}
+
+            // @pre: one frame that arrived, sent_ms on the sender's clock, delivered_ms on the receiver's
+            // @post: the estimates and the quality for the next frame are updated
+            void onDelivered(uint32 bytes, uint32 sent_ms, uint32 delivered_ms, float rtt_ms) {
+                if (has_sample) {
+                    const uint32 send_gap = sent_ms - last_sent_ms;
+                    const uint32 delivery_gap = delivered_ms - last_delivered_ms;
+
+                    if (send_gap > 0) send_bps = smooth(send_bps, bytes * 8000.0 / send_gap);
+                    if (delivery_gap > 0) delivery_bps = smooth(delivery_bps, bytes * 8000.0 / delivery_gap);
+                    srtt_ms = smooth(srtt_ms, G3D::max(rtt_ms, 0.0f));
+                } else {
+                    srtt_ms = G3D::max(rtt_ms, 0.0f);
+                }
+
+                last_sent_ms = sent_ms;
+                last_delivered_ms = delivered_ms;
+                has_sample = true;
+
+                adapt();
+            }
+
+            uint8 getQuality() const { return (uint8)iRound(quality); }
+
+            double rttMs() const { return srtt_ms; }
+            double sendMbps() const { return send_bps / 1e6; }
+            double deliveryMbps() const { return delivery_bps / 1e6; }
+    };
+}
@@ -0,0 +1,110 @@
+#pragma once
+#include <G3D/G3D.h>
+
+/* =========================================
+ *               Region Culling
+ * =========================================
+ *
+ * A remote only shades its clip rect, the rest of the camera's frustum is
+ * wasted submission and vertex work. The part of the frustum behind a rect
+ * of the screen is a frustum of its own, the camera's near plane and four
+ * sides through the rect's edges, and a remote culls against that:
+ *
+ *   before posing   entities outside the region of every view about to be
+ *                   rendered are hidden for the pose, their bounds from the
+ *                   last pose they had, grown to cover any turn since.
+ *                   Only when no light casts shadows, a caster off the
+ *                   region can still shadow it and has to be in the shadow maps
+ *   before shading  surfaces outside the current view's region are left out
+ *                   of the G-buffer and forward passes. Shadow maps are drawn
+ *                   from everything posed first, so they are the same as without
+ *
+ * Both are conservative, bounding spheres against planes, and the region is
+ * widened by REGION_CULL_MARGIN rows for the guard band.
+ */
+
+namespace DistributedRenderer {
+
+    class RegionCull {
+        public:
+            // inside is n.x + d >= 0 for every plane, the near plane and the four sides, no far plane
+            typedef struct {
+                Vector3 normal[5];
+                float d[5];
+            } frustum_t;
+
+            typedef struct {
+                uint32 entities;         // visible entities at the last pose
+                uint32 entities_culled;  // of those, hidden for it
+                uint32 surfaces;         // posed surfaces, summed over the views rendered
+                uint32 surfaces_culled;  // of those, left out of shading
+            } stats_t;
+
+            // @return: the tangent of half the vertical field of view, whichever way the camera measures it
+            static float tanHalfFovY(float fov, FOVDirection direction, float width, float height) {
+                const float t = tanf(fov * 0.5f);
+                return (direction == FOVDirection::HORIZONTAL) ? t * height / width : t;
+            }
+
+            static float tanHalfFovY(const shared_ptr<Camera>& camera, float width, float height) {
+                return tanHalfFovY(camera->fieldOfViewAngle(), camera->fieldOfViewDirection(), width, height);
+            }
+
+            // @post: f is the part of the view's frustum behind rect, a rect of a width by height screen
+            // widened by margin rows each way, rows from the top
+            static void fromView(const CoordinateFrame& view, float tan_half_fov_y, float near_z, const Rect2D& rect, float width, float height, float margin, frustum_t& f) {
+                const float tan_half_fov_x = tan_half_fov_y * width / height;
+
+                // the rect's edges at unit depth in camera space, y up
+                const float left = (rect.x0() / width * 2.0f - 1.0f) * tan_half_fov_x;
+                const float right = (rect.x1() / width * 2.0f - 1.0f) * tan_half_fov_x;
+                const float top = (1.0f - G3D::max(rect.y0() - margin, 0.0f) / height * 2.0f) * tan_half_fov_y;
+                const float bottom = (1.0f - G3D::min(rect.y1() + margin, height) / height * 2.0f) * tan_half_fov_y;
+
+                // inward normals in camera space, every side plane through the eye
+                Vector3 n[5];
+                n[0] = Vector3(0, 0, -1);
+                n[1] = Vector3(1, 0, left).direction();
+                n[2] = Vector3(-1, 0, -right).direction();
+                n[3] = Vector3(0, -1, -top).direction();
+                n[4] = Vector3(0, 1, bottom).direction();
+
+                for (int i = 0; i < 5; i++) {
+                    f.normal[i] = view.vectorToWorldSpace(n[i]);
+                    f.d[i] = -f.normal[i].dot(view.translation);
+                }
+                // the near plane is near_z in front of the eye, near_z negative as G3D has it
+                f.d[0] += near_z;
+            }
+
+            // @return: false only if the sphere is wholly outside the frustum
+            static bool intersects(const frustum_t& f, const Sphere& s) {
+                if (!isFinite(s.radius)) return true;
+                for (int i = 0; i < 5; i++) {
+                    if (f.normal[i].dot(s.center) + f.d[i] < -s.radius) return false;
+                }
+                return true;
+            }
+
+            static bool intersectsAny(const Array<frustum_t>& frusta, const Sphere& s) {
+                for (int i = 0; i < frusta.size(); i++) {
+                    if (intersects(frusta[i], s)) return true;
+                }
+                return false;
+            }
+
+            // @post: out holds the surfaces that can be inside the frustum
+            // @return: how many were left out
+            static uint32 cull(const frustum_t& f, const Array<shared_ptr<Surface>>& surfaces, Array<shared_ptr<Surface>>& out) {
+                out.fastClear();
+                for (int i = 0; i < surfaces.size(); i++) {
+                    CoordinateFrame cframe;
+                    Sphere bounds;
+                    surfaces[i]->getCoordinateFrame(cframe);
+                    surfaces[i]->getObjectSpaceBoundingSphere(bounds);
+                    if (intersects(f, cframe.toWorldSpace(bounds))) out.append(surfaces[i]);
+                }
+                return (uint32)(surfaces.size() - out.size());
+            }
+    };
+}
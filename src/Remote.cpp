@@ -1,18 +1,25 @@
 #include "DistributedRenderer.h"
 #include "FramebufferDist.h"
+#include "SceneSnapshot.h"
 
 using namespace DistributedRenderer;
 
 namespace DistributedRenderer{
 
-    Remote::Remote(RApp* app, bool headless_mode) : NetworkNode(NodeType::REMOTE, app, headless_mode) {}
+    Remote::Remote(RApp* app, bool headless_mode) : NetworkNode(NodeType::REMOTE, app, headless_mode) {
+        FrameTrace::instance().open(Constants::TRACE_DIR, "remote");
+    }
 
     void Remote::onConnect() {
 
 		cout << "Connected to router" << endl;
 
-        // send router intoduction
-        send(PacketType::HI_AM_REMOTE);
+        // every session starts from the scene as it was loaded
+        loaded_states.resize(entity_table.loadedCount());
+        for (int i = 0; i < entity_table.loadedCount(); i++) PropertyReplication::capture(entity_table.at(i), loaded_states[i]);
+
+        // send router intoduction, along with the codecs we can encode
+        send(PacketType::HI_AM_REMOTE, *BinaryUtils::empty(), *BinaryUtils::codecs());
 
 		cout << "Awaiting configuration" << endl;
 
@@ -25,9 +32,13 @@ namespace DistributedRenderer{
                 switch(iter.type()){
                     case PacketType::CONFIG:
                         cout << "Received CONFIG, configuring..." << endl;
-                        setClip(&iter.binaryInput());
+                        configure(&iter.binaryInput());
+                        if (notNull(the_app)) warmUp();
                         send(PacketType::CONFIG_RECEIPT);
                         break;
+                    case PacketType::SNAPSHOT: // joining a running network
+                        loadSnapshot(iter.headerBinaryInput(), iter.binaryInput());
+                        break;
                     case PacketType::READY:
 						cout << "Network is ready" << endl;
                         ready = true;
@@ -44,6 +55,39 @@ namespace DistributedRenderer{
         }
     }
 
+    // @pre: a CONFIG packet, on connecting or whenever the router lays the remotes out again
+    // @post: our strip, share of the entities, codec and scale are the router's, and every
+    // session's streams start over from a keyframe
+    void Remote::configure(BinaryInput* bi) {
+        setClip(bi);
+        setPartition(bi);
+        setCodec(bi);
+        setScale(bi);
+
+        for (map<uint8, session_t>::iterator it = sessions.begin(); it != sessions.end(); it++) {
+            for (int v = 0; v < it->second.codecs.size(); v++) it->second.codecs[v] = FrameCodec::create(codec_id, Constants::KEYFRAME_INTERVAL);
+        }
+        if (notNull(session)) {
+            codec = session->codecs[0];
+            showEntities();
+        }
+    }
+
+    // @pre: a SNAPSHOT packet, a session's entities as the router last sent them on
+    // @post: the session's scene is caught up, spawns included, as if we had had every UPDATE
+    void Remote::loadSnapshot(BinaryInput& header, BinaryInput& body) {
+        const uint8 id = header.readUInt8();
+        setSession(id);
+
+        BinaryOutput* records = BinaryUtils::create();
+        SceneSnapshot::toRecords(body, *records);
+        BinaryInput in(records->getCArray(), records->length(), G3D_LITTLE_ENDIAN, false, false);
+        sync(&in);
+
+        cout << "Caught up with session " << (int)id << " from a " << body.getLength() << " byte snapshot" << endl;
+        delete records;
+    }
+
     void Remote::setClip(uint32 y, uint32 height){
         bounds = Rect2D::xywh(0, y, Constants::SCREEN_WIDTH, height);
     }
@@ -57,24 +101,162 @@ namespace DistributedRenderer{
 		setClip(y, h);
 	}
 
+    // @pre: the rest of a CONFIG packet, the render mode and our place among the remotes
+    // @post: when sort-last, only the visible entities whose names hash to our place are drawn here,
+    // the same split on every remote whatever order it loaded the scene in
+    void Remote::setPartition(BinaryInput* bi) {
+        mode = (RenderMode)bi->readUInt8();
+        partition_index = bi->readUInt32();
+        partition_count = G3D::max(bi->readUInt32(), (uint32)1);
+
+        if (mode != SORT_LAST) return;
+
+        // every entity stays posed so it still casts its shadows, only the ones we own are shaded
+        int owned = 0;
+        for (int i = 0; i < (int)visible_entities.size(); i++) {
+            if (owns(visible_entities[i]->name())) ++owned;
+        }
+
+        cout << "Sort-last partition " << partition_index << "/" << partition_count << ", shading " << owned << " of " << visible_entities.size() << " entities" << endl;
+    }
+
+    // @return: whether the entity with this name, as the client knows it, is shaded here
+    bool Remote::owns(const String& name) const {
+        return mode != SORT_LAST || EntityTable::stableHash(name) % partition_count == partition_index;
+    }
+
+    // @return: whether the surfaces of e go into our layer. Spawned entities are named for their
+    // session, "name#session", and owned by the name their client knows them by
+    bool Remote::shades(const shared_ptr<Entity>& e) const {
+        if (mode != SORT_LAST || isNull(e)) return true;
+
+        const String& name = e->name();
+        const size_t mark = name.rfind('#');
+        if (mark != String::npos && mark + 1 < name.size() && name.find_first_not_of("0123456789", mark + 1) == String::npos) {
+            return owns(name.substr(0, mark));
+        }
+        return owns(name);
+    }
+
+    // @pre: the rest of a CONFIG packet, the codec the router picked for us
+    // @post: fragments are encoded with a fresh instance of it, starting from a keyframe
+    void Remote::setCodec(BinaryInput* bi) {
+        codec_id = (CodecID)bi->readUInt8();
+
+        cout << "Encoding fragments as " << FrameCodec::name(codec_id) << endl;
+    }
+
+    // @pre: the rest of a CONFIG packet, the resolution divisor of our foveation tier
+    // @post: our strip is sent at 1 / scale resolution
+    void Remote::setScale(BinaryInput* bi) {
+        scale = G3D::max(bi->readUInt8(), (uint8)1);
+        if (scale > 1) cout << "Peripheral strip, rendering at 1/" << (int)scale << " resolution" << endl;
+    }
+
+    // @pre: the percent of full resolution the router wants this batch at
+    // @post: the strip is rendered and sent at it, a change starts the stream over from a keyframe
+    void Remote::setRenderScale(uint8 percent) {
+        percent = (uint8)iClamp(percent, 1, ResolutionController::MAX_SCALE);
+        if (percent == render_scale) return;
+
+        render_scale = percent;
+        session->render_scale = percent;
+        for (int v = 0; v < session->codecs.size(); v++) session->codecs[v]->reset();
+        the_app->setRenderScale(percent);
+
+#if(DEBUG)
+        cout << "Rendering at " << (int)percent << "% resolution" << endl;
+#endif
+    }
+
+    // @pre: the session the next UPDATE is for
+    // @post: the scene, codec and render scale are the session's. A session seen for the first
+    // time starts from the scene as loaded and a fresh codec, its first strip is a keyframe
+    void Remote::setSession(uint8 id) {
+        if (notNull(session) && session->id == id) return;
+
+        map<uint8, session_t>::iterator it = sessions.find(id);
+        if (it == sessions.end()) {
+            session_t s;
+            s.id = id;
+            for (int v = 0; v < MultiView::count(Constants::VIEW_LAYOUT); v++) s.codecs.append(FrameCodec::create(codec_id, Constants::KEYFRAME_INTERVAL));
+            s.render_scale = ResolutionController::MAX_SCALE;
+            s.states = loaded_states;
+            s.table = entity_table;
+            it = sessions.insert(make_pair(id, s)).first;
+        }
+
+        // only the properties that differ between the sessions are touched, and what
+        // one session spawned is hidden while another's batch is drawn
+        if (notNull(session)) showSpawned(session, false);
+        session = &it->second;
+        FrameTrace::instance().setSession(id);
+        PropertyReplication::state_t now = PropertyReplication::state_t();
+        for (int i = 0; i < entity_table.loadedCount() && i < session->states.size(); i++) {
+            const shared_ptr<Entity>& e = entity_table.at(i);
+            PropertyReplication::capture(e, now);
+            PropertyReplication::apply(e, session->states[i], PropertyReplication::changed(now, session->states[i]) & ~PropertyReplication::VISIBLE);
+        }
+        showEntities();
+
+        codec = session->codecs[0];
+        if (render_scale != session->render_scale) {
+            render_scale = session->render_scale;
+            the_app->setRenderScale(render_scale);
+        }
+
+#if(DEBUG)
+        cout << "Rendering for session " << (int)id << endl;
+#endif
+    }
+
     void Remote::receive() {
 
         NetMessageIterator& iter = connection->incomingMessageIterator();
         if(!iter.isValid()) return;
+        const int64 arrived_ns = ClockSync::localTimeNs();
         
         try{
             // read the header
             BinaryInput& header = iter.headerBinaryInput();
-            uint32 batch_id = header.readUInt32();
 
             switch(iter.type()){
-                case PacketType::UPDATE: // update data
+                case PacketType::UPDATE: { // update data
+                    uint32 batch_id = header.readUInt32();
+                    update_received_ms = current_time_ms();
 #if(DEBUG)
                     cout << "Received state update " << batch_id << " at " << current_time_ms() << endl;
 #endif
-                    sync(&iter.binaryInput());
-                    the_app->oneFrameAdHoc();
-                    sendFrame(batch_id);
+                    // the batch is one session's, the router's rate controller picks our quality for it
+                    setSession(header.readUInt8());
+                    quality = header.readUInt8();
+                    setRenderScale(header.readUInt8());
+                    {
+                        // every update is synced, only the views dealt to us are rendered
+                        const uint8 mask = header.readUInt8();
+
+                        // the router gave up on a layer of these views, their streams start over from a keyframe
+                        const uint8 restart = header.readUInt8();
+                        for (int v = 0; v < session->codecs.size(); v++) {
+                            if (restart & (1 << v)) session->codecs[v]->reset();
+                        }
+                        const SimTime sim_time = header.readFloat64();
+                        ClockSync::instance().onEcho(BinaryUtils::readClockEcho(header), arrived_ns);
+                        Array<MultiView::view_t> views;
+                        MultiView::read(header, views);
+                        FrameTrace::instance().setBatch(batch_id);
+                        sync(&iter.binaryInput());
+                        if (mask != 0) {
+                            pose(sim_time);
+                            render(batch_id, mask, views);
+                        }
+                    }
+                    break;
+                }
+
+                case PacketType::CONFIG: // the router laid the remotes out again, already warm
+                    cout << "Received CONFIG, reconfiguring..." << endl;
+                    configure(&iter.binaryInput());
                     break;
 
                 case PacketType::TERMINATE: // this is the end of all messages
@@ -97,42 +279,439 @@ namespace DistributedRenderer{
         
     }
 
-    // @pre: transform packet with list of transforms of entities to update
-    // @post: updates frame of corresponding entity with new position data
+    // @pre: the records of an UPDATE body, see UpdateRecord
+    // @post: the session's entities are spawned, despawned, moved and changed as the client did.
+    // Records for an entity that is already gone are dropped
 	void Remote::sync(BinaryInput* update) {
+        FrameTrace::Span span("sync");
 		
 #if (DEBUG)
         cout << "Syncing update..." << endl;
 #endif
         while(update->hasMore()){
-            uint32 id = update->readUInt32();
-            float x = update->readFloat32();
-            float y = update->readFloat32();
-            float z = update->readFloat32();
-            float yaw = update->readFloat32();
-            float pitch = update->readFloat32();
-            float roll = update->readFloat32();
+            const uint8 kind = update->readUInt8();
+            const EntityTable::NetID id = update->readUInt32();
+
+            switch (kind) {
+                case ENTITY_FRAME: {
+                    CoordinateFrame nextframe = BinaryUtils::readEntityFrame(*update);
+                    shared_ptr<Entity> ent = session->table.get(id);
+                    if (isNull(ent)) break;
+                    ent->setFrame(nextframe, true);
+
+                    const uint32 slot = EntityTable::slotOf(id);
+                    if (slot < (uint32)session->states.size()) session->states[slot].frame = nextframe;
+                    break;
+                }
+                case ENTITY_PROPERTIES: {
+                    // read whether or not the entity is still here, the records after it are
+                    PropertyReplication::state_t gone = PropertyReplication::state_t();
+                    shared_ptr<Entity> ent = session->table.get(id);
+                    const int slot = (int)EntityTable::slotOf(id);
+                    PropertyReplication::state_t& s = (notNull(ent) && slot < session->states.size()) ? session->states[slot] : gone;
+                    const PropertyReplication::mask_t changed = PropertyReplication::read(*update, s);
+                    if (isNull(ent)) break;
+
+                    PropertyReplication::apply(ent, s, changed & ~PropertyReplication::VISIBLE);
+                    if (changed & PropertyReplication::VISIBLE) {
+                        shared_ptr<VisibleEntity> visible = dynamic_pointer_cast<VisibleEntity>(ent);
+                        if (notNull(visible)) visible->setVisible(drawn(session, slot));
+                    }
+                    break;
+                }
+                case ENTITY_SPAWN: {
+                    const String name = update->readString();
+                    const String spec = update->readString();
+                    spawnEntity(id, name, spec, BinaryUtils::readEntityFrame(*update));
+                    break;
+                }
+                case ENTITY_DESPAWN:
+                    despawnEntity(id);
+                    break;
+                case ENTITY_FRAME_BLOCK:
+                    if (!transforms.read(*update, id)) return;
+                    applyFrames();
+                    break;
+                default:
+                    // records have no length, nothing after one we do not know can be read
+                    debugPrintf("Unknown update record %d\n", (int)kind);
+                    return;
+            }
+        }
+    }
 
-            CoordinateFrame nextframe = CoordinateFrame::fromXYZYPRRadians(x,y,z,yaw,pitch,roll);
-            getEntityByID(id)->setFrame(nextframe, true);
+    // @pre: transforms holds a frame block of the current session's
+    // @post: every entity of it that is still here is at its frame, set across cores when there are enough
+    void Remote::applyFrames() {
+        FrameTrace::Span span("apply");
+        transforms.toMatrices();
+
+        // every entity has a slot of its own, nothing is written twice
+        session_t* s = session;
+        const int n = (int)transforms.size();
+        runConcurrently(0, n, [&](int i) {
+            const EntityTable::NetID id = transforms.id(i);
+            const shared_ptr<Entity> ent = s->table.get(id);
+            if (isNull(ent)) return;
+
+            const CoordinateFrame frame = transforms.frame(i);
+            ent->setFrame(frame, true);
+            const uint32 slot = EntityTable::slotOf(id);
+            if (slot < (uint32)s->states.size()) s->states[slot].frame = frame;
+        }, (uint32)n < Constants::PARALLEL_APPLY_MIN);
+    }
 
+    // @post: every animated entity of the session is posed at the client's simulation time t, only where
+    // an animation starts is replicated, so this is what moves them along between its records
+    void Remote::pose(SimTime t) {
+        FrameTrace::Span span("animate");
+        for (int i = 0; i < session->table.size() && i < session->states.size(); i++) {
+            const shared_ptr<Entity>& ent = session->table.at(i);
+            if (notNull(ent)) PropertyReplication::pose(ent, session->states[i], t);
         }
     }
 
-    // @pre: the current batch id
-    // @post: renders a new frame and sends it in a frame packet back to the router
-    void Remote::sendFrame(uint32 batch_id){
+    // @pre: a spawn record of the current session's client
+    // @post: the entity is in the scene under a name of the session's, at the client's ID
+    void Remote::spawnEntity(EntityTable::NetID id, const String& name, const String& spec, const CoordinateFrame& frame) {
+        const uint32 slot = EntityTable::slotOf(id);
+        if (slot < (uint32)session->table.loadedCount()) return;
+
+        // a spawn into a live slot means the client reused it without us hearing it was freed
+        if (slot < (uint32)session->table.size() && notNull(session->table.at(slot))) {
+            the_app->scene()->removeEntity(session->table.at(slot)->name());
+        }
+
+        shared_ptr<Entity> ent;
+        try {
+            ent = the_app->scene()->createEntity(format("%s#%d", name.c_str(), (int)session->id), Any::parse(spec));
+        } catch (...) {
+            cout << "Could not spawn " << name << " for session " << (int)session->id << endl;
+            return;
+        }
+        if (isNull(ent)) return;
+
+        ent->setFrame(frame, true);
+        session->table.addAt(id, ent);
+
+        // as the spec made it, the client sends what changes after
+        if (session->states.size() <= (int)slot) session->states.resize(slot + 1);
+        PropertyReplication::capture(ent, session->states[slot]);
+
+        shared_ptr<VisibleEntity> visible = dynamic_pointer_cast<VisibleEntity>(ent);
+        if (notNull(visible)) visible->setVisible(drawn(session, (int)slot));
+
+#if(DEBUG)
+        cout << "Spawned " << ent->name() << endl;
+#endif
+    }
+
+    // @post: the current session's entity with this ID, if any, is out of the scene
+    void Remote::despawnEntity(EntityTable::NetID id) {
+        shared_ptr<Entity> ent = session->table.remove(id);
+        if (notNull(ent)) the_app->scene()->removeEntity(ent->name());
+    }
+
+    // @post: the entities the session spawned are posed, the ones its client shows, or hidden
+    void Remote::showSpawned(session_t* s, bool shown) {
+        for (int i = s->table.loadedCount(); i < s->table.size(); i++) {
+            shared_ptr<VisibleEntity> visible = dynamic_pointer_cast<VisibleEntity>(s->table.at(i));
+            if (notNull(visible)) visible->setVisible(shown && drawn(s, i));
+        }
+    }
+
+    // @post: every entity of the current session, loaded or spawned, is posed if its client shows it
+    void Remote::showEntities() {
+        for (int i = 0; i < session->table.size(); i++) {
+            shared_ptr<VisibleEntity> visible = dynamic_pointer_cast<VisibleEntity>(session->table.at(i));
+            if (notNull(visible)) visible->setVisible(drawn(session, i));
+        }
+    }
+
+    // @return: whether the entity at slot is posed here for the session, visible as its client
+    // last set it. Sort-last poses the ones we do not own too, for their shadows, see shades
+    bool Remote::drawn(session_t* s, int slot) const {
+        return slot >= s->states.size() || !(s->states[slot].has & PropertyReplication::VISIBLE) || s->states[slot].visible;
+    }
+
+    // @post: renders our strip with the configured backend, bottom_up set if the rows come bottom first
+    // @return: the pixels, with our strip at rect
+    shared_ptr<PixelTransferBuffer> Remote::renderStrip(Rect2D& rect, bool& bottom_up) {
+
+        // both backends hand back the top row first: the CPU renderer writes it that way and G3D
+        // renders into textures with invertY, so the readback already matches the screen
+        bottom_up = false;
+
+        if (Constants::REMOTE_BACKEND == CPU_BACKEND) {
+            // a reduced strip is rasterized at its reduced size on a screen reduced by as much
+            const int w = (int)Foveation::atPercent(Foveation::scaled((uint32)bounds.width(), scale), render_scale);
+            const int h = (int)Foveation::atPercent(Foveation::scaled((uint32)bounds.height(), scale), render_scale);
+            const Rect2D strip = Rect2D::xywh(0, (float)((uint32)bounds.y0() / scale * render_scale / 100), (float)w, (float)h);
+
+            if (isNull(cpu_strip) || cpu_strip->width() != w || cpu_strip->height() != h) {
+                cpu_strip = FramePool::instance().cpu(w, h);
+            }
+
+            FrameTrace::Span span("graphics");
+            cpu_renderer.render(the_app->scene(), the_app->activeCamera(), strip,
+                Foveation::atPercent(Foveation::scaled(Constants::SCREEN_WIDTH, scale), render_scale), Foveation::atPercent(Foveation::scaled(Constants::SCREEN_HEIGHT, scale), render_scale), cpu_strip,
+                [this](const shared_ptr<Entity>& e) { return shades(e); });
+            rect = Rect2D::xywh(0, 0, (float)w, (float)h);
+            return cpu_strip;
+        }
+
+        the_app->graphicsAdHoc();
+        rect = getRenderedClip();
+        FrameTrace::Span span("readback");
+
+        // read back into a pooled pack buffer instead of letting the texture allocate one. Below
+        // full resolution the film pass wrote the frame out at render_scale, nothing is resized here
+        const shared_ptr<Texture>& color = the_app->renderedFrameBuffer()->texture(0);
+        readback.reset();
+        readback = FramePool::instance().gl(color->width(), color->height(), ImageFormat::RGB8());
+        color->toPixelTransferBuffer(readback, ImageFormat::RGB8());
+        if (scale == 1) return readback;
+
+        // GApp sizes its framebuffers from the window, so a peripheral strip is rendered at the
+        // render scale's full size and reduced here, to the size the router placed it at
+        const uint8* pixels = (const uint8*)readback->mapRead();
+        const uint8* strip = pixels + readback->rowOffset((int)rect.y0());
+        const int w = (int)Foveation::atPercent(Foveation::scaled((uint32)bounds.width(), scale), render_scale);
+        const int h = (int)Foveation::atPercent(Foveation::scaled((uint32)bounds.height(), scale), render_scale);
+
+        scaled_strip.reset();
+        scaled_strip = FramePool::instance().cpu(w, h);
+        if (render_scale == ResolutionController::MAX_SCALE) {
+            Foveation::downsample(strip, readback->stride(), (int)rect.width(), (int)rect.height(), scale, (uint8*)scaled_strip->buffer(), scaled_strip->stride());
+        } else {
+            Foveation::resample(strip, readback->stride(), (int)rect.width(), (int)rect.height(), (uint8*)scaled_strip->buffer(), scaled_strip->stride(), w, h);
+        }
+        readback->unmap();
+
+        rect = Rect2D::xywh(0, 0, (float)w, (float)h);
+        return scaled_strip;
+    }
+
+    // @return: our strip in what the last frame was rendered into, the rows of bounds at render_scale
+    Rect2D Remote::getRenderedClip() const {
+        if (render_scale == ResolutionController::MAX_SCALE) return bounds;
+        return Rect2D::xywh(0, (float)((uint32)bounds.y0() * render_scale / 100),
+            (float)Foveation::atPercent((uint32)bounds.width(), render_scale), (float)Foveation::atPercent((uint32)bounds.height(), render_scale));
+    }
+
+    // @post: depth of the strip just rendered, stride floats per row, nearer is smaller
+    // @return: a pointer to the top left of the strip, valid until depth is unmapped
+    const float* Remote::renderDepth(shared_ptr<PixelTransferBuffer>& depth, size_t& stride) {
+
+        if (Constants::REMOTE_BACKEND == CPU_BACKEND) {
+            stride = (size_t)bounds.width();
+            return cpu_renderer.depthBuffer();
+        }
+
+        Vector2int32 offset;
+        const shared_ptr<Texture>& texture = the_app->depthTexture(offset);
+        depth_readback.reset();
+        depth_readback = FramePool::instance().gl(texture->width(), texture->height(), ImageFormat::DEPTH32F());
+        texture->toPixelTransferBuffer(depth_readback, ImageFormat::DEPTH32F());
+        depth = depth_readback;
+        stride = depth->stride() / sizeof(float);
+
+        const float* d = (const float*)depth->mapRead();
+        return d + (offset.y + (int)bounds.y0()) * stride + offset.x;
+    }
+
+    // @post: screen-space motion of the strip just rendered, 2 floats a pixel and stride floats a row
+    // @return: a pointer to the top left of the strip, valid until motion is unmapped, or nullptr if there is none
+    const float* Remote::renderMotion(shared_ptr<PixelTransferBuffer>& motion, size_t& stride) {
+
+        // the software rasterizer keeps no G-buffer
+        if (Constants::REMOTE_BACKEND == CPU_BACKEND) return nullptr;
+
+        Vector2int32 offset;
+        const shared_ptr<Texture>& texture = the_app->motionTexture(offset);
+        if (isNull(texture)) return nullptr;
+
+        motion_readback.reset();
+        motion_readback = FramePool::instance().gl(texture->width(), texture->height(), ImageFormat::RG32F());
+        texture->toPixelTransferBuffer(motion_readback, ImageFormat::RG32F());
+        motion = motion_readback;
+        stride = motion->stride() / sizeof(float);
+
+        const float* m = (const float*)motion->mapRead();
+        return m + (offset.y + (int)bounds.y0()) * stride + offset.x * 2;
+    }
+
+    // @post: saves the strip and its motion to Constants::RECORD_WALKTHROUGH_DIR as
+    // <batch>.png and <batch>.motion, the input CodecBenchmark reads
+    void Remote::record(uint32 batch_id, const shared_ptr<PixelTransferBuffer>& p, const Rect2D& rect, const float* motion, size_t motion_stride) {
+        const String base = FilePath::concat(Constants::RECORD_WALKTHROUGH_DIR, format("%08u", batch_id));
+
+        // through G3D's Image, which writes the file the right way up for Image::fromFile to read back
+        const int w = (int)rect.width();
+        const int h = (int)rect.height();
+        shared_ptr<CPUPixelTransferBuffer> strip = CPUPixelTransferBuffer::create(w, h, ImageFormat::RGB8());
+        const uint8* pixels = (const uint8*)p->mapRead();
+        for (int row = 0; row < h; row++) {
+            System::memcpy((uint8*)strip->buffer() + strip->rowOffset(row), pixels + p->rowOffset((int)rect.y0() + row), w * 3);
+        }
+        p->unmap();
+        Image::fromPixelTransferBuffer(strip)->save(base + ".png");
+
+        if (notNull(motion)) {
+            MotionPrediction::saveMotion(base + ".motion", motion, w, h, motion_stride);
+        }
+    }
+
+    // @pre: the current batch id, the views to render and the cameras of all of them
+    // @post: renders our strip of every view in mask and sends them, a layer each, in one fragment packet back to the router
+    void Remote::render(uint32 batch_id, uint8 mask, const Array<MultiView::view_t>& views) {
+
+        const shared_ptr<Camera>& camera = the_app->activeCamera();
+        const CoordinateFrame synced = camera->frame();
+        const float fov = camera->fieldOfViewAngle();
+
+        // the scene is posed once for every view, only the camera moves between them, and
+        // what none of them has in our rect is not posed at all
+        if (Constants::REMOTE_BACKEND == GPU_BACKEND) {
+            const float w = (float)Constants::SCREEN_WIDTH;
+            const float h = (float)Constants::SCREEN_HEIGHT;
+            Array<RegionCull::frustum_t> regions;
+            for (int v = 0; v < views.size(); v++) {
+                if (!(mask & (1 << v))) continue;
+                RegionCull::frustum_t f;
+                RegionCull::fromView(views[v].frame, RegionCull::tanHalfFovY(views[v].fov, camera->fieldOfViewDirection(), w, h), camera->nearPlaneZ(), bounds, w, h, Constants::REGION_CULL_MARGIN, f);
+                regions.append(f);
+            }
+            the_app->setCullRegions(regions);
+            the_app->poseAdHoc();
+        }
 
         BinaryOutput* bo = BinaryUtils::create();
-        BinaryOutput* header = BinaryUtils::toBinaryOutput(batch_id);
+        Array<MultiView::layer_t> layers;
+        bool bottom_up = false;
+
+        for (int v = 0; v < views.size() && v < session->codecs.size(); v++) {
+            if (!(mask & (1 << v))) continue;
+
+            // moved without motion, the views of a batch are not frames in time of each other
+            camera->setFrame(views[v].frame, true);
+            camera->setFieldOfViewAngle(views[v].fov);
+            codec = session->codecs[v];
+
+            MultiView::layer_t layer;
+            layer.view = (uint8)v;
+            const int64 start = bo->length();
+            renderView(batch_id, v, *bo, bottom_up);
+            layer.bytes = (uint32)(bo->length() - start);
+            layers.append(layer);
+        }
 
+        camera->setFrame(synced, true);
+        camera->setFieldOfViewAngle(fov);
+        codec = session->codecs[0];
 
-		shared_ptr<PixelTransferBuffer> p = the_app->finalFrameBuffer()->texture(0)->toPixelTransferBuffer(ImageFormat::RGB8());
-		shared_ptr<ImageDist> frame = ImageDist::fromPixelTransferBuffer(p,bounds);
+        sendFragment(batch_id, bottom_up, layers, bo);
+
+        uint32 allocations = FramePool::instance().endFrame();
+#if(DEBUG)
+        cout << "Frame pool allocations this frame: " << allocations << endl;
+        const RegionCull::stats_t& culled = the_app->cullStats();
+        cout << "Culled " << culled.entities_culled << " of " << culled.entities << " entities before posing, "
+             << culled.surfaces_culled << " of " << culled.surfaces << " surfaces before shading" << endl;
+#endif
+        (void)allocations;
+    }
 
-		frame->serialize(*bo, Image::JPEG);
+    // @pre: the current batch id and the view the camera is at
+    // @post: renders our strip of the view and appends it to bo, depth first when sort-last
+    void Remote::renderView(uint32 batch_id, int view, BinaryOutput& bo, bool& bottom_up) {
+        Rect2D rect;
+        shared_ptr<PixelTransferBuffer> p = renderStrip(rect, bottom_up);
+
+        // the G-buffer's motion vectors stand in for a motion search, a
+        // reduced strip no longer lines up with them and goes without
+        shared_ptr<PixelTransferBuffer> motion;
+        size_t motion_stride = 0;
+        const bool recording = String(Constants::RECORD_WALKTHROUGH_DIR) != "" && view == 0;
+        const float* m = (scale == 1 && render_scale == ResolutionController::MAX_SCALE && (codec->usesMotion() || recording)) ? renderMotion(motion, motion_stride) : nullptr;
+        if (recording) record(batch_id, p, rect, m, motion_stride);
+        codec->setMotion(m, motion_stride);
+
+        if (mode == SORT_LAST) {
+            shared_ptr<PixelTransferBuffer> depth;
+            size_t stride;
+            const float* d = renderDepth(depth, stride);
+            encodeLayer(batch_id, p, rect, bo, d, stride);
+            if (notNull(depth)) depth->unmap();
+        } else {
+            encodeLayer(batch_id, p, rect, bo);
+        }
+        if (notNull(motion)) motion->unmap();
+    }
 
-        send(PacketType::FRAGMENT, *header, *bo);
+    // @post: renders and reads back one strip that is thrown away. The first frame is where
+    // shaders get compiled and the G-buffer and framebuffers get allocated, doing it before
+    // CONFIG_RECEIPT means READY only goes out once every remote is warm
+    void Remote::warmUp() {
+        RealTime start = System::time();
+
+        Rect2D rect;
+        bool bottom_up;
+        if (Constants::REMOTE_BACKEND == GPU_BACKEND) {
+            the_app->setCullRegions(Array<RegionCull::frustum_t>());
+            the_app->poseAdHoc();
+        }
+        shared_ptr<PixelTransferBuffer> p = renderStrip(rect, bottom_up);
+        p->mapRead();
+        p->unmap();
+
+        cout << "Warm-up frame took " << (System::time() - start) * 1000.0 << " ms, " << FramePool::instance().endFrame() << " buffers pooled" << endl;
+    }
+
+    // @pre: the current batch id and the pixels holding our strip at rect, optionally its depth
+    // @post: the strip, depth first if given, is encoded with the current view's codec onto bo
+    void Remote::encodeLayer(uint32 batch_id, const shared_ptr<PixelTransferBuffer>& p, const Rect2D& rect, BinaryOutput& bo, const float* depth, size_t depth_stride){
+
+        codec->setQuality(quality);
+
+		if (notNull(depth)) {
+			FrameTrace::Span span("depth", batch_id);
+			depth_plane.encode(depth, (int)rect.width(), (int)rect.height(), depth_stride, bo);
+		}
+
+		// encode straight out of the readback, only our strip's rows. Mapping
+		// waits on the GPU's copy, so a slow readback shows up in this span
+		{
+			FrameTrace::Span span("encode", batch_id);
+			const uint8* pixels = (const uint8*)p->mapRead();
+			codec->encode(pixels + p->rowOffset((int)rect.y0()), (int)rect.width(), (int)rect.height(), p->stride(), bo);
+			p->unmap();
+		}
+    }
+
+    // @pre: the current batch id, the layers encoded onto bo and the table of them
+    // @post: sends them in one fragment packet to the router and frees bo
+    void Remote::sendFragment(uint32 batch_id, bool bottom_up, const Array<MultiView::layer_t>& layers, BinaryOutput* bo){
+
+        frame_header_t fh;
+        fh.batch_id = batch_id;
+        fh.encoding = codec->id();
+        fh.flags = bottom_up ? FRAME_BOTTOM_UP : 0;
+        fh.quality = quality;
+        fh.render_scale = render_scale;
+
+        // stamp the header last so the encode counts as processing, not link time
+        fh.sent_ms = current_time_ms();
+        fh.held_ms = (uint16)G3D::min(fh.sent_ms - update_received_ms, (uint32)0xFFFF);
+        BinaryOutput* header = BinaryUtils::toBinaryOutput(fh);
+        header->writeUInt8(session->id);
+        BinaryUtils::writeClockRequest(*header);
+        MultiView::writeLayers(*header, layers);
+
+        {
+            FrameTrace::Span span("sendFragment", batch_id);
+            send(PacketType::FRAGMENT, *header, *bo);
+        }
 
 #if(DEBUG)
         cout << "Sent fragment of frame no. " << batch_id << " at " << current_time_ms() << endl;
@@ -0,0 +1,78 @@
+#pragma once
+#include <G3D/G3D.h>
+
+/* =========================================
+ *          Resolution Controller
+ * =========================================
+ *
+ * Picks the render scale of the whole frame, frame by frame, so the time
+ * the router spends on a batch (UPDATE in to FRAME out: the remotes'
+ * render, readback and encode, the fragments' trip, decode, composite and
+ * encode) stays on target as the scene gets cheaper or dearer to draw.
+ *
+ * The scale is a percentage of full resolution each way, in STEP steps.
+ * Most of that time goes with the number of pixels, so when the smoothed
+ * frame time is over target the scale drops to what would hit it, by at
+ * least a step, and it only goes back up a step once the frame time at the
+ * bigger scale is predicted to stay under the target with room to spare.
+ *
+ * Every change costs every stream a keyframe, so after one the controller
+ * holds the scale for HOLD_FRAMES frames to see what it did.
+ */
+
+namespace DistributedRenderer {
+
+    class ResolutionController {
+        public:
+            static const int MAX_SCALE = 100;
+            static const int STEP = 5;
+            static const int HOLD_FRAMES = 15;
+
+        private:
+            double target_ms;
+            int min_scale;
+
+            int scale = MAX_SCALE;
+            double frame_ms = 0;
+            bool has_sample = false;
+            int since_change = 0;
+
+            // weight of a new sample in the smoothed frame time
+            static double smooth(double average, double sample) { return average + 0.125 * (sample - average); }
+
+            void adapt() {
+                if (++since_change < HOLD_FRAMES) return;
+
+                int next = scale;
+                if (frame_ms > target_ms) {
+                    const int fit = (int)(scale * sqrt(target_ms / frame_ms)) / STEP * STEP;
+                    next = G3D::max(min_scale, G3D::min(scale - STEP, fit));
+                } else if (scale < MAX_SCALE) {
+                    const double grown = (scale + STEP) / (double)scale;
+                    if (frame_ms * grown * grown < target_ms * 0.9) next = scale + STEP;
+                }
+
+                if (next != scale) {
+                    scale = next;
+                    since_change = 0;
+                }
+            }
+
+        public:
+            ResolutionController(double frame_time_target_ms = 12.0, int min_render_scale = 50) :
+                target_ms(frame_time_target_ms), min_scale(iClamp(min_render_scale, STEP, MAX_SCALE)) {}
+
+            // @pre: the time the router spent on one batch at the current scale
+            // @post: the estimate and the scale for the next batch are updated
+            void onFrame(double ms) {
+                frame_ms = has_sample ? smooth(frame_ms, ms) : ms;
+                has_sample = true;
+
+                adapt();
+            }
+
+            uint8 getScale() const { return (uint8)scale; }
+
+            double frameMs() const { return frame_ms; }
+    };
+}
@@ -11,21 +11,47 @@ namespace Router{
 //                  Setup
 // =========================================
 
-    void Router::addClient(shared_ptr<NetConnection> conn){
+    void Router::addClient(shared_ptr<NetConnection> conn, uint32 codecs, uint8 weight){
 
         cout << "Connected to client" << endl;
 
-        // first come first serve
-        if (client != NULL) return;
+        // one session per client, first come first serve up to MAX_CLIENTS
+        for (int i = 0; i < sessions.size(); i++) {
+            if (sessions[i]->connection == conn) return;
+        }
+        if (numSessions() >= Constants::MAX_CLIENTS) return;
+
+        session_t* s = new session_t();
+        s->id = (uint8)sessions.size();
+        s->weight = G3D::max(weight, (uint8)1);
+        s->closed = false;
+        s->connection = conn;
+        s->codecs = codecs;
 
-        client = conn; 
+        // defaults
+        s->rate = RateController(Constants::TARGET_MBPS, Constants::LATENCY_BUDGET_MS);
+        s->clock = clock_echo_t();
+        s->resolution = ResolutionController(Constants::FRAME_TIME_TARGET_MS, Constants::MIN_RENDER_SCALE);
+        s->frame_scale = ResolutionController::MAX_SCALE;
+        s->current_batch = 0;
+        s->pieces = 0;
+        s->received_ms = 0;
+        s->dispatched_ms = 0;
+        s->on_pool = 0;
+        s->last_finish = 0;
+        s->service_ms = 0;
+        s->stats = session_stats_t();
+
+        sessions.append(s);
+
+        cout << "Client session " << (int)s->id << " registered with weight " << (int)s->weight << endl;
     }
 
-    void Router::addRemote(shared_ptr<NetConnection> conn){
+    remote_connection_t* Router::addRemote(shared_ptr<NetConnection> conn, uint32 codecs, map<uint32, remote_connection_t*>& registry){
 
         uint32 id = conn->address().ip();
 
-        if(remote_connection_registry.find(id) != remote_connection_registry.end()) return;
+        if(registry.find(id) != registry.end()) return nullptr;
 
         remote_connection_t* cv = new remote_connection_t();
         cv->id = id;
@@ -35,15 +61,298 @@ namespace Router{
         cv->y = 0;
         cv->h = 0;
         cv->frag_loc = 0;
+        cv->max_quality = RateController::MAX_QUALITY;
+        cv->region = Foveation::region_t();
+        cv->region.scale = 1;
+        cv->codecs = codecs;
+        cv->rate = RateController(Constants::TARGET_MBPS, Constants::LATENCY_BUDGET_MS);
+        cv->clock = clock_echo_t();
+        cv->outstanding = 0;
+        cv->service_ms = 0;
 
     	cv->connection = conn;
-    	remote_connection_registry[id] = cv;
+    	registry[id] = cv;
 
         cout << "Remote node with address " << id << " registered" << endl;
+        return cv;
+    }
+
+    // @post: the remote is out of the registry and every batch waiting on it is answered with the
+    // frame the session's client last got, so its pipeline never waits on a frame that will not come.
+    // The rest are laid out again over the screen once the batches out on them are back
+    void Router::dropRemote(remote_connection_t* cv){
+        remote_connection_registry.erase(cv->id);
+        cout << "Remote node with address " << cv->id << " dropped, " << numRemotes() << " left" << endl;
+
+        for (int i = 0; i < sessions.size(); i++) {
+            session_t* s = sessions[i];
+            if (s->closed) continue;
+
+            if (Constants::RENDER_MODE == ALTERNATE_FRAME) {
+                for (map<uint32, afr_batch_t>::iterator it = s->reorder.begin(); it != s->reorder.end(); it++) {
+                    for (int v = 0; v < it->second.views.size(); v++) {
+                        afr_view_t& view = it->second.views[v];
+                        if (view.remote == cv && !view.arrived) {
+                            view.remote = nullptr;
+                            view.arrived = true;
+                        }
+                    }
+                }
+                sendReordered(s);
+            } else if (s->on_pool > 0) {
+                // the composite still holds the last frame, less whatever fragments made it in
+                Array<shared_ptr<CPUPixelTransferBuffer>> frames;
+                for (int v = 0; v < numViews(); v++) frames.append(s->compositor[v]->buffer());
+                sendFrame(s, s->current_batch, frames, s->received_ms, s->dispatched_ms);
+                s->pieces = 0;
+                s->on_pool = 0;
+            }
+        }
+
+        cv->connection->disconnect(false);
+        delete cv;
+        relayout_pending = true;
+    }
+
+    // @post: remotes that connect once the network is running are introduced, sent a CONFIG to warm
+    // up with, and wait in joining until they reply. A remote reconnecting from the same address
+    // takes the place of the one it was
+    void Router::acceptRemotes(){
+        for (NetConnectionIterator niter = server->newConnectionIterator(); niter.isValid(); ++niter) {
+            connecting.push_back(niter.connection());
+        }
+
+        for (list<shared_ptr<NetConnection>>::iterator it = connecting.begin(); it != connecting.end(); ) {
+            shared_ptr<NetConnection> conn = *it;
+            bool introduced = false;
+            for (NetMessageIterator miter = conn->incomingMessageIterator(); miter.isValid() && !introduced; ++miter) {
+                try {
+                    switch (miter.type()) {
+                        case PacketType::HI_AM_REMOTE: {
+                            introduced = true;
+                            // a foveated frame's layout went to the clients with READY and cannot change
+                            if (Constants::FOVEATED && Constants::RENDER_MODE == SORT_FIRST) {
+                                cout << "Foveated frames cannot be laid out again, remote " << conn->address().ip() << " turned away" << endl;
+                                fastsend(PacketType::TERMINATE, conn);
+                                break;
+                            }
+
+                            map<uint32, remote_connection_t*>::iterator old = remote_connection_registry.find(conn->address().ip());
+                            if (old != remote_connection_registry.end()) dropRemote(old->second);
+                            map<uint32, remote_connection_t*>::iterator waiting = joining.find(conn->address().ip());
+                            if (waiting != joining.end()) {
+                                delete waiting->second;
+                                joining.erase(waiting);
+                            }
+
+                            remote_connection_t* cv = addRemote(conn, BinaryUtils::readCodecs(miter.binaryInput()), joining);
+                            cv->h = Constants::SCREEN_HEIGHT;
+                            sendConfig(cv, 1);
+                            break;
+                        }
+                        case PacketType::HI_AM_CLIENT:
+                            introduced = true;
+                            cout << "Clients can only join before the network is ready" << endl;
+                            fastsend(PacketType::TERMINATE, conn);
+                            break;
+                        default:
+                            break;
+                    }
+                } catch (...) {
+                    cout << "An error occured" << endl;
+                }
+            }
+            if (introduced) it = connecting.erase(it);
+            else ++it;
+        }
+
+        // warmed up, the remote is laid out with the others between two batches
+        for (map<uint32, remote_connection_t*>::iterator it = joining.begin(); it != joining.end(); it++) {
+            remote_connection_t* cv = it->second;
+            for (NetMessageIterator miter = cv->connection->incomingMessageIterator(); miter.isValid(); ++miter) {
+                if (miter.type() == PacketType::CONFIG_RECEIPT && !cv->configured) {
+                    cv->configured = true;
+                    relayout_pending = true;
+                }
+            }
+        }
+    }
+
+    // @pre: no batch is out on the remotes
+    // @post: the remotes that have warmed up join the registry, the screen is split between every
+    // remote again, and the new ones are sent every session's snapshot and READY. Every stream
+    // starts over from a keyframe
+    void Router::relayout(){
+        relayout_pending = false;
+
+        Array<remote_connection_t*> joined;
+        for (map<uint32, remote_connection_t*>::iterator it = joining.begin(); it != joining.end(); ) {
+            if (it->second->configured) {
+                joined.append(it->second);
+                remote_connection_registry[it->first] = it->second;
+                it = joining.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        if (numRemotes() == 0) return;
+
+        uint32 atlas_width;
+        layout(atlas_width);
+
+        // the streams to the clients start over at the new layout too. Only sort-first frames are
+        // packed from the regions, the others are the screen whatever the remotes
+        for (int i = 0; i < sessions.size(); i++) {
+            session_t* s = sessions[i];
+            if (Constants::RENDER_MODE == SORT_FIRST) {
+                const uint8 scale = s->frame_scale;
+                s->frame_scale = 0;
+                setFrameScale(s, scale);
+            } else {
+                for (int v = 0; v < numViews(); v++) {
+                    s->compositor[v].reset();
+                    s->compositor[v] = Compositor::create(Constants::SCREEN_WIDTH, Constants::SCREEN_HEIGHT);
+                    s->codec[v]->reset();
+                }
+            }
+
+            // a client unpacks frames by the region table it got with READY, that changed with the layout
+            if (Constants::RENDER_MODE == SORT_FIRST && !s->closed) {
+                BinaryOutput* body = BinaryUtils::create();
+                Foveation::writeRegions(*body, regions);
+                fastsend(PacketType::REGIONS, s->connection, BinaryUtils::empty(), body);
+                delete body;
+            }
+        }
+
+        for (int j = 0; j < joined.size(); j++) {
+            remote_connection_t* cv = joined[j];
+            for (int i = 0; i < sessions.size(); i++) {
+                session_t* s = sessions[i];
+                if (s->closed) continue;
+
+                BinaryOutput* header = BinaryUtils::create();
+                header->writeUInt8(s->id);
+                BinaryOutput* body = BinaryUtils::create();
+                s->snapshot.write(*body);
+                fastsend(PacketType::SNAPSHOT, cv->connection, header, body);
+
+                cout << "Sent remote " << cv->id << " the snapshot of session " << (int)s->id << ", " << s->snapshot.size() << " entities in " << body->length() << " bytes" << endl;
+                delete header;
+                delete body;
+            }
+            fastsend(PacketType::READY, cv->connection);
+        }
+
+        cout << "Laid out " << numRemotes() << " remotes" << endl;
+    }
+
+
+// =========================================
+//               Scheduling
+// =========================================
+
+    // @return: how many batches may be out on the remotes at once, every remote takes
+    // part in each batch unless they take turns, then each of a batch's views takes one
+    uint32 Router::poolCapacity() {
+        return Constants::POOL_BATCHES * ((Constants::RENDER_MODE == ALTERNATE_FRAME) ? G3D::max(numRemotes() / numViews(), (uint32)1) : 1);
+    }
+
+    uint32 Router::batchesOnPool() {
+        uint32 n = 0;
+        for (int i = 0; i < sessions.size(); i++) n += sessions[i]->on_pool;
+        return n;
+    }
+
+    // @pre: an UPDATE from the session's client
+    // @post: the update waits its turn in the session's queue, stamped with its virtual finish time
+    void Router::queueUpdate(session_t* session, BinaryInput* header, BinaryInput* body) {
+        queued_update_t update;
+        update.batch = header->readUInt32();
+        update.sim_time = header->readFloat64();
+        update.received_ms = current_time_ms();
+
+        // the client's receipt for the last frame we sent it
+        frame_echo_t echo = BinaryUtils::readFrameEcho(*header);
+        if (echo.bytes > 0) {
+            session->rate.onDelivered(echo.bytes, echo.sent_ms, echo.received_ms, (float)(int32)(update.received_ms - echo.sent_ms - echo.held_ms));
+        }
+        session->clock = BinaryUtils::readClockRequest(*header);
+
+        // the cameras to render the batch from, one for each view of the layout
+        MultiView::read(*header, update.views);
+        if (update.views.size() != numViews()) {
+            cout << "Update " << update.batch << " of session " << (int)session->id << " has " << update.views.size() << " views, expected " << numViews() << endl;
+            return;
+        }
+
+        // and where the entities it changes are, to send them only where they can be seen
+        update.tan_half_fov_y = 0;
+        if (Constants::INTEREST_MANAGEMENT && header->hasMore()) Interest::read(*header, update.tan_half_fov_y, update.interest);
+
+        // weighted fair queuing over the time the remotes spend on a session's batch, so a
+        // session with twice the weight gets twice the remotes' time whatever its frames cost
+        const double cost = G3D::max(session->service_ms, 1.0);
+        update.finish = G3D::max(virtual_time, session->last_finish) + cost / session->weight;
+        session->last_finish = update.finish;
+
+        const int n = (int)(body->getLength() - body->getPosition());
+        update.body.resize(n, false);
+        body->readBytes(update.body.getCArray(), n);
+        session->queue.append(update);
+
+#if (DEBUG)
+        cout << "Queued update " << update.batch << " of session " << (int)session->id << " at " << update.received_ms << ", finish " << update.finish << endl;
+#endif
     }
 
-    void Router::removeRemote(NetAddress& addr){
-        // TODO: dynamic rebalancing
+    // @post: queued updates go out, the smallest virtual finish time first, while the remotes have room.
+    // None do while a change of remotes waits for the pool to drain
+    void Router::dispatch() {
+        // remotes come and go between batches, the ones out have to be back first
+        if (relayout_pending) {
+            if (batchesOnPool() > 0) return;
+            relayout();
+        }
+        if (numRemotes() == 0) return;
+
+        while (batchesOnPool() < poolCapacity()) {
+            session_t* next = nullptr;
+            for (int i = 0; i < sessions.size(); i++) {
+                session_t* s = sessions[i];
+                if (s->closed || s->queue.size() == 0) continue;
+                if (isNull(next) || s->queue[0].finish < next->queue[0].finish) next = s;
+            }
+            if (isNull(next)) return;
+
+            // self-clocked, virtual time is the finish time of the last update to go out
+            const queued_update_t update = next->queue[0];
+            next->queue.remove(0);
+            virtual_time = update.finish;
+
+            rerouteUpdate(next, update);
+        }
+    }
+
+    // @post: every session's throughput and latency since the last report is printed and reset
+    void Router::report() {
+        const RealTime now = System::time();
+        const double seconds = now - last_report;
+        last_report = now;
+
+        for (int i = 0; i < sessions.size(); i++) {
+            session_t* s = sessions[i];
+            session_stats_t& st = s->stats;
+            if (st.frames > 0) {
+                printf("session %d (weight %d): %.1f fps, %.1f Mbps, latency %.1f ms mean %.1f max, queued %.1f ms, remotes %.1f ms, scale %d%%\n",
+                    (int)s->id, (int)s->weight, st.frames / seconds, st.bytes * 8.0 / seconds / 1e6,
+                    st.latency_ms / st.frames, st.max_latency_ms, st.queued_ms / st.frames, st.pool_ms / st.frames, (int)s->frame_scale);
+            }
+            if (Constants::INTEREST_MANAGEMENT && st.full_update_bytes > 0) {
+                printf("session %d: updates to the remotes at %.1f%% of their full size\n", (int)s->id, 100.0 * st.update_bytes / st.full_update_bytes);
+            }
+            st = session_stats_t();
+        }
     }
 
 
@@ -51,66 +360,610 @@ namespace Router{
 //              Packet Handling
 // =========================================
 
-    void Router::rerouteUpdate(BinaryInput* header, BinaryInput* body) {
-       
-        current_batch = header->readUInt32();
+    // @pre: an update whose turn it is
+    // @post: it goes out to every remote, each told the session, the quality to encode at, the views to render
+    // and the cameras of all of them
+    void Router::rerouteUpdate(session_t* session, const queued_update_t& update) {
 
-		last_received_update = current_time_ms();
+        const uint32 current_batch = update.batch;
+        FrameTrace::Span span("reroute", session->id, current_batch);
+        const uint32 now = current_time_ms();
+        FrameTrace::instance().record("queue", session->id, current_batch, FrameTrace::nowUs() - (int64)(now - update.received_ms) * 1000, FrameTrace::nowUs());
 
 #if (DEBUG)
-        cout << "Rerouting update packet " << current_batch << " at " << last_received_update << endl;
+        cout << "Rerouting update packet " << current_batch << " of session " << (int)session->id << " at " << now << endl;
 #endif
 
-        // reset batch variables
-        //pieces = 0;
+        // the whole batch is rendered at the scale picked now, sort-last layers are always full size
+        if (Constants::DYNAMIC_RESOLUTION && Constants::RENDER_MODE == SORT_FIRST) setFrameScale(session, session->resolution.getScale());
+
+        // deal the (view, region) work items. Every remote renders its region of every view, unless
+        // they take turns, then one remote renders the whole of each view and its layer waits in
+        // the reorder buffer for the batch's others
+        const bool afr = Constants::RENDER_MODE == ALTERNATE_FRAME;
+        afr_batch_t* dealt = nullptr;
+        if (afr) {
+            dealt = &session->reorder[current_batch];
+            dealt->received_ms = update.received_ms;
+            dealt->dispatched_ms = now;
+            dealt->views.resize(numViews());
+            for (int v = 0; v < numViews(); v++) {
+                afr_view_t& view = dealt->views[v];
+                view.remote = pickRemote();
+                view.arrived = false;
+                view.bottom_up = false;
+                ++view.remote->outstanding;
+            }
+            ++session->on_pool;
+        } else {
+            // a batch still out for the session was lost, this one takes its place
+            session->current_batch = current_batch;
+            session->received_ms = update.received_ms;
+            session->dispatched_ms = now;
+            session->pieces = 0;
+            session->on_pool = 1;
+        }
+
+        // route transform data to all remotes, each told the quality to encode at and which views
+        // to render, one that renders none still syncs so no change is missed
+        BinaryOutput* data = BinaryUtils::create();
+        data->writeBytes(update.body.getCArray(), update.body.size());
+
+        // and keep the session's snapshot in step with what the remotes have been sent, for any that join later
+        // or copies that missed records
+        {
+            BinaryInput records(update.body.getCArray(), update.body.size(), G3D_LITTLE_ENDIAN, false, false);
+            if (!session->snapshot.apply(records)) cout << "Update " << current_batch << " of session " << (int)session->id << " has a record the snapshot does not know" << endl;
+        }
+
+        // where the entities of the batch were before it, the first time the client sends bounds
+        // for one it could have been anywhere
+        map<EntityTable::NetID, Sphere> before;
+        const bool interest = Constants::INTEREST_MANAGEMENT && update.tan_half_fov_y > 0;
+        if (interest) {
+            for (int i = 0; i < update.interest.size(); i++) {
+                const Interest::entry_t& e = update.interest[i];
+                map<EntityTable::NetID, Sphere>::iterator it = session->bounds.find(e.id);
+                before[e.id] = (it != session->bounds.end()) ? it->second : Sphere(Vector3::zero(), finf());
+                session->bounds[e.id] = e.bounds;
+            }
+        }
+
+    	map<uint32, remote_connection_t*>::iterator iter;
+    	for (iter = remote_connection_registry.begin(); iter != remote_connection_registry.end(); iter++) {
+            uint8 mask = (uint8)((1 << numViews()) - 1);
+            if (afr) {
+                mask = 0;
+                for (int v = 0; v < numViews(); v++) {
+                    if (dealt->views[v].remote == iter->second) mask |= (uint8)(1 << v);
+                }
+            }
+
+            // and the views whose streams start over from a keyframe
+            uint8 restart = 0;
+            for (int v = 0; v < numViews(); v++) {
+                stream_t& s = stream(iter->second, session->id, v);
+                if (s.restart) restart |= (uint8)(1 << v);
+                s.restart = false;
+            }
+
+            BinaryOutput* h = BinaryUtils::toBinaryOutput(current_batch);
+            h->writeUInt8(session->id);
+            h->writeUInt8(G3D::min(iter->second->rate.getQuality(), iter->second->max_quality));
+            h->writeUInt8(session->frame_scale);
+            h->writeUInt8(mask);
+            h->writeUInt8(restart);
+            h->writeFloat64(update.sim_time);
+            BinaryUtils::writeClockEcho(*h, iter->second->clock);
+            iter->second->clock.origin_ns = 0;
+            MultiView::write(*h, update.views);
+
+            session->stats.full_update_bytes += data->length();
+            if (interest) {
+                BinaryOutput* filtered = BinaryUtils::create();
+                filterUpdate(session, iter->second, update, before, *filtered);
+                session->stats.update_bytes += filtered->length();
+                send(PacketType::UPDATE, iter->second->connection, h, filtered);
+                delete filtered;
+            } else {
+                session->stats.update_bytes += data->length();
+                send(PacketType::UPDATE, iter->second->connection, h, data);
+            }
+            delete h;
+    	}
+
+        // despawned entities are nowhere
+        if (interest) {
+            BinaryInput records(update.body.getCArray(), update.body.size(), G3D_LITTLE_ENDIAN, false, false);
+            uint8 kind;
+            EntityTable::NetID id;
+            while (records.hasMore() && Interest::nextRecord(records, kind, id)) {
+                if (kind == ENTITY_DESPAWN) session->bounds.erase(id);
+            }
+        }
+
+        delete data;
+    }
+
+    // @pre: the session's update, its bounds applied, and where its entities were before it
+    // @post: out holds the records of the update the remote can see in its rows, and the whole state of
+    // every entity whose copy there missed records and that it now can, from the session's snapshot
+    void Router::filterUpdate(session_t* session, remote_connection_t* conn_vars, const queued_update_t& update, const map<EntityTable::NetID, Sphere>& before, BinaryOutput& out) {
+        Interest::stale_t& stale = conn_vars->stale[session->id];
+        const float w = (float)Constants::SCREEN_WIDTH;
+        const float h = (float)Constants::SCREEN_HEIGHT;
+        const float y = (float)conn_vars->y;
+        const float rows = (float)conn_vars->h;
+        const float margin = Constants::INTEREST_MARGIN;
+        const uint8* body = update.body.getCArray();
+
+        // @return: whether the remote gets the entity's record, otherwise its copy there is left stale
+        // or was caught up from the snapshot, which the update has been applied to
+        auto sends = [&](EntityTable::NetID id) {
+            map<EntityTable::NetID, Sphere>::const_iterator now = session->bounds.find(id);
+            map<EntityTable::NetID, Sphere>::const_iterator was = before.find(id);
+            Interest::stale_t::iterator copy = stale.find(id);
+            if (now == session->bounds.end() || was == before.end()) {
+                // no bounds sent for it, it goes everywhere
+                stale.erase(id);
+                return true;
+            }
+
+            // the copy here is where it was when it last heard, or where the entity was before this batch
+            const Sphere& here = (copy != stale.end()) ? copy->second : was->second;
+            const bool seen = Interest::covers(now->second, update.views, update.tan_half_fov_y, w, h, y, rows, margin) ||
+                              Interest::covers(here, update.views, update.tan_half_fov_y, w, h, y, rows, margin);
+            if (!seen) {
+                if (copy == stale.end()) stale[id] = here;
+            } else if (copy != stale.end()) {
+                session->snapshot.catchUp(id, out);
+                stale.erase(copy);
+            } else {
+                return true;
+            }
+            return false;
+        };
+
+        BinaryInput records(body, update.body.size(), G3D_LITTLE_ENDIAN, false, false);
+        while (records.hasMore()) {
+            const int64 start = records.getPosition();
+            uint8 kind;
+            EntityTable::NetID id;
+            if (!Interest::nextRecord(records, kind, id)) {
+                // nothing after a record we do not know can be split, it all goes
+                out.writeBytes(body + start, update.body.size() - start);
+                break;
+            }
+            const int64 end = records.getPosition();
+
+            if (kind == ENTITY_FRAME_BLOCK) {
+                // a block of frames is split entity by entity, the ones the remote gets go on in a block of their own
+                BinaryInput block_records(body + start + 5, end - start - 5, G3D_LITTLE_ENDIAN, false, false);
+                if (!block.read(block_records, id)) continue;
+                which.fastClear();
+                for (uint32 i = 0; i < block.size(); i++) {
+                    if (sends(block.id(i))) which.append(i);
+                }
+                if (which.size() > 0) {
+                    out.writeUInt8(ENTITY_FRAME_BLOCK);
+                    out.writeUInt32((uint32)which.size());
+                    block.write(out, &which);
+                }
+                continue;
+            }
+
+            if (kind != ENTITY_PROPERTIES && kind != ENTITY_FRAME) {
+                // spawned or despawned, the copy here is new or gone
+                stale.erase(id);
+                out.writeBytes(body + start, end - start);
+                continue;
+            }
+
+            if (sends(id)) out.writeBytes(body + start, end - start);
+        }
 
-        // route transform data to all remotes
-        broadcast(PacketType::UPDATE, 
-                  BinaryUtils::toBinaryOutput(header), 
-                  BinaryUtils::toBinaryOutput(body), 
-                  false);
+        // copies that missed records and came into view without one, the camera moved
+        for (Interest::stale_t::iterator it = stale.begin(); it != stale.end();) {
+            map<EntityTable::NetID, Sphere>::const_iterator now = session->bounds.find(it->first);
+            const bool seen = now == session->bounds.end() ||
+                              Interest::covers(now->second, update.views, update.tan_half_fov_y, w, h, y, rows, margin) ||
+                              Interest::covers(it->second, update.views, update.tan_half_fov_y, w, h, y, rows, margin);
+            if (seen) {
+                session->snapshot.catchUp(it->first, out);
+                it = stale.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    // @pre: the percent of full resolution the session's next batch is rendered at
+    // @post: the session's frames and every region in them are laid out at that scale, the client's
+    // streams start over from a keyframe if it changed
+    void Router::setFrameScale(session_t* session, uint8 percent) {
+        if (percent == session->frame_scale) return;
+        session->frame_scale = percent;
+
+        Array<Foveation::region_t> scaled;
+        uint32 atlas_width;
+        const uint32 atlas_height = Foveation::atScale(regions, Constants::SCREEN_WIDTH, percent, scaled, atlas_width);
+
+        int region = 0;
+        map<uint32, remote_connection_t*>::iterator iter;
+        for (iter = remote_connection_registry.begin(); iter != remote_connection_registry.end(); iter++) {
+            for (int v = 0; v < numViews(); v++) stream(iter->second, session->id, v).scaled_region = scaled[region];
+            ++region;
+        }
+
+        for (int v = 0; v < numViews(); v++) {
+            session->compositor[v].reset();
+            session->compositor[v] = Compositor::create(atlas_width, atlas_height);
+            session->codec[v]->reset();
+        }
+
+#if (DEBUG)
+        cout << "Session " << (int)session->id << " frame scale " << (int)percent << "%, " << atlas_width << "x" << atlas_height << ", router frame time " << session->resolution.frameMs() << " ms" << endl;
+#endif
+    }
+
+    // @pre: a remote's layer of one view for the session, positioned at its colour
+    // @post: decodes it into the remote's strip of the view's frame, or into its layer when sort-last
+    // @return: false if it could not be decoded or does not fit
+    bool Router::decodeFragment(session_t* session, remote_connection_t* conn_vars, int view, BinaryInput& body) {
+
+        // sort-last and alternate-frame fragments are whole screen layers of their own, sort-first ones are regions of the frame
+        stream_t& s = stream(conn_vars, session->id, view);
+        const bool whole_frames = Constants::RENDER_MODE != SORT_FIRST;
+        const shared_ptr<CPUPixelTransferBuffer>& target = whole_frames ? s.layer->buffer() : session->compositor[view]->buffer();
+        const Foveation::region_t& r = s.scaled_region;
+        const int target_y = whole_frames ? 0 : r.atlas_y;
+        const int target_x = whole_frames ? 0 : r.atlas_x;
+
+        // the frame is kept top row first, a bottom-up fragment is decoded
+        // from the strip's last row upwards rather than flipped afterwards
+        if (s.bottom_up) {
+            uint8* dst = (uint8*)target->buffer() + target->rowOffset(target_y + r.atlas_h - 1) + target_x * FrameCodec::BYTES_PER_PIXEL;
+            return s.codec->decode(body, dst, -(ptrdiff_t)target->stride(), r.atlas_w, r.atlas_h);
+        }
+
+        uint8* dst = (uint8*)target->buffer() + target->rowOffset(target_y) + target_x * FrameCodec::BYTES_PER_PIXEL;
+        return s.codec->decode(body, dst, target->stride(), r.atlas_w, r.atlas_h);
     }
 
     void Router::handleFragment(remote_connection_t* conn_vars, BinaryInput* h, BinaryInput* body) {
 
-        uint32 batch_id = h->readUInt32();
+        frame_header_t fh = BinaryUtils::readFrameHeader(*h);
+        const uint8 session_id = h->readUInt8();
+        conn_vars->clock = BinaryUtils::readClockRequest(*h);
+        Array<MultiView::layer_t> layers;
+        MultiView::readLayers(*h, layers);
+
+        if (session_id >= numSessions() || sessions[session_id]->closed) return;
+        session_t* session = sessions[session_id];
+
+        const shared_ptr<FrameCodec>& codec = stream(conn_vars, session_id, 0).codec;
+        if (fh.encoding != codec->id()) {
+            cout << "Fragment from " << conn_vars->id << " encoded as " << FrameCodec::name((CodecID)fh.encoding) << ", expected " << codec->name() << endl;
+            return;
+        }
+
+        // a strip from before the scale changed has no place in the frame, the remote's
+        // next one at the new scale starts from a keyframe
+        if (fh.render_scale != session->frame_scale) return;
+
+        // the layer table is the remote's word, every layer has to be in the body
+        int64 end = body->getPosition();
+        for (int i = 0; i < layers.size(); i++) {
+            if (layers[i].view >= numViews()) {
+                cout << "Fragment from " << conn_vars->id << " has a layer for view " << (int)layers[i].view << endl;
+                return;
+            }
+            end += layers[i].bytes;
+            if (end > body->getLength()) {
+                cout << "Fragment from " << conn_vars->id << " has a layer longer than its body" << endl;
+                return;
+            }
+        }
+
+        // whole views from one remote go through the reorder buffer instead
+        if (Constants::RENDER_MODE == ALTERNATE_FRAME) {
+            queueFrame(session, conn_vars, fh, layers, *h, *body);
+            return;
+        }
+
+        const bool sort_last = Constants::RENDER_MODE == SORT_LAST;
+        const bool temporal = codec->isTemporal();
+
+        // one layer per view, back to back, each with its depth ahead of its colour in the same row order
+        Array<int64> colour;
+        int64 offset = body->getPosition();
+        for (int i = 0; i < layers.size(); i++) {
+            stream_t& s = stream(conn_vars, session_id, layers[i].view);
+            s.bottom_up = (fh.flags & FRAME_BOTTOM_UP) != 0;
+            BinaryInput layer(body->getCArray() + offset, layers[i].bytes, G3D_LITTLE_ENDIAN, false, false);
+            offset += layers[i].bytes;
+
+            // a bottom-up depth plane is decoded from the last row upwards, like the colour after it
+            if (sort_last) {
+                const int w = Constants::SCREEN_WIDTH;
+                const int rows = s.depth.size() / w;
+                float* dst = s.bottom_up ? s.depth.getCArray() + (size_t)(rows - 1) * w : s.depth.getCArray();
+                if (!depth_plane.decode(layer, dst, w, rows, s.bottom_up ? -(ptrdiff_t)w : (ptrdiff_t)w)) {
+                    cout << "Fragment from " << conn_vars->id << " has a malformed depth plane" << endl;
+                    return;
+                }
+            }
+            colour.append(offset - layers[i].bytes + layer.getPosition());
+
+            // temporal layers are always decoded, even when old, because the
+            // remote's encoder already counts them as the new reference
+            if (temporal) {
+                FrameTrace::Span span("decode", session_id, fh.batch_id);
+                if (!decodeFragment(session, conn_vars, layers[i].view, layer)) {
+                    cout << "Fragment from " << conn_vars->id << " does not fit its strip" << endl;
+                    return;
+                }
+            }
+        }
 
         // old fragment, toss out
-		if (batch_id != current_batch) {
+		if (fh.batch_id != session->current_batch || session->on_pool == 0) {
 #if (DEBUG)
 			cout << "Frame was old" << endl;
 #endif
 			return;
 		}
 
-        // attach fragment to buffer
-		fragments[conn_vars->frag_loc] = ImageDist::fromBinaryInput(*body, ImageFormat::RGB8());
+        // the fragment made it across for the batch we sent, one sample for the remote's link
+        const uint32 now = current_time_ms();
+        conn_vars->rate.onDelivered((uint32)(h->getLength() + body->getLength()), fh.sent_ms, now, (float)(int32)(now - session->dispatched_ms - fh.held_ms));
+
+        // hold on to the rest until the batch is complete, they are decoded together
+		if (!temporal) {
+            offset = body->getPosition();
+            for (int i = 0; i < layers.size(); i++) {
+                stream_t& s = stream(conn_vars, session_id, layers[i].view);
+                offset += layers[i].bytes;
+                const int n = (int)(offset - colour[i]);
+                s.pending.resize(n, false);
+                System::memcpy(s.pending.getCArray(), body->getCArray() + colour[i], n);
+            }
+		}
 
 #if (DEBUG)
-        cout << "Received fragment from " << conn_vars->id << ", total: " << pieces + 1 << "/" << numRemotes() << endl;
+        cout << "Received fragment from " << conn_vars->id << " for session " << (int)session_id << ", total: " << session->pieces + layers.size() << "/" << numRemotes() * numViews() << endl;
 #endif
 
-        // check if finished
-        if (++pieces == numRemotes()){
-            
-            shared_ptr<ImageDist> frame = TextureDist::CombineImages(fragments);
+        // check if finished, every remote sends a layer of every view
+        session->pieces += layers.size();
+        if (session->pieces == numRemotes() * numViews()){
+
+            const uint32 current_batch = session->current_batch;
+            map<uint32, remote_connection_t*>::iterator iter;
+
+            // layers land in separate strips (or layers), so each is decoded on its own thread
+            Array<remote_connection_t*> remotes;
+            Array<int> views;
+            for (iter = remote_connection_registry.begin(); iter != remote_connection_registry.end(); iter++) {
+                for (int v = 0; v < numViews(); v++) {
+                    if (stream(iter->second, session_id, v).pending.size() == 0) continue;
+                    remotes.append(iter->second);
+                    views.append(v);
+                }
+            }
+            runConcurrently(0, remotes.size(), [&](int i) {
+                remote_connection_t* cv = remotes[i];
+                stream_t& s = stream(cv, session_id, views[i]);
+                FrameTrace::Span span("decode", session_id, current_batch);
+                BinaryInput in(s.pending.getCArray(), s.pending.size(), G3D_LITTLE_ENDIAN, false, false);
+                if (!decodeFragment(session, cv, views[i], in)) debugPrintf("Fragment from %u could not be decoded\n", cv->id);
+                s.pending.fastClear();
+            });
+
+            if (sort_last) {
+                FrameTrace::Span span("combine", session_id, current_batch);
+                for (int v = 0; v < numViews(); v++) {
+                    Array<Compositor::layer_t> merged;
+                    for (iter = remote_connection_registry.begin(); iter != remote_connection_registry.end(); iter++) {
+                        stream_t& s = stream(iter->second, session_id, v);
+                        Compositor::layer_t layer;
+                        layer.color = (const uint8*)s.layer->buffer()->buffer();
+                        layer.color_stride = s.layer->buffer()->stride();
+                        layer.depth = s.depth.getCArray();
+                        layer.depth_stride = Constants::SCREEN_WIDTH;
+                        merged.append(layer);
+                    }
+                    session->compositor[v]->depthMerge(merged);
+                }
+            }
+
+            Array<shared_ptr<CPUPixelTransferBuffer>> frames;
+            for (int v = 0; v < numViews(); v++) frames.append(session->compositor[v]->buffer());
+            sendFrame(session, current_batch, frames, session->received_ms, session->dispatched_ms);
 
-            // send a new frame packet to the client
-            BinaryOutput* header = BinaryUtils::toBinaryOutput(current_batch);
-            BinaryOutput* bo = BinaryUtils::create();
+			session->pieces = 0;
+            session->on_pool = 0;
+		}
+    }
+
+    // @return: the remote to render the next view when alternate-frame. Round robin deals in
+    // registry order, least-loaded deals to the remote with the fewest views outstanding and,
+    // of those, the one that has been turning them around quickest
+    remote_connection_t* Router::pickRemote() {
+        Array<remote_connection_t*> remotes;
+        map<uint32, remote_connection_t*>::iterator iter;
+        for (iter = remote_connection_registry.begin(); iter != remote_connection_registry.end(); iter++) {
+            remotes.append(iter->second);
+        }
+
+        // starting after the last one dealt to, so ties go round robin too
+        int picked = next_dealt % remotes.size();
+        if (Constants::AFR_SCHEDULE == LEAST_LOADED) {
+            for (int k = 1; k < remotes.size(); k++) {
+                const int i = (next_dealt + k) % remotes.size();
+                const remote_connection_t* a = remotes[i];
+                const remote_connection_t* b = remotes[picked];
+                if (a->outstanding < b->outstanding || (a->outstanding == b->outstanding && a->service_ms < b->service_ms)) picked = i;
+            }
+        }
+
+        next_dealt = picked + 1;
+        return remotes[picked];
+    }
+
+    // @pre: a remote's whole views, its header read, for a batch of the session they were dealt to it in
+    // @post: the views wait in the session's reorder buffer, and the batches at its head that are complete go on to the client
+    void Router::queueFrame(session_t* session, remote_connection_t* conn_vars, const frame_header_t& fh, const Array<MultiView::layer_t>& layers, BinaryInput& h, BinaryInput& body) {
+        map<uint32, afr_batch_t>::iterator it = session->reorder.find(fh.batch_id);
+        if (it == session->reorder.end()) {
+            cout << "Frame " << fh.batch_id << " from " << conn_vars->id << " was not dealt to it" << endl;
+            return;
+        }
+
+        afr_batch_t& dealt = it->second;
+        const uint32 now = current_time_ms();
+        conn_vars->rate.onDelivered((uint32)(h.getLength() + body.getLength()), fh.sent_ms, now, (float)(int32)(now - dealt.dispatched_ms - fh.held_ms));
+
+        int64 offset = body.getPosition();
+        for (int i = 0; i < layers.size(); i++) {
+            afr_view_t& view = dealt.views[layers[i].view];
+            offset += layers[i].bytes;
+            if (view.remote != conn_vars || view.arrived) {
+                cout << "View " << (int)layers[i].view << " of frame " << fh.batch_id << " from " << conn_vars->id << " was not dealt to it" << endl;
+                continue;
+            }
 
-            // JPEG encoding/decoding takes more time but substantially less bandwidth than PNG
-            frame->serialize(*bo, Image::JPEG);
+            conn_vars->service_ms = (conn_vars->service_ms == 0) ? (now - dealt.dispatched_ms) : conn_vars->service_ms + 0.125 * ((now - dealt.dispatched_ms) - conn_vars->service_ms);
+            --conn_vars->outstanding;
 
-			fastsend(PacketType::FRAME, client, header, bo);
+            view.arrived = true;
+            view.bottom_up = (fh.flags & FRAME_BOTTOM_UP) != 0;
+            view.body.resize(layers[i].bytes, false);
+            System::memcpy(view.body.getCArray(), body.getCArray() + offset - layers[i].bytes, layers[i].bytes);
+        }
+
+        sendReordered(session);
+    }
+
+    // @post: the batches at the head of the session's reorder buffer that are complete go on to the client.
+    // Frames go out in batch order, a late view holds back every batch dealt after it, but only until
+    // Constants::AFR_DEADLINE_MS. They are decoded only now because the remote's layer holds the
+    // reference its next view is coded against
+    void Router::sendReordered(session_t* session) {
+        const uint32 now = current_time_ms();
+        while (!session->reorder.empty()) {
+            const uint32 batch = session->reorder.begin()->first;
+            afr_batch_t& next = session->reorder.begin()->second;
+
+            bool complete = true;
+            for (int v = 0; v < next.views.size(); v++) complete = complete && next.views[v].arrived;
+
+            // a view lost on the way, or one that never comes, would hold the session up for good. Past the
+            // deadline it is given up on and the client gets the view as it last saw it. The remote's encoder
+            // went on from the lost layer, so its stream of the view starts over from a keyframe
+            if (!complete && now - next.dispatched_ms > Constants::AFR_DEADLINE_MS) {
+                for (int v = 0; v < next.views.size(); v++) {
+                    afr_view_t& view = next.views[v];
+                    if (view.arrived || isNull(view.remote)) continue;
+                    cout << "View " << v << " of frame " << batch << " from " << view.remote->id << " missed its deadline" << endl;
+                    --view.remote->outstanding;
+                    stream(view.remote, session->id, v).restart = true;
+                    view.remote = nullptr;
+                }
+                complete = true;
+            }
+            if (!complete) break;
+
+            Array<shared_ptr<CPUPixelTransferBuffer>> frames;
+            for (int v = 0; v < next.views.size(); v++) {
+                afr_view_t& view = next.views[v];
+
+                // its remote dropped out, the client gets the view as it last saw it
+                if (isNull(view.remote)) {
+                    frames.append((v < session->last_frames.size()) ? session->last_frames[v] : session->compositor[v]->buffer());
+                    continue;
+                }
+
+                stream_t& s = stream(view.remote, session->id, v);
+                s.bottom_up = view.bottom_up;
+                {
+                    FrameTrace::Span span("decode", session->id, batch);
+                    BinaryInput in(view.body.getCArray(), view.body.size(), G3D_LITTLE_ENDIAN, false, false);
+                    if (!decodeFragment(session, view.remote, v, in)) debugPrintf("Frame from %u could not be decoded\n", view.remote->id);
+                }
+                frames.append(s.layer->buffer());
+            }
+            sendFrame(session, batch, frames, next.received_ms, next.dispatched_ms);
+
+            session->reorder.erase(session->reorder.begin());
+            if (session->on_pool > 0) --session->on_pool;
+        }
+    }
+
+    // @pre: the session's frame of every view for batch, top row first, when the batch's UPDATE came in and when it went out
+    // @post: every view is encoded into a layer of its own and sent to the session's client
+    void Router::sendFrame(session_t* session, uint32 batch, const Array<shared_ptr<CPUPixelTransferBuffer>>& frames, uint32 received_ms, uint32 dispatched_ms) {
+        frame_header_t out;
+        out.batch_id = batch;
+        out.encoding = session->codec[0]->id();
+        out.flags = 0; // the composite is top row first whatever the fragments were
+        out.quality = session->rate.getQuality();
+        out.render_scale = session->frame_scale;
+        session->last_frames = frames;
+
+        BinaryOutput* bo = BinaryUtils::create();
+        Array<MultiView::layer_t> layers;
+
+        {
+            FrameTrace::Span span("encode", session->id, batch);
+            for (int v = 0; v < frames.size(); v++) {
+                const shared_ptr<CPUPixelTransferBuffer>& frame = frames[v];
+                const int64 start = bo->length();
+                session->codec[v]->setQuality(out.quality);
+                session->codec[v]->encode((const uint8*)frame->buffer(), frame->width(), frame->height(), frame->stride(), *bo);
+
+                MultiView::layer_t layer;
+                layer.view = (uint8)v;
+                layer.bytes = (uint32)(bo->length() - start);
+                layers.append(layer);
+            }
+        }
+
+        // the resolution follows the time on the remotes, the queue is the scheduler's to keep short
+        out.sent_ms = current_time_ms();
+        out.held_ms = (uint16)G3D::min(out.sent_ms - received_ms, (uint32)0xFFFF);
+        session->resolution.onFrame(out.sent_ms - dispatched_ms);
+        session->service_ms = (session->service_ms == 0) ? (out.sent_ms - dispatched_ms) : session->service_ms + 0.125 * ((double)(out.sent_ms - dispatched_ms) - session->service_ms);
+        BinaryOutput* header = BinaryUtils::toBinaryOutput(out);
+        BinaryUtils::writeClockEcho(*header, session->clock);
+        session->clock.origin_ns = 0;
+        MultiView::writeLayers(*header, layers);
+
+        {
+            FrameTrace::Span span("sendFrame", session->id, batch);
+            fastsend(PacketType::FRAME, session->connection, header, bo);
+        }
+
+        session_stats_t& st = session->stats;
+        const double latency = out.sent_ms - received_ms;
+        ++st.frames;
+        st.bytes += bo->length();
+        st.latency_ms += latency;
+        st.max_latency_ms = G3D::max(st.max_latency_ms, latency);
+        st.queued_ms += dispatched_ms - received_ms;
+        st.pool_ms += out.sent_ms - dispatched_ms;
 
 #if (DEBUG)
-			uint32 ms = current_time_ms();
-            cout << "Sent frame no. " << batch_id << " to client at " << ms << ", ms since update: " << ms - last_received_update << endl;
+        uint32 ms = current_time_ms();
+        cout << "Sent frame no. " << batch << " to client " << (int)session->id << " at " << ms << ", ms since update: " << ms - received_ms << endl;
+        cout << "Client link: quality " << (int)out.quality << ", rtt " << session->rate.rttMs() << " ms, sent " << session->rate.sendMbps() << " Mbps, delivered " << session->rate.deliveryMbps() << " Mbps" << endl;
 #endif
 
-			pieces = 0;
-        } 
+        uint32 allocations = FramePool::instance().endFrame();
+#if (DEBUG)
+        cout << "Frame pool allocations this frame: " << allocations << endl;
+#endif
+        (void)allocations;
     }
 
 // =========================================
@@ -118,8 +971,10 @@ namespace Router{
 // =========================================
 
     void Router::broadcast(PacketType t, BinaryOutput* header, BinaryOutput* body, bool include_client) {
-    	// optionally send to client
-    	if (include_client) send(t, client, header, body);
+    	// optionally send to every client
+    	if (include_client) {
+            for (int i = 0; i < sessions.size(); i++) send(t, sessions[i]->connection, header, body);
+        }
 
     	map<uint32, remote_connection_t*>::iterator iter;
     	for (iter = remote_connection_registry.begin(); iter != remote_connection_registry.end(); iter++) {
@@ -160,9 +1015,10 @@ namespace Router{
         // cache connected machines 
         list<shared_ptr<NetConnection>> connections;
 
-        // listen until the client responds, and if the client responded wait until the tolerance is exceeded
-        // then just use whatever nodes were registered. If there were no remote nodes, it will terminate in main
-        while (client == NULL || System::time() < tolerance) {
+        // listen until a client responds, and if one responded wait until the tolerance is exceeded, every
+        // client that joins extends it. Then just use whatever nodes were registered. If there were no
+        // remote nodes, it will terminate in main
+        while (numSessions() == 0 || System::time() < tolerance) {
             // If we directly check the message iterator after we get the connection, it will not always
             // give us the messages even though it has them because it hasn't initialized its NetServerSideConnection
             // so we just cache the connection and always recheck it afterwards
@@ -177,12 +1033,14 @@ namespace Router{
                     try {
                         switch(miter.type()){
                             case PacketType::HI_AM_REMOTE:
-                                addRemote(conn);
+                                addRemote(conn, BinaryUtils::readCodecs(miter.binaryInput()), remote_connection_registry);
                                 break;
-                            case PacketType::HI_AM_CLIENT:
-                                addClient(conn);
+                            case PacketType::HI_AM_CLIENT: {
+                                const uint32 codecs = BinaryUtils::readCodecs(miter.binaryInput());
+                                addClient(conn, codecs, BinaryUtils::readWeight(miter.binaryInput()));
                                 tolerance = System::time() + Constants::CONNECTION_WAIT;
                                 break;
+                            }
                             default:
                                 cout << "Set up phase was not expecting packet of type " << miter.type() << endl; 
 						}
@@ -194,44 +1052,122 @@ namespace Router{
         } // end while
     }
 
-    void Router::configuration() {
-        setState(CONFIGURATION);
+    // @pre: the remote's strip and place among count remotes
+    // @post: they are sent to it with the codec picked for its link and its tier's scale
+    void Router::sendConfig(remote_connection_t* cv, uint32 count) {
+        // send the config data
+        BinaryOutput* config = BinaryUtils::create();
+
+        config->writeUInt32(cv->y);
+        config->writeUInt32(cv->h);
+
+        // render mode and this node's place among the remotes
+        config->writeUInt8(Constants::RENDER_MODE);
+        config->writeUInt32(cv->frag_loc);
+        config->writeUInt32(count);
+
+        // the codec for this link, every session's stream on it is coded with its own instance
+        cv->codec = BinaryUtils::negotiateCodec(cv->codecs);
+        config->writeUInt8(cv->codec);
+
+        // the resolution to render at, 1 / scale of the strip's
+        config->writeUInt8(cv->region.scale);
 
-        // TODO: if the screen height is not perfectly divisble by the number of nodes, give the remaining pixels
-        // to one of the nodes
-        uint32 frag_height = Constants::SCREEN_HEIGHT / numRemotes(); 
+        cout << "Sending CONFIG packet to Remote Node " << cv->id << " offset_y: " << cv->y << ", height: " << cv->h << ", codec: " << FrameCodec::name(cv->codec) << ", scale: 1/" << (int)cv->region.scale << endl;
+
+        fastsend(PacketType::CONFIG, cv->connection, BinaryUtils::empty(), config);
+    }
+
+    // @post: the screen is split between the registered remotes, each is sent its CONFIG and
+    // every stream on it starts over
+    // @return: the height of the frame sent to clients at full resolution, atlas_width its width
+    uint32 Router::layout(uint32& atlas_width) {
+
+        // if the screen height is not perfectly divisible by the number of nodes, the last node gets the spill
+        // when sort-last, every node gets the whole screen and a share of the entities instead, and
+        // when alternate-frame the whole screen and a share of the batches
+        const bool sort_last = Constants::RENDER_MODE == SORT_LAST;
+        const bool whole_frames = Constants::RENDER_MODE != SORT_FIRST;
+        uint32 frag_height = whole_frames ? Constants::SCREEN_HEIGHT : Constants::SCREEN_HEIGHT / numRemotes(); 
         uint32 curr_y = 0;
         int frag = 0; 
 
+        // lay the strips out and give each its tier first, the frame to the client is packed from all of them
+        regions.fastClear();
         map<uint32, remote_connection_t*>::iterator iter;
         for(iter = remote_connection_registry.begin(); iter != remote_connection_registry.end(); iter++){ 
 
             remote_connection_t* cv = iter->second;
 
 			// add the spill to the last node
-			if (frag == numRemotes() - 1) frag_height += Constants::SCREEN_HEIGHT % numRemotes();
+			if (!whole_frames && frag == numRemotes() - 1) frag_height += Constants::SCREEN_HEIGHT % numRemotes();
 
-            // send the config data
-            BinaryOutput* config = BinaryUtils::create();
+            cv->y = curr_y;
+            cv->h = frag_height;
+			cv->frag_loc = frag++;
 
-            config->writeUInt32(curr_y);
-            config->writeUInt32(frag_height);
+            // foveation is per strip of the screen, sort-last layers all cover all of it
+            Foveation::region_t r = Foveation::region_t();
+            r.screen_y = curr_y;
+            r.screen_h = frag_height;
+            r.scale = (Constants::FOVEATED && !whole_frames && Constants::VIEW_LAYOUT == SINGLE_VIEW) ? Foveation::tierFor(curr_y, frag_height, Constants::SCREEN_HEIGHT, Constants::FOVEA_FRACTION, Constants::PERIPHERY_SCALE) : 1;
+            if (whole_frames) {
+                r.atlas_w = Constants::SCREEN_WIDTH;
+                r.atlas_h = Constants::SCREEN_HEIGHT;
+            }
+            regions.append(r);
 
-            cout << "Sending CONFIG packet to Remote Node " << cv->id << " offset_y: " << curr_y << ", height: " << frag_height << endl;
+            cv->max_quality = (r.scale > 1) ? Constants::PERIPHERY_MAX_QUALITY : RateController::MAX_QUALITY;
 
-			fastsend(PacketType::CONFIG, cv->connection, BinaryUtils::empty(), config);
+            if (!whole_frames) curr_y += frag_height;
+        }
 
-            // store internal record
-            cv->y = curr_y;
-            cv->h = frag_height;
-			cv->frag_loc = frag++;
+        const uint32 atlas_height = whole_frames ? Constants::SCREEN_HEIGHT : Foveation::pack(regions, Constants::SCREEN_WIDTH, atlas_width);
+        if (whole_frames) atlas_width = Constants::SCREEN_WIDTH;
 
-            curr_y += frag_height;
+        int region = 0;
+        for(iter = remote_connection_registry.begin(); iter != remote_connection_registry.end(); iter++){ 
+
+            remote_connection_t* cv = iter->second;
+            cv->region = regions[region++];
+            sendConfig(cv, numRemotes());
+
+            cv->streams.resize(numSessions() * numViews());
+            for (int i = 0; i < cv->streams.size(); i++) {
+                stream_t& stream = cv->streams[i];
+                stream.codec = FrameCodec::create(cv->codec, Constants::KEYFRAME_INTERVAL);
+                stream.pending.fastClear();
+                stream.restart = false;
+                stream.bottom_up = false;
+                stream.scaled_region = cv->region;
+                if (whole_frames) stream.layer = Compositor::create(Constants::SCREEN_WIDTH, Constants::SCREEN_HEIGHT);
+                if (sort_last) stream.depth.resize(Constants::SCREEN_WIDTH * Constants::SCREEN_HEIGHT);
+            }
+        }
+
+        return atlas_height;
+    }
+
+    void Router::configuration() {
+        setState(CONFIGURATION);
+
+        uint32 atlas_width;
+        const uint32 atlas_height = layout(atlas_width);
+        const bool whole_frames = Constants::RENDER_MODE != SORT_FIRST;
+
+        // every client gets a frame of its own for every view and picks its codec for them
+        for (int i = 0; i < sessions.size(); i++) {
+            session_t* s = sessions[i];
+            const bool client_yuv = Constants::YUV_TO_CLIENT && (s->codecs & (1 << YUV420_CODEC));
+            const CodecID id = client_yuv ? YUV420_CODEC : BinaryUtils::negotiateCodec(s->codecs);
+            for (int v = 0; v < numViews(); v++) {
+                s->compositor.append(Compositor::create(atlas_width, atlas_height));
+                s->codec.append(FrameCodec::create(id, Constants::KEYFRAME_INTERVAL));
+            }
         }
 
         int configurations = 0;
         map<uint32, remote_connection_t*>::iterator remotes;
-        fragments.resize(numRemotes(), true);
 
         while(router_state != TERMINATED){
             for(remotes = remote_connection_registry.begin(); remotes != remote_connection_registry.end(); remotes++){
@@ -248,7 +1184,27 @@ namespace Router{
 									// if every node is accounted for and running without error
 									// broadcast a ready message and await the client's update
 									if (++configurations == numRemotes()) {
-										broadcast(PacketType::READY, true); 
+										broadcast(PacketType::READY, false);
+
+										// every client also needs to know what its frames will be encoded with,
+										// and where each region of the screen is in them
+										for (int i = 0; i < sessions.size(); i++) {
+											BinaryOutput* ready = BinaryUtils::create();
+											ready->writeUInt8(sessions[i]->codec[0]->id());
+											if (whole_frames) {
+												Foveation::region_t whole = remote_connection_registry.begin()->second->region;
+												Foveation::writeRegions(*ready, Array<Foveation::region_t>(whole));
+											} else {
+												Foveation::writeRegions(*ready, regions);
+											}
+
+											// and how many batches it may have in flight, one per remote a batch's views take when they take turns
+											ready->writeUInt8((uint8)((Constants::RENDER_MODE == ALTERNATE_FRAME) ? G3D::max(numRemotes() / numViews(), (uint32)1) : 1));
+
+											// and its session, which its spans are traced under
+											ready->writeUInt8(sessions[i]->id);
+											fastsend(PacketType::READY, sessions[i]->connection, BinaryUtils::empty(), ready);
+										}
 
 										cout << "----------------" << endl;
 										cout << "NETWORK IS READY" << endl;
@@ -284,7 +1240,7 @@ namespace Router{
         if(numRemotes() == 0){
             cout << "No remote nodes were registered." << endl;  
             return false;
-        } else if (client == NULL) {
+        } else if (numSessions() == 0) {
             cout << "Client connection could not be initalized" << endl;
             return false;
         }
@@ -296,44 +1252,73 @@ namespace Router{
     }
 
     // This receive method will check for available messages forever unless a connection is compromised,
-    // it will check every connection in the remote connection registry and the client connection
-    // then call whatever code is specified with that message type
+    // it will check every connection in the remote connection registry and every client connection
+    // then call whatever code is specified with that message type. Client updates are queued and
+    // sent on to the remotes as the scheduler gives each session its turn
     void Router::poll(){
         setState(LISTENING);
 
         map<uint32, remote_connection_t*>::iterator remotes;
+        last_report = System::time();
 
         while(router_state != TERMINATED){
 
-            // TODO: make sure client is still connected
+            // TODO: make sure clients are still connected
             if (false) {}
 
-            // listen to client
-            for(NetMessageIterator iter = client->incomingMessageIterator(); iter.isValid(); ++iter){
-                try {
-                    switch(iter.type()){
-                        case PacketType::UPDATE: // reroute update from clients
-                            rerouteUpdate(&iter.headerBinaryInput(), &iter.binaryInput());
-                            break;
-                        case PacketType::TERMINATE: // the client wants to stop
-                            setState(TERMINATED);
-                            break;
-                        default:
-                            cout << "Listener received unexpected message " << iter.type() << " from client" << endl;
-    						break;
+            // listen to clients
+            for (int i = 0; i < sessions.size(); i++) {
+                session_t* session = sessions[i];
+                if (session->closed) continue;
+
+                for(NetMessageIterator iter = session->connection->incomingMessageIterator(); iter.isValid(); ++iter){
+                    try {
+                        switch(iter.type()){
+                            case PacketType::UPDATE: // queue update from clients
+                                queueUpdate(session, &iter.headerBinaryInput(), &iter.binaryInput());
+                                break;
+                            case PacketType::TERMINATE: { // the client wants to stop, the router stops with the last one
+                                session->closed = true;
+                                session->queue.fastClear();
+                                session->on_pool = 0;
+                                for (map<uint32, afr_batch_t>::iterator it = session->reorder.begin(); it != session->reorder.end(); it++) {
+                                    for (int v = 0; v < it->second.views.size(); v++) {
+                                        afr_view_t& view = it->second.views[v];
+                                        if (!view.arrived && notNull(view.remote)) --view.remote->outstanding;
+                                    }
+                                }
+                                session->reorder.clear();
+                                cout << "Client session " << (int)session->id << " ended" << endl;
+
+                                bool open = false;
+                                for (int j = 0; j < sessions.size(); j++) open = open || !sessions[j]->closed;
+                                if (!open) setState(TERMINATED);
+                                break;
+                            }
+                            default:
+                                cout << "Listener received unexpected message " << iter.type() << " from client" << endl;
+    							break;
+                        }
+                    }catch(...){
+                        // handle client error
                     }
-                }catch(...){
-                    // handle client error
-                }
-            } // client message loop
+                } // client message loop
+            } // client connection loop
+
+            // remotes joining the running network
+            acceptRemotes();
 
             // listen to remote connections
+            Array<remote_connection_t*> lost;
             for(remotes = remote_connection_registry.begin(); remotes != remote_connection_registry.end(); remotes++){
                 remote_connection_t* conn_vars = remotes->second;
                 shared_ptr<NetConnection> conn = conn_vars->connection;
 
-                // TODO: check if node is still connected
-                if (false) {}
+                // a remote that went away is dropped once everything else has been heard
+                if (conn->status() == NetConnection::DISCONNECTED) {
+                    lost.append(conn_vars);
+                    continue;
+                }
 
                 for(NetMessageIterator iter = conn->incomingMessageIterator(); iter.isValid(); ++iter){
                     try {  
@@ -341,6 +1326,8 @@ namespace Router{
                             case PacketType::FRAGMENT: // a frame fragment
                                 handleFragment(conn_vars, &iter.headerBinaryInput(), &iter.binaryInput());
                                 break;
+                            case PacketType::CONFIG_RECEIPT: // a running remote after a layout, nothing to wait for
+                                break;
                             case PacketType::TERMINATE:
                                 // handle failure
                                 break;
@@ -353,14 +1340,28 @@ namespace Router{
                     }
                 } // end remote message loop
             } // end remote connection loop
+            for (int i = 0; i < lost.size(); i++) dropRemote(lost[i]);
+
+            // batches waiting on a view that is late past its deadline go out without it
+            if (Constants::RENDER_MODE == ALTERNATE_FRAME) {
+                for (int i = 0; i < sessions.size(); i++) {
+                    if (!sessions[i]->closed) sendReordered(sessions[i]);
+                }
+            }
+
+            // frames sent above made room on the remotes
+            dispatch();
+
+            if (Constants::SESSION_STATS_INTERVAL > 0 && System::time() - last_report >= Constants::SESSION_STATS_INTERVAL) report();
         } // end main loop
     }
 
     void Router::terminate() {
         cout << "Shutting down." << endl;
         broadcast(PacketType::TERMINATE, true);
+        FrameTrace::instance().close();
 
-        if (client != NULL) client->disconnect(false);
+        for (int i = 0; i < sessions.size(); i++) sessions[i]->connection->disconnect(false);
 
         map<uint32, remote_connection_t*>::iterator iter;
         for (iter = remote_connection_registry.begin(); iter != remote_connection_registry.end(); iter++) {
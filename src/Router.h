@@ -1,5 +1,7 @@
 #include <G3D/G3D.h>
 #include "DistributedRenderer.h"
+#include "SceneSnapshot.h"
+#include "Interest.h"
 #include "ImageDist.h"
 #include "TextureDist.h"
 
@@ -22,37 +24,104 @@ using namespace G3D;
  *
  * Upon starting, a server will listen for connections. The server
  * will listen indefinitely until a Client connects, at which point
- * the server will make a deadline for remote nodes to connect, after
+ * the server will make a deadline for remote nodes and more clients
+ * to connect, pushed back by every client that does, after
  * which it will begin when it has at least one remote node. At this
  * point the router will ignore any incoming messages that it has not
- * already registered as a remote or client node.
+ * already registered as a remote or client node. Every HI_AM packet
+ * carries a bitmask of the frame codecs that node supports.
  *
  *
  * CONFIG:
  * 
  * Given valid connections the router will calculate the screen fragments 
  * for each remote node and send a CONFIG packet with that info to each 
- * node respectively. It is up to the remote nodes to respond with a 
+ * node respectively, along with the codec picked for that link. It is up to the remote nodes to respond with a 
  * CONFIG_RECEIPT packet asserting that the nodes successfully started their 
- * applications with the received screen data. The router will 
+ * applications with the received screen data. Remotes render and read back
+ * one throwaway warm-up frame before replying, so shader compilation and
+ * render target allocation are done by the time they count as configured.
+ * The router will 
  * tally the responses, and when all are accounted for, the router
  * signals the client to start by broadcasting a READY packet to 
- * the network, also signalling the remote nodes.
+ * the network, also signalling the remote nodes. The client's READY
+ * carries the codec its frames will be sent in and the table of where
+ * each strip sits in them. With foveation on, strips away from the view
+ * centre are rendered at reduced resolution and quality (CONFIG carries
+ * the scale) and the frame becomes an atlas of differently sized strips,
+ * see Foveation.h.
  *
  *
  * RUNNING:
  *
  * On reception of an UPDATE packet, the router will reroute
- * the packet to all remote nodes. If the current frame build
+ * the packet to all remote nodes, each with the encoder quality its
+ * link's rate controller picked. The client's UPDATE header carries a
+ * receipt for the last frame, which drives the client link's controller
+ * the same way arriving fragments drive each remote's. If the current frame build
  * is not complete, the rotuer will flush it and reset because that
  * frame missed the deadline on the client by now.
  *
  * On reception of a FRAGMENT packet, the router will add it 
  * to the build buffer for the current frame. If this makes the 
- * build buffer is full, the router will send the finished frame
- * to the client as a PNG.
+ * build buffer is full, every fragment is decoded into a persistent
+ * frame, one thread per fragment, and the finished frame is encoded
+ * with the client's codec and sent on. Fragments from temporal codecs
+ * (block delta, motion) are decoded as they come, even late ones, so the
+ * router's copy never falls out of step with the remote's encoder.
  *
- * Coming soon, dynamic rebalancing on node failure
+ * In sort-last mode every remote draws a subset of the entities over the
+ * whole screen and sends its depth ahead of its colour. The router keeps
+ * one layer per remote and, once all have arrived, keeps the nearest
+ * colour at every pixel (direct-send compositing).
+ *
+ * Every UPDATE carries the cameras of the view layout, and every remote
+ * is told which of the views to render: all of them for its own strip or
+ * entities, or, when alternate-frame, the ones dealt to it. FRAGMENTs and
+ * FRAMEs carry a layer per view and each view is composited on its own,
+ * see MultiView.h.
+ *
+ *
+ * LATE JOIN:
+ *
+ * The router keeps a snapshot of every session's entities from the
+ * UPDATEs it sends on, see SceneSnapshot.h. A remote can connect to a
+ * running network, or reconnect after a restart: its HI_AM_REMOTE is
+ * answered with a CONFIG to warm up on, off the remotes' critical path,
+ * and once it sends CONFIG_RECEIPT the router stops dispatching until the
+ * batches out are back. It then splits the screen (or the entities) over
+ * every remote again and sends each its new CONFIG, running remotes
+ * included. The new remote also gets every session's snapshot and READY,
+ * and gets UPDATEs like everyone else from the next batch on. A join costs
+ * at most one batch of waiting, plus a keyframe on every stream.
+ *
+ * A remote whose connection drops is taken out the same way. The batches
+ * it held up are answered with the client's last frame, so no client waits
+ * on a frame that will never come.
+ *
+ * Clients only join before READY. A foveated sort-first frame cannot be
+ * laid out again, so no remote joins one.
+ *
+ *
+ * SESSIONS:
+ *
+ * Up to MAX_CLIENTS clients share the remotes, each in a session of its
+ * own with its own batches, frame, codec and controllers. Remotes keep
+ * every session's entity state and switch the scene over when a batch
+ * of another session comes in, and code each session's strips as a
+ * stream of their own. UPDATEs and FRAGMENTs say which session they are for.
+ *
+ * Client UPDATEs are queued per session and sent on to the remotes by
+ * weighted fair queuing (self-clocked): each gets a virtual finish time of
+ * the session's smoothed time on the remotes over its weight, from
+ * HI_AM_CLIENT, after the later of the session's last one and the last to
+ * go out, and the smallest goes out first whenever fewer than POOL_BATCHES
+ * are out. Every session's frame rate, bandwidth, latency and its split
+ * into queueing and time on the remotes is printed every SESSION_STATS_INTERVAL.
+ *
+ * With interest management on, each remote gets only the records of the
+ * entities that can show up in its rows, and the whole state of one whose
+ * copy missed some once it can, see Interest.h.
  *
  *
  * TERMINATION:
@@ -73,35 +142,190 @@ namespace DistributedRenderer{
 		    TERMINATED
 		};
 
+		// One remote's part in one view of one session. Every session's views are encoded as streams
+		// of their own, temporal codecs need each stream's last frame to code the next one against
+		typedef struct {
+		    // the codec the remote's layers of the view are decoded with, and its layer
+		    // for the session's current batch, not decoded yet
+		    shared_ptr<FrameCodec> codec;
+		    Array<uint8> pending;
+
+		    // row order of the remote's last fragment (FRAME_BOTTOM_UP)
+		    bool bottom_up;
+
+		    // where the strip goes in the view's frame at the session's current scale
+		    Foveation::region_t scaled_region;
+
+		    // a layer of the stream was given up on, the remote's next one has to be a keyframe
+		    bool restart;
+
+		    // sort-last and alternate-frame, this remote's full screen colour, and sort-last only its depth
+		    shared_ptr<Compositor> layer;
+		    Array<float> depth;
+		} stream_t;
+
 		typedef struct {
 		    bool configured;
 		    uint32 id;
 		    uint32 y;
 		    uint32 h;
 		    int frag_loc;
+
+		    // where the strip goes in the frame sent to each client at full
+		    // resolution, and the most quality its tier allows
+		    Foveation::region_t region;
+		    uint8 max_quality;
 		    shared_ptr<NetConnection> connection;
+
+		    // codecs the remote announced and the one picked for it
+		    uint32 codecs;
+		    CodecID codec;
+
+		    // one stream per view of every session, see Router::stream
+		    Array<stream_t> streams;
+
+		    // picks the quality this remote encodes at
+		    RateController rate;
+
+		    // the clock exchange from the remote's last fragment, echoed with the next UPDATE
+		    clock_echo_t clock;
+
+		    // interest management, per session the entities whose copy here missed records
+		    map<uint8, Interest::stale_t> stale;
+
+		    // alternate-frame only, batches dealt to this remote and not back yet, and the
+		    // smoothed time from a batch's UPDATE to its frame
+		    uint32 outstanding;
+		    double service_ms;
 		} remote_connection_t;
 
+		// alternate-frame, one view of a batch dealt to one remote and its layer once that is in
+		typedef struct {
+		    remote_connection_t* remote;
+		    bool arrived;
+		    bool bottom_up;
+		    Array<uint8> body;
+		} afr_view_t;
+
+		// alternate-frame, a batch whose views are out on the remotes
+		typedef struct {
+		    uint32 received_ms;   // when the client's UPDATE came in
+		    uint32 dispatched_ms; // when it went out to the remotes
+		    Array<afr_view_t> views;
+		} afr_batch_t;
+
+		// A client's UPDATE waiting for its turn on the remotes
+		typedef struct {
+		    uint32 batch;
+		    SimTime sim_time; // the client's, the remotes pose animated entities at it
+		    uint32 received_ms;
+		    double finish; // virtual finish time, the smallest goes out first
+		    Array<MultiView::view_t> views;
+		    Array<uint8> body;
+
+		    // interest management, the bounds of the entities with records in the body
+		    float tan_half_fov_y;
+		    Array<Interest::entry_t> interest;
+		} queued_update_t;
+
+		// What a session got out of the remotes since the last report
+		typedef struct {
+		    uint32 frames;
+		    uint64 bytes;
+		    double latency_ms; // UPDATE in to FRAME out, summed
+		    double max_latency_ms;
+		    double queued_ms;  // of that, waiting for the remotes, summed
+		    double pool_ms;    // on the remotes and in the router, summed
+		    uint64 update_bytes;      // UPDATE bodies sent on to the remotes, summed
+		    uint64 full_update_bytes; // and what they would have been without interest management
+		} session_stats_t;
+
+		// One client, its own frame, stream and batches
+		typedef struct {
+		    uint8 id;
+		    uint8 weight;
+		    bool closed;
+		    shared_ptr<NetConnection> connection;
+
+		    // persistent frame of every view that fragments are decoded into, and an
+		    // instance of the codec the client picked for each
+		    Array<shared_ptr<Compositor>> compositor;
+		    uint32 codecs;
+		    Array<shared_ptr<FrameCodec>> codec;
+		    RateController rate;
+		    clock_echo_t clock; // from the last UPDATE, echoed with the next FRAME
+
+		    ResolutionController resolution;
+		    uint8 frame_scale;
+
+		    // the batch on the remotes now, the fragments in for it, and when its UPDATE came in
+		    // and went out. Alternate-frame keeps these per batch in reorder instead
+		    uint32 current_batch;
+		    uint32 pieces;
+		    uint32 received_ms;
+		    uint32 dispatched_ms;
+		    uint32 on_pool;
+
+		    // alternate-frame, batches on their way in batch order, and the frames the client last got
+		    map<uint32, afr_batch_t> reorder;
+		    Array<shared_ptr<CPUPixelTransferBuffer>> last_frames;
+
+		    // every entity as the remotes have been told, for remotes that join later
+		    SceneSnapshot snapshot;
+
+		    // interest management, the latest bounds of every entity the client sent them for
+		    map<EntityTable::NetID, Sphere> bounds;
+
+		    // UPDATEs not sent on yet, the virtual finish time of the last one queued
+		    // and the smoothed time a batch takes once it has gone out
+		    Array<queued_update_t> queue;
+		    double last_finish;
+		    double service_ms;
+
+		    session_stats_t stats;
+		} session_t;
+
 		class Router{
 			private:
 				RouterState router_state;
 
 				shared_ptr<NetServer> server;
-				shared_ptr<NetConnection> client;
 
-				uint32 current_batch;
-				uint32 pieces;
-				Array<shared_ptr<ImageDist>> fragments;
+				// every client, by session id, and the virtual time of the fair queue
+				Array<session_t*> sessions;
+				double virtual_time;
+				RealTime last_report;
 
-				uint32 last_received_update = 0;
+				// where dealing goes on from when alternate-frame
+				int next_dealt;
+
+				// sort-last, decompresses the depth ahead of every remote's layer
+				DepthPlane depth_plane;
+
+				// every region of the frame as sent with READY
+				Array<Foveation::region_t> regions;
 
 				// this registry will track remote connections, addressable with IP addresses
 				map<uint32, remote_connection_t*> remote_connection_registry;
 
+				// once running, connections that have not introduced themselves, remotes warming up
+				// to join, and whether the remotes are to be laid out again between two batches
+				list<shared_ptr<NetConnection>> connecting;
+				map<uint32, remote_connection_t*> joining;
+				bool relayout_pending;
+
+				// a frame block of the update being filtered, and which of its entities go to the remote at hand
+				TransformBlock block;
+				Array<uint32> which;
+
 				// setup
-				void addClient(shared_ptr<NetConnection> conn);
-				void addRemote(shared_ptr<NetConnection> conn);
-				void removeRemote(NetAddress& addr);
+				void addClient(shared_ptr<NetConnection> conn, uint32 codecs, uint8 weight);
+				remote_connection_t* addRemote(shared_ptr<NetConnection> conn, uint32 codecs, map<uint32, remote_connection_t*>& registry);
+				void dropRemote(remote_connection_t* cv);
+				void acceptRemotes();
+				void relayout();
+				void sendConfig(remote_connection_t* cv, uint32 count);
+				uint32 layout(uint32& atlas_width);
 
 				void setState(RouterState s) { router_state = s; }
 
@@ -117,12 +341,31 @@ namespace DistributedRenderer{
 				void registration();
 				void configuration();
 
+				// scheduling
+				void queueUpdate(session_t* session, BinaryInput* header, BinaryInput* body);
+				void dispatch();
+				uint32 poolCapacity();
+				uint32 batchesOnPool();
+				void report();
+
+				// the remote's stream of one view of a session
+				stream_t& stream(remote_connection_t* conn_vars, uint8 session, int view) { return conn_vars->streams[session * numViews() + view]; }
+
 				// packet handlers
-				void rerouteUpdate(BinaryInput* header, BinaryInput* body);
+				void rerouteUpdate(session_t* session, const queued_update_t& update);
+				void filterUpdate(session_t* session, remote_connection_t* conn_vars, const queued_update_t& update, const map<EntityTable::NetID, Sphere>& before, BinaryOutput& out);
 				void handleFragment(remote_connection_t* conn_vars, BinaryInput* header, BinaryInput* body);
+				bool decodeFragment(session_t* session, remote_connection_t* conn_vars, int view, BinaryInput& body);
+				void setFrameScale(session_t* session, uint8 percent);
+				void sendFrame(session_t* session, uint32 batch, const Array<shared_ptr<CPUPixelTransferBuffer>>& frames, uint32 received_ms, uint32 dispatched_ms);
+				remote_connection_t* pickRemote();
+				void queueFrame(session_t* session, remote_connection_t* conn_vars, const frame_header_t& fh, const Array<MultiView::layer_t>& layers, BinaryInput& header, BinaryInput& body);
+				void sendReordered(session_t* session);
 
 			public:
-				Router() : pieces(0), current_batch(1000), router_state(OFFLINE) {
+				Router() : router_state(OFFLINE), virtual_time(0), last_report(0), next_dealt(0), relayout_pending(false) {
+					FramePool::instance().setHugePages(Constants::USE_HUGE_PAGES);
+					FrameTrace::instance().open(Constants::TRACE_DIR, "router");
 					cout << "Router started up" << endl;
 				}
 
@@ -133,6 +376,8 @@ namespace DistributedRenderer{
 				// accessors
 				RouterState getState() { return router_state; }
 				uint32 numRemotes() { return remote_connection_registry.size();}
+				uint32 numSessions() { return sessions.size(); }
+				int numViews() { return MultiView::count(Constants::VIEW_LAYOUT); }
 		};
 	}
-}
\ No newline at end of file
+}
@@ -0,0 +1,240 @@
+#pragma once
+#include <G3D/G3D.h>
+#include <map>
+#include "DistributedRenderer.h"
+
+/* =========================================
+ *              Scene Snapshot
+ * =========================================
+ *
+ * The router's record of one session's entities, kept from the UPDATEs it
+ * sends on: the last frame and properties of every entity the client ever
+ * changed, and the name, spec and frame of every entity it spawned and has
+ * not despawned. Entities that never changed are as the scene file put them
+ * on every node and are left out.
+ *
+ * A remote that joins a running cluster gets every session's snapshot
+ * before its READY, then the same UPDATEs as everyone else, so it is in
+ * step from its first batch. On the wire a snapshot is
+ *
+ *     count, then per entity by ascending ID:
+ *         ID delta (varint), flags, [name, spec,] [frame,] [properties]
+ *
+ * The frame is kept as the floats it last arrived in, x, y, z, yaw, pitch,
+ * roll from an ENTITY_FRAME or ENTITY_SPAWN record, or the translation and
+ * quaternion from a frame block, and goes back out in the same record. The
+ * remote that joins decodes exactly what every other remote decoded, where
+ * rounding the rotation to fewer bits would leave it a little off from its
+ * neighbours in every entity that stands still, seams along the strips.
+ * Properties other than the frame go as PropertyReplication writes them,
+ * every one the client ever sent with its latest value.
+ *
+ * The remote expands a snapshot back into UPDATE records, the block frames
+ * in one frame block after the rest, and syncs them like any other batch.
+ */
+
+namespace DistributedRenderer {
+
+    class SceneSnapshot {
+        private:
+            enum {
+                SPAWNED     = 1 << 0,
+                HAS_FRAME   = 1 << 1,
+                PROPERTIES  = 1 << 2,
+                BLOCK_FRAME = 1 << 3  // the frame is a block's translation and quaternion
+            };
+
+            // the most floats a frame arrives in, a block's
+            static const int FRAME_FLOATS = TransformBlock::WIRE_FIELDS;
+            static const int YPR_FLOATS = 6;
+
+            typedef struct {
+                PropertyReplication::state_t state; // the frame and whatever else was sent
+                PropertyReplication::mask_t sent;   // which of it
+                bool spawned;
+                bool block_frame;                   // which record wire came in
+                float wire[FRAME_FLOATS];           // the frame as it came
+                String name;
+                String spec;
+            } entry_t;
+
+            std::map<EntityTable::NetID, entry_t> entries;
+
+            static void writeVarint(BinaryOutput& bo, uint32 v) {
+                while (v >= 0x80) {
+                    bo.writeUInt8((uint8)(v | 0x80));
+                    v >>= 7;
+                }
+                bo.writeUInt8((uint8)v);
+            }
+
+            static uint32 readVarint(BinaryInput& in) {
+                uint32 v = 0;
+                for (int shift = 0; shift < 35; shift += 7) {
+                    const uint8 b = in.readUInt8();
+                    v |= (uint32)(b & 0x7F) << shift;
+                    if (!(b & 0x80)) break;
+                }
+                return v;
+            }
+
+            // @post: e holds the x, y, z, yaw, pitch, roll of an ENTITY_FRAME or ENTITY_SPAWN record, and the frame they make
+            static void readYPR(BinaryInput& in, entry_t& e) {
+                for (int i = 0; i < YPR_FLOATS; i++) e.wire[i] = in.readFloat32();
+                e.block_frame = false;
+                e.state.frame = CoordinateFrame::fromXYZYPRRadians(e.wire[0], e.wire[1], e.wire[2], e.wire[3], e.wire[4], e.wire[5]);
+                e.sent |= PropertyReplication::FRAME;
+            }
+
+            static CoordinateFrame fromBlock(const float wire[FRAME_FLOATS]) {
+                return CoordinateFrame(Quat(wire[TransformBlock::QX], wire[TransformBlock::QY], wire[TransformBlock::QZ], wire[TransformBlock::QW]).toRotationMatrix(),
+                    Vector3(wire[TransformBlock::TX], wire[TransformBlock::TY], wire[TransformBlock::TZ]));
+            }
+
+        public:
+            void clear() { entries.clear(); }
+
+            int size() const { return (int)entries.size(); }
+
+            // @pre: the records of an UPDATE body, see UpdateRecord
+            // @post: the snapshot holds what they did
+            // @return: false at a record it does not know, the rest of the body is skipped
+            bool apply(BinaryInput& body) {
+                while (body.hasMore()) {
+                    const uint8 kind = body.readUInt8();
+                    const EntityTable::NetID id = body.readUInt32();
+                    switch (kind) {
+                        case ENTITY_FRAME:
+                            readYPR(body, entries[id]);
+                            break;
+                        case ENTITY_SPAWN: {
+                            // the slot may have held an entity before, none of its properties carry over
+                            entry_t& e = entries[id] = entry_t();
+                            e.spawned = true;
+                            e.name = body.readString();
+                            e.spec = body.readString();
+                            readYPR(body, e);
+                            break;
+                        }
+                        case ENTITY_PROPERTIES: {
+                            entry_t& e = entries[id];
+                            e.sent |= PropertyReplication::read(body, e.state);
+                            break;
+                        }
+                        case ENTITY_FRAME_BLOCK: {
+                            TransformBlock block;
+                            if (!block.read(body, id)) return false;
+                            for (uint32 i = 0; i < block.size(); i++) {
+                                entry_t& e = entries[block.id(i)];
+                                for (int f = 0; f < FRAME_FLOATS; f++) e.wire[f] = block.field((TransformBlock::Field)f)[i];
+                                e.block_frame = true;
+                                e.state.frame = block.frameFromQuat(i);
+                                e.sent |= PropertyReplication::FRAME;
+                            }
+                            break;
+                        }
+                        case ENTITY_DESPAWN:
+                            entries.erase(id);
+                            break;
+                        default:
+                            return false;
+                    }
+                }
+                return true;
+            }
+
+            // @post: records holds an ENTITY_PROPERTIES record of everything the snapshot has of the entity,
+            // for a remote whose copy of it missed records, see Interest
+            // @return: false if it has nothing, the entity is as the scene file put it
+            bool catchUp(EntityTable::NetID id, BinaryOutput& records) const {
+                std::map<EntityTable::NetID, entry_t>::const_iterator it = entries.find(id);
+                if (it == entries.end()) return false;
+
+                records.writeUInt8(ENTITY_PROPERTIES);
+                records.writeUInt32(id);
+                PropertyReplication::write(records, it->second.state, it->second.sent);
+                return true;
+            }
+
+            void write(BinaryOutput& bo) const {
+                writeVarint(bo, (uint32)entries.size());
+                EntityTable::NetID last = 0;
+                for (std::map<EntityTable::NetID, entry_t>::const_iterator it = entries.begin(); it != entries.end(); it++) {
+                    const entry_t& e = it->second;
+                    writeVarint(bo, it->first - last);
+                    last = it->first;
+
+                    const bool has_frame = e.spawned || (e.sent & PropertyReplication::FRAME);
+                    const PropertyReplication::mask_t properties = e.sent & ~PropertyReplication::FRAME;
+
+                    bo.writeUInt8((e.spawned ? SPAWNED : 0) | (has_frame ? HAS_FRAME : 0) | (properties != 0 ? PROPERTIES : 0) |
+                        ((has_frame && e.block_frame) ? BLOCK_FRAME : 0));
+                    if (e.spawned) {
+                        bo.writeString(e.name);
+                        bo.writeString(e.spec);
+                    }
+                    if (has_frame) {
+                        const int count = e.block_frame ? FRAME_FLOATS : YPR_FLOATS;
+                        for (int i = 0; i < count; i++) bo.writeFloat32(e.wire[i]);
+                    }
+                    if (properties != 0) PropertyReplication::write(bo, e.state, properties);
+                }
+            }
+
+            // @pre: a snapshot as write put it
+            // @post: records holds it as UPDATE records, spawns, frames and properties, in ID order, then
+            // a frame block of every frame that came in one
+            static void toRecords(BinaryInput& in, BinaryOutput& records) {
+                TransformBlock block;
+                const uint32 n = readVarint(in);
+                EntityTable::NetID id = 0;
+                for (uint32 i = 0; i < n; i++) {
+                    id += readVarint(in);
+                    const uint8 flags = in.readUInt8();
+                    const bool spawned = (flags & SPAWNED) != 0;
+
+                    String name, spec;
+                    if (spawned) {
+                        name = in.readString();
+                        spec = in.readString();
+                    }
+                    if (flags & HAS_FRAME) {
+                        const bool block_frame = (flags & BLOCK_FRAME) != 0;
+                        float wire[FRAME_FLOATS];
+                        for (int f = 0; f < (block_frame ? FRAME_FLOATS : YPR_FLOATS); f++) wire[f] = in.readFloat32();
+
+                        if (spawned) {
+                            // a spawn needs a frame of its own, the block after it puts back the exact one
+                            records.writeUInt8(ENTITY_SPAWN);
+                            records.writeUInt32(id);
+                            records.writeString(name);
+                            records.writeString(spec);
+                            if (block_frame) {
+                                BinaryUtils::writeEntityFrame(records, fromBlock(wire));
+                            } else {
+                                for (int f = 0; f < YPR_FLOATS; f++) records.writeFloat32(wire[f]);
+                            }
+                        } else if (!block_frame) {
+                            records.writeUInt8(ENTITY_FRAME);
+                            records.writeUInt32(id);
+                            for (int f = 0; f < YPR_FLOATS; f++) records.writeFloat32(wire[f]);
+                        }
+                        if (block_frame) block.append(id, wire);
+                    }
+                    if (flags & PROPERTIES) {
+                        PropertyReplication::state_t state = PropertyReplication::state_t();
+                        const PropertyReplication::mask_t mask = PropertyReplication::read(in, state);
+                        records.writeUInt8(ENTITY_PROPERTIES);
+                        records.writeUInt32(id);
+                        PropertyReplication::write(records, state, mask);
+                    }
+                }
+
+                if (block.size() > 0) {
+                    records.writeUInt8(ENTITY_FRAME_BLOCK);
+                    records.writeUInt32(block.size());
+                    block.write(records);
+                }
+            }
+    };
+}
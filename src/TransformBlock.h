@@ -0,0 +1,178 @@
+#pragma once
+#include <G3D/G3D.h>
+#include <emmintrin.h>
+
+/* =========================================
+ *              Transform Block
+ * =========================================
+ *
+ * Every frame an UPDATE carries, as one record laid out as arrays rather
+ * than one record per entity:
+ *
+ *     count, NetID[count], tx[count], ty[count], tz[count],
+ *     qx[count], qy[count], qz[count], qw[count]
+ *
+ * with the rotation as its unit quaternion, so decoding is a copy of each
+ * array into an aligned table and a rotation matrix from every quaternion,
+ * four at a time with SSE2 and no trig. The arrays are copied as they are,
+ * little endian like the rest of the wire, which every host this runs on is.
+ *
+ * The table keeps the quaternions next to the matrices, so the router can
+ * pass any subset of a block on without a round trip through matrices.
+ * Remotes apply the frames across cores, see Remote::applyFrames.
+ */
+
+namespace DistributedRenderer {
+
+    class TransformBlock {
+        public:
+            enum Field {
+                TX, TY, TZ, QX, QY, QZ, QW, // on the wire, in this order
+                M00, M01, M02, M10, M11, M12, M20, M21, M22,
+                NUM_FIELDS
+            };
+
+            static const int WIRE_FIELDS = QW + 1;
+
+            // bytes a block of n takes after its record header
+            static size_t wireBytes(uint32 n) { return (size_t)n * (sizeof(uint32) + WIRE_FIELDS * sizeof(float)); }
+
+        private:
+            uint32 n = 0;
+            uint32 capacity = 0;
+            void* memory = nullptr;
+            uint32* ids = nullptr;
+            float* fields[NUM_FIELDS];
+
+            // owns its table, never copied
+            TransformBlock(const TransformBlock&);
+            TransformBlock& operator=(const TransformBlock&);
+
+            // @post: the table holds at least count entities, every array 16 byte aligned and a multiple of four long
+            void reserve(uint32 count) {
+                if (count <= capacity) return;
+                const uint32 c = (G3D::max(count, capacity * 2) + 3) & ~3u;
+                void* m = System::alignedMalloc((size_t)c * (sizeof(uint32) + NUM_FIELDS * sizeof(float)), 16);
+
+                uint32* new_ids = (uint32*)m;
+                float* base = (float*)(new_ids + c);
+                if (n > 0) memcpy(new_ids, ids, n * sizeof(uint32));
+                for (int f = 0; f < NUM_FIELDS; f++) {
+                    if (n > 0) memcpy(base + (size_t)f * c, fields[f], n * sizeof(float));
+                    fields[f] = base + (size_t)f * c;
+                }
+
+                if (notNull(memory)) System::alignedFree(memory);
+                memory = m;
+                ids = new_ids;
+                capacity = c;
+            }
+
+        public:
+            TransformBlock() {
+                for (int f = 0; f < NUM_FIELDS; f++) fields[f] = nullptr;
+            }
+
+            ~TransformBlock() { if (notNull(memory)) System::alignedFree(memory); }
+
+            uint32 size() const { return n; }
+            void clear() { n = 0; }
+
+            uint32 id(uint32 i) const { return ids[i]; }
+            const float* field(Field f) const { return fields[f]; }
+
+            // the client's side, one entity's frame at a time
+            void append(uint32 id, const CoordinateFrame& frame) {
+                reserve(n + 1);
+                const Quat q = Quat(frame.rotation).toUnit();
+                ids[n] = id;
+                fields[TX][n] = frame.translation.x;
+                fields[TY][n] = frame.translation.y;
+                fields[TZ][n] = frame.translation.z;
+                fields[QX][n] = q.x;
+                fields[QY][n] = q.y;
+                fields[QZ][n] = q.z;
+                fields[QW][n] = q.w;
+                ++n;
+            }
+
+            // @pre: wire holds an entity's fields as a block carried them, TX to QW
+            // @post: the entity goes out exactly as it came in, see SceneSnapshot
+            void append(uint32 id, const float wire[WIRE_FIELDS]) {
+                reserve(n + 1);
+                ids[n] = id;
+                for (int f = 0; f < WIRE_FIELDS; f++) fields[f][n] = wire[f];
+                ++n;
+            }
+
+            // @post: bo holds the entities at which, in that order, or every one, after the record header
+            void write(BinaryOutput& bo, const Array<uint32>* which = nullptr) const {
+                if (isNull(which)) {
+                    bo.writeBytes(ids, n * sizeof(uint32));
+                    for (int f = 0; f < WIRE_FIELDS; f++) bo.writeBytes(fields[f], n * sizeof(float));
+                    return;
+                }
+                for (int i = 0; i < which->size(); i++) bo.writeUInt32(ids[(*which)[i]]);
+                for (int f = 0; f < WIRE_FIELDS; f++) {
+                    for (int i = 0; i < which->size(); i++) bo.writeFloat32(fields[f][(*which)[i]]);
+                }
+            }
+
+            // @pre: in is past the record header of a block of count
+            // @post: the table holds it and in is past it, the matrices are not computed yet
+            // @return: false if in ends first
+            bool read(BinaryInput& in, uint32 count) {
+                n = 0;
+                if ((size_t)(in.getLength() - in.getPosition()) < wireBytes(count)) return false;
+                reserve(count);
+                in.readBytes(ids, count * sizeof(uint32));
+                for (int f = 0; f < WIRE_FIELDS; f++) in.readBytes(fields[f], count * sizeof(float));
+                n = count;
+                return true;
+            }
+
+            static void skip(BinaryInput& in, uint32 count) { in.skip(wireBytes(count)); }
+
+            // @post: every entity's rotation matrix is computed from its quaternion
+            void toMatrices() {
+                // the tail of the last four is whatever was there, its matrices are never read
+                const __m128 one = _mm_set1_ps(1.0f);
+                const __m128 two = _mm_set1_ps(2.0f);
+                for (uint32 i = 0; i < n; i += 4) {
+                    const __m128 x = _mm_load_ps(fields[QX] + i);
+                    const __m128 y = _mm_load_ps(fields[QY] + i);
+                    const __m128 z = _mm_load_ps(fields[QZ] + i);
+                    const __m128 w = _mm_load_ps(fields[QW] + i);
+
+                    const __m128 xx = _mm_mul_ps(x, x), yy = _mm_mul_ps(y, y), zz = _mm_mul_ps(z, z);
+                    const __m128 xy = _mm_mul_ps(x, y), xz = _mm_mul_ps(x, z), yz = _mm_mul_ps(y, z);
+                    const __m128 wx = _mm_mul_ps(w, x), wy = _mm_mul_ps(w, y), wz = _mm_mul_ps(w, z);
+
+                    _mm_store_ps(fields[M00] + i, _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(yy, zz))));
+                    _mm_store_ps(fields[M01] + i, _mm_mul_ps(two, _mm_sub_ps(xy, wz)));
+                    _mm_store_ps(fields[M02] + i, _mm_mul_ps(two, _mm_add_ps(xz, wy)));
+                    _mm_store_ps(fields[M10] + i, _mm_mul_ps(two, _mm_add_ps(xy, wz)));
+                    _mm_store_ps(fields[M11] + i, _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, zz))));
+                    _mm_store_ps(fields[M12] + i, _mm_mul_ps(two, _mm_sub_ps(yz, wx)));
+                    _mm_store_ps(fields[M20] + i, _mm_mul_ps(two, _mm_sub_ps(xz, wy)));
+                    _mm_store_ps(fields[M21] + i, _mm_mul_ps(two, _mm_add_ps(yz, wx)));
+                    _mm_store_ps(fields[M22] + i, _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, yy))));
+                }
+            }
+
+            // @pre: toMatrices since the last read
+            CoordinateFrame frame(uint32 i) const {
+                return CoordinateFrame(
+                    Matrix3(fields[M00][i], fields[M01][i], fields[M02][i],
+                            fields[M10][i], fields[M11][i], fields[M12][i],
+                            fields[M20][i], fields[M21][i], fields[M22][i]),
+                    Vector3(fields[TX][i], fields[TY][i], fields[TZ][i]));
+            }
+
+            // without the matrices, for the router
+            CoordinateFrame frameFromQuat(uint32 i) const {
+                return CoordinateFrame(Quat(fields[QX][i], fields[QY][i], fields[QZ][i], fields[QW][i]).toRotationMatrix(),
+                    Vector3(fields[TX][i], fields[TY][i], fields[TZ][i]));
+            }
+    };
+}